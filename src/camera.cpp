@@ -22,11 +22,240 @@
  *
  */
 
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
 #include "camera.h"
 
+// Vectorized projection kernels are compiled for x86 only. The SSE one is
+// built for the baseline the compiler targets, and the AVX one has its own
+// target attribute, so the rest of the code does not depend on -mavx
+#if defined(__GNUC__) && defined(__SSE2__)
+#define CAMERA_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// Kernels are instantiated once per camera model, so the model is resolved when the
+// camera picks its kernel and never inside the loops. Every kernel of a model does the
+// same operations in the same order (no fused multiply-adds), so all of them give the
+// same results as the scalar one. Distorted projections go through normalized camera
+// coordinates:
+//   (x, y, z) = R (v - C),  n = (x/z, y/z),  d = 1 + k1 r^2 + k2 r^4,  uv ~ K [d n; 1]
+// where r^2 is clamped to the range in which the distortion is monotonic. Fisheyes
+// distort the angle a = atan(r) instead: uv ~ K [a d(a) n / r; 1]
+template <CameraModel MODEL>
+static inline void projectPoint(const CameraProjection& _p, const float* _xyz, float* _uv, float* _depth){
+    const float x = _xyz[0] - _p.c[0];
+    const float y = _xyz[1] - _p.c[1];
+    const float z = _xyz[2] - _p.c[2];
+    float u, v, w, depth;
+    if (MODEL == FISHEYE){
+        const float cx = _p.r[0] * x + _p.r[1] * y + _p.r[2] * z;
+        const float cy = _p.r[3] * x + _p.r[4] * y + _p.r[5] * z;
+        const float cz = _p.r[6] * x + _p.r[7] * y + _p.r[8] * z;
+        const float rc = std::sqrt(cx * cx + cy * cy);
+        const float a = std::atan2(rc, cz);
+        float a2 = a * a;
+        a2 = a2 < _p.maxR2 ? a2 : _p.maxR2;
+        const float s = rc > 0.0f ? a * (1.0f + a2 * (_p.k1 + _p.k2 * a2)) / rc : 0.0f;
+        const float dx = s * cx;
+        const float dy = s * cy;
+        u = _p.k[0] * dx + _p.k[1] * dy + _p.k[2];
+        v = _p.k[3] * dx + _p.k[4] * dy + _p.k[5];
+        w = _p.k[6] * dx + _p.k[7] * dy + _p.k[8];
+        depth = cz;
+    } else if (MODEL == RADIAL){
+        const float cx = _p.r[0] * x + _p.r[1] * y + _p.r[2] * z;
+        const float cy = _p.r[3] * x + _p.r[4] * y + _p.r[5] * z;
+        const float cz = _p.r[6] * x + _p.r[7] * y + _p.r[8] * z;
+        const float iz = 1.0f / cz;
+        const float nx = cx * iz;
+        const float ny = cy * iz;
+        float r2 = nx * nx + ny * ny;
+        r2 = r2 < _p.maxR2 ? r2 : _p.maxR2;
+        const float d = 1.0f + r2 * (_p.k1 + _p.k2 * r2);
+        const float dx = d * nx;
+        const float dy = d * ny;
+        u = _p.k[0] * dx + _p.k[1] * dy + _p.k[2];
+        v = _p.k[3] * dx + _p.k[4] * dy + _p.k[5];
+        w = _p.k[6] * dx + _p.k[7] * dy + _p.k[8];
+        depth = cz;
+    } else {
+        u = _p.kr[0] * x + _p.kr[1] * y + _p.kr[2] * z;
+        v = _p.kr[3] * x + _p.kr[4] * y + _p.kr[5] * z;
+        w = _p.kr[6] * x + _p.kr[7] * y + _p.kr[8] * z;
+        depth = w;
+    }
+    _uv[0] = u / w;
+    _uv[1] = v / w;
+    if (_depth != NULL){
+        *_depth = depth;
+    }
+}
+
+template <CameraModel MODEL>
+static void projectScalar(const CameraProjection& _p, const float* _xyz, size_t _n, float* _uv, float* _depth){
+    for (size_t i = 0; i < _n; i++){
+        projectPoint<MODEL>(_p, _xyz + 3 * i, _uv + 2 * i, _depth != NULL ? _depth + i : NULL);
+    }
+}
+
+#ifdef CAMERA_X86_KERNELS
+
+// Splits 4 consecutive (x, y, z) triplets into one register per coordinate
+static inline void deinterleave4(const float* _xyz, __m128& _x, __m128& _y, __m128& _z){
+    const __m128 a = _mm_loadu_ps(_xyz);     // x0 y0 z0 x1
+    const __m128 b = _mm_loadu_ps(_xyz + 4); // y1 z1 x2 y2
+    const __m128 c = _mm_loadu_ps(_xyz + 8); // z2 x3 y3 z3
+    _x = _mm_shuffle_ps(a, _mm_shuffle_ps(b, c, _MM_SHUFFLE(1,0,3,2)), _MM_SHUFFLE(3,0,3,0));
+    _y = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(0,0,1,1)), _mm_shuffle_ps(b, c, _MM_SHUFFLE(2,2,3,3)), _MM_SHUFFLE(2,0,2,0));
+    _z = _mm_shuffle_ps(_mm_shuffle_ps(a, b, _MM_SHUFFLE(1,1,2,2)), _mm_shuffle_ps(c, c, _MM_SHUFFLE(3,3,0,0)), _MM_SHUFFLE(2,0,2,0));
+}
+
+// Row _i of a 3x3 matrix (row-major) times (_x, _y, _z)
+static inline __m128 dotRow(const __m128* _m, unsigned int _i, __m128 _x, __m128 _y, __m128 _z){
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_m[3 * _i], _x), _mm_mul_ps(_m[3 * _i + 1], _y)), _mm_mul_ps(_m[3 * _i + 2], _z));
+}
+
+template <CameraModel MODEL>
+static void projectSSE(const CameraProjection& _p, const float* _xyz, size_t _n, float* _uv, float* _depth){
+
+    __m128 kr[9], r[9], k[9];
+    for (unsigned int j = 0; j < 9; j++){
+        kr[j] = _mm_set1_ps(_p.kr[j]);
+        r[j] = _mm_set1_ps(_p.r[j]);
+        k[j] = _mm_set1_ps(_p.k[j]);
+    }
+    const __m128 cx = _mm_set1_ps(_p.c[0]), cy = _mm_set1_ps(_p.c[1]), cz = _mm_set1_ps(_p.c[2]);
+    const __m128 one = _mm_set1_ps(1.0f), k1 = _mm_set1_ps(_p.k1), k2 = _mm_set1_ps(_p.k2), maxR2 = _mm_set1_ps(_p.maxR2);
+
+    size_t i = 0;
+    for (; i + 4 <= _n; i += 4){
+        __m128 x, y, z, u, v, w, depth;
+        deinterleave4(_xyz + 3 * i, x, y, z);
+        x = _mm_sub_ps(x, cx);
+        y = _mm_sub_ps(y, cy);
+        z = _mm_sub_ps(z, cz);
+        if (MODEL == RADIAL){
+            const __m128 camz = dotRow(r, 2, x, y, z);
+            const __m128 iz = _mm_div_ps(one, camz);
+            const __m128 nx = _mm_mul_ps(dotRow(r, 0, x, y, z), iz);
+            const __m128 ny = _mm_mul_ps(dotRow(r, 1, x, y, z), iz);
+            const __m128 r2 = _mm_min_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), maxR2);
+            const __m128 d = _mm_add_ps(one, _mm_mul_ps(r2, _mm_add_ps(k1, _mm_mul_ps(k2, r2))));
+            const __m128 dx = _mm_mul_ps(d, nx);
+            const __m128 dy = _mm_mul_ps(d, ny);
+            u = dotRow(k, 0, dx, dy, one);
+            v = dotRow(k, 1, dx, dy, one);
+            w = dotRow(k, 2, dx, dy, one);
+            depth = camz;
+        } else {
+            u = dotRow(kr, 0, x, y, z);
+            v = dotRow(kr, 1, x, y, z);
+            w = dotRow(kr, 2, x, y, z);
+            depth = w;
+        }
+        const __m128 s = _mm_div_ps(u, w);
+        const __m128 t = _mm_div_ps(v, w);
+        _mm_storeu_ps(_uv + 2 * i, _mm_unpacklo_ps(s, t));
+        _mm_storeu_ps(_uv + 2 * i + 4, _mm_unpackhi_ps(s, t));
+        if (_depth != NULL){
+            _mm_storeu_ps(_depth + i, depth);
+        }
+    }
+
+    projectScalar<MODEL>(_p, _xyz + 3 * i, _n - i, _uv + 2 * i, _depth != NULL ? _depth + i : NULL);
+}
+
+__attribute__((target("avx")))
+static inline __m256 dotRow(const __m256* _m, unsigned int _i, __m256 _x, __m256 _y, __m256 _z){
+    return _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_m[3 * _i], _x), _mm256_mul_ps(_m[3 * _i + 1], _y)), _mm256_mul_ps(_m[3 * _i + 2], _z));
+}
+
+template <CameraModel MODEL>
+__attribute__((target("avx")))
+static void projectAVX(const CameraProjection& _p, const float* _xyz, size_t _n, float* _uv, float* _depth){
+
+    __m256 kr[9], r[9], k[9];
+    for (unsigned int j = 0; j < 9; j++){
+        kr[j] = _mm256_set1_ps(_p.kr[j]);
+        r[j] = _mm256_set1_ps(_p.r[j]);
+        k[j] = _mm256_set1_ps(_p.k[j]);
+    }
+    const __m256 cx = _mm256_set1_ps(_p.c[0]), cy = _mm256_set1_ps(_p.c[1]), cz = _mm256_set1_ps(_p.c[2]);
+    const __m256 one = _mm256_set1_ps(1.0f), k1 = _mm256_set1_ps(_p.k1), k2 = _mm256_set1_ps(_p.k2), maxR2 = _mm256_set1_ps(_p.maxR2);
+
+    size_t i = 0;
+    for (; i + 8 <= _n; i += 8){
+        __m128 x0, y0, z0, x1, y1, z1;
+        deinterleave4(_xyz + 3 * i, x0, y0, z0);
+        deinterleave4(_xyz + 3 * i + 12, x1, y1, z1);
+        const __m256 x = _mm256_sub_ps(_mm256_insertf128_ps(_mm256_castps128_ps256(x0), x1, 1), cx);
+        const __m256 y = _mm256_sub_ps(_mm256_insertf128_ps(_mm256_castps128_ps256(y0), y1, 1), cy);
+        const __m256 z = _mm256_sub_ps(_mm256_insertf128_ps(_mm256_castps128_ps256(z0), z1, 1), cz);
+        __m256 u, v, w, depth;
+        if (MODEL == RADIAL){
+            const __m256 camz = dotRow(r, 2, x, y, z);
+            const __m256 iz = _mm256_div_ps(one, camz);
+            const __m256 nx = _mm256_mul_ps(dotRow(r, 0, x, y, z), iz);
+            const __m256 ny = _mm256_mul_ps(dotRow(r, 1, x, y, z), iz);
+            const __m256 r2 = _mm256_min_ps(_mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)), maxR2);
+            const __m256 d = _mm256_add_ps(one, _mm256_mul_ps(r2, _mm256_add_ps(k1, _mm256_mul_ps(k2, r2))));
+            const __m256 dx = _mm256_mul_ps(d, nx);
+            const __m256 dy = _mm256_mul_ps(d, ny);
+            u = dotRow(k, 0, dx, dy, one);
+            v = dotRow(k, 1, dx, dy, one);
+            w = dotRow(k, 2, dx, dy, one);
+            depth = camz;
+        } else {
+            u = dotRow(kr, 0, x, y, z);
+            v = dotRow(kr, 1, x, y, z);
+            w = dotRow(kr, 2, x, y, z);
+            depth = w;
+        }
+        const __m256 s = _mm256_div_ps(u, w);
+        const __m256 t = _mm256_div_ps(v, w);
+        // Unpacking works within each 128-bit half, so halves are swapped back in place
+        const __m256 lo = _mm256_unpacklo_ps(s, t);
+        const __m256 hi = _mm256_unpackhi_ps(s, t);
+        _mm256_storeu_ps(_uv + 2 * i, _mm256_permute2f128_ps(lo, hi, 0x20));
+        _mm256_storeu_ps(_uv + 2 * i + 8, _mm256_permute2f128_ps(lo, hi, 0x31));
+        if (_depth != NULL){
+            _mm256_storeu_ps(_depth + i, depth);
+        }
+    }
+
+    projectSSE<MODEL>(_p, _xyz + 3 * i, _n - i, _uv + 2 * i, _depth != NULL ? _depth + i : NULL);
+}
+
+#endif
+
+// The kernels of each model are chosen once, depending on what the CPU supports.
+// There are no vector instructions for atan, so fisheyes use the scalar kernel
+static ProjectKernel selectProjectKernel(CameraModel _model){
+    if (_model == FISHEYE){
+        return projectScalar<FISHEYE>;
+    }
+#ifdef CAMERA_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx")){
+        return _model == RADIAL ? projectAVX<RADIAL> : projectAVX<PINHOLE>;
+    }
+    return _model == RADIAL ? projectSSE<RADIAL> : projectSSE<PINHOLE>;
+#else
+    return _model == RADIAL ? projectScalar<RADIAL> : projectScalar<PINHOLE>;
+#endif
+}
+
 Camera::Camera(){
     imWidth_ = imHeight_ = 0;
     k1_ = k2_ = 0.0; // If not distortion is specified, then it's set to 0
+    fisheye_ = false;
+    K_.setIdentity();
+    R_.setIdentity();
+    position_.setZero();
+    updateProjection();
 }
 
 Camera::~Camera(){
@@ -60,14 +289,19 @@ void Camera::loadCameraParameters(const std::string &_textline){
     line >> imWidth_ >> imHeight_;
 
 
-    // Distortion parameters (they are optional)
+    // Distortion parameters (they are optional), and then the lens model
     if (!line.eof()){
         line >> k1_ >> k2_;
     }
+    std::string model;
+    if (line >> model){
+        fisheye_ = model.compare("fisheye") == 0 || model.compare("FISHEYE") == 0;
+    }
 
+    updateProjection();
 }
 
-void Camera::loadBundlerCameraParameters(std::ifstream& _stream, const std::string& _imageName){
+void Camera::loadBundlerCameraParameters(std::ifstream& _stream, const Vector2i& _imageDim){
 
     std::string line;
     float focal;
@@ -113,23 +347,20 @@ void Camera::loadBundlerCameraParameters(std::ifstream& _stream, const std::stri
     position_ = -R_.transpose() * t;
     setPosition(t);
 
-    if (!loadImageDimensions(_imageName)){
-        std::cerr << "Unable get " << _imageName << " dimensions!" << std::endl;
-        exit(-1);
-    }
+    imWidth_ = _imageDim(0);
+    imHeight_ = _imageDim(1);
 
     K_ << focal, 0, imWidth_*0.5,
           0, focal, imHeight_*0.5,
           0, 0, 1;
+
+    updateProjection();
 }
 
 bool Camera::loadImageDimensions(const std::string& _imageName){
 
     fipImage input;
-    char * name = new char[_imageName.length()];
-    strcpy(name, _imageName.c_str());
-
-    if (!input.load(name, FIF_LOAD_NOPIXELS)){
+    if (!input.load(_imageName.c_str(), FIF_LOAD_NOPIXELS)){
         std::cerr << "Image couldn't be loaded!" << std::endl;
         return false;
     }
@@ -160,14 +391,60 @@ MatrixXf Camera::getXMatrix() const{
 }
 
 MatrixXf Camera::getProjectiveMatrix() const {
-    const MatrixXf X = getXMatrix();
-    MatrixXf Kh(3,4);
+    return P_;
+}
+
+void Camera::updateProjection(){
+
+    P_.leftCols<3>() = K_ * R_;
+    P_.col(3) = K_ * getTranslationVector();
+
+    const Matrix3f KR = P_.leftCols<3>();
     for (unsigned int i = 0; i < 3; i++){
-        Kh.col(i) = K_.col(i);
-        Kh(i,3) = 0;
+        for (unsigned int j = 0; j < 3; j++){
+            projection_.kr[3 * i + j] = KR(i,j);
+            projection_.r[3 * i + j] = R_(i,j);
+            projection_.k[3 * i + j] = K_(i,j);
+        }
+        projection_.c[i] = position_(i);
+    }
+    projection_.k1 = k1_;
+    projection_.k2 = k2_;
+    if (fisheye_){
+        projection_.model = FISHEYE;
+    } else if (k1_ != 0.0f || k2_ != 0.0f){
+        projection_.model = RADIAL;
+    } else {
+        projection_.model = PINHOLE;
     }
 
-    return Kh*X;
+    static const ProjectKernel kernels[3] = {selectProjectKernel(PINHOLE), selectProjectKernel(RADIAL), selectProjectKernel(FISHEYE)};
+    static const ProjectKernel pointKernels[3] = {projectScalar<PINHOLE>, projectScalar<RADIAL>, projectScalar<FISHEYE>};
+    kernel_ = kernels[projection_.model];
+    pointKernel_ = pointKernels[projection_.model];
+
+    // r d(r) stops growing where its derivative 1 + 3 k1 r^2 + 5 k2 r^4 reaches 0: points
+    // further away from the center would fold back into the image, so the factor is kept
+    // constant past that radius. For fisheyes, r is the angle
+    float maxR2 = std::numeric_limits<float>::max();
+    if (k2_ == 0.0f){
+        if (k1_ < 0.0f){
+            maxR2 = -1.0f / (3.0f * k1_);
+        }
+    } else {
+        const float disc = 9.0f * k1_ * k1_ - 20.0f * k2_;
+        if (disc >= 0.0f){
+            const float s0 = (-3.0f * k1_ - sqrt(disc)) / (10.0f * k2_);
+            const float s1 = (-3.0f * k1_ + sqrt(disc)) / (10.0f * k2_);
+            if (s0 > 0.0f){
+                maxR2 = s0;
+            }
+            if (s1 > 0.0f){
+                maxR2 = std::min(maxR2, s1);
+            }
+        }
+    }
+    projection_.maxR2 = maxR2;
 }
 
 Vector3f Camera::transform2CameraCoord(const Vector3f &_v) const {
@@ -179,17 +456,35 @@ Vector3f Camera::transform2CameraCoord(const Vector3f &_v) const {
 
 Vector3f Camera::transform2TextureCoord(const Vector3f &_v) const {
 
-    const Vector3f aux = transform2CameraCoord(_v);
-    return K_ * aux;
+    const Vector3f aux = _v - position_;
+    return P_.leftCols<3>() * aux;
 
 }
 
 Vector2f Camera::transform2uvCoord(const Vector3f &_v) const {
 
-    const Vector3f aux = transform2TextureCoord(_v);
     // u = p.x/p.z
     // v = p.y/p.z
-    return Vector2f(aux(0)/aux(2), aux(1)/aux(2));
+    Vector2f uv;
+    projectBatch(_v.data(), 1, uv.data());
+    return uv;
+}
+
+void Camera::projectBatch(const float* _xyz, size_t _n, float* _uv, float* _depth) const {
+
+    // Single points skip the vectorized kernels
+    (_n == 1 ? pointKernel_ : kernel_)(projection_, _xyz, _n, _uv, _depth);
+}
+
+void Camera::projectBatch(const std::vector<Vector3f>& _points, std::vector<Vector2f>& _uv) const {
+
+    // Eigen vectors of fixed size are stored as plain arrays, with no padding
+    static_assert(sizeof(Vector3f) == 3 * sizeof(float) && sizeof(Vector2f) == 2 * sizeof(float), "Unexpected Eigen vector layout");
+
+    _uv.resize(_points.size());
+    if (!_points.empty()){
+        projectBatch(_points[0].data(), _points.size(), _uv[0].data());
+    }
 }
 
 Vector3f Camera::get3Dpoint(const Vector2f &_p) const {
@@ -202,3 +497,101 @@ Vector3f Camera::get3Dpoint(const Vector2f &_p) const {
     return p3D;
 }
 
+
+void Camera::getFrustumPlanes(Vector4f _planes[5]) const {
+
+    // Borders of the image in normalized camera coordinates, (x/z, y/z)
+    float min_x = std::numeric_limits<float>::max(), max_x = -min_x;
+    float min_y = min_x, max_y = max_x;
+    const Matrix3f Kinv = K_.inverse();
+
+    const float k1 = k1_, k2 = k2_, maxR2 = projection_.maxR2;
+    const CameraModel model = projection_.model;
+    const bool distorted = model != PINHOLE;
+    // Distorted radius of a point at (undistorted) radius _r
+    auto distort = [k1, k2, maxR2, model](float _r){
+        const float a = model == FISHEYE ? std::atan(_r) : _r;
+        const float a2 = std::min(a * a, maxR2);
+        return a * (1.0f + a2 * (k1 + k2 * a2));
+    };
+    // r d(r) grows monotonically up to maxR2 and linearly past it, unless the
+    // factor is already negative there. Then the sides cannot be bounded
+    bool bounded = model != RADIAL || distort(std::sqrt(std::min(maxR2, 1e6f))) > 0.0f;
+
+    // Samples along each side of the image. Without distortion the corners are enough
+    const unsigned int samples = distorted ? 16 : 1;
+    for (unsigned int side = 0; bounded && side < 4; side++){
+        for (unsigned int s = 0; bounded && s <= samples; s++){
+            const float f = (float) s / samples;
+            float u = 0.0f, v = 0.0f;
+            switch (side){
+            case 0: u = f * imWidth_; v = 0.0f;      break;
+            case 1: u = f * imWidth_; v = imHeight_; break;
+            case 2: u = 0.0f;      v = f * imHeight_; break;
+            case 3: u = imWidth_;  v = f * imHeight_; break;
+            }
+            const Vector3f q = Kinv * Vector3f(u, v, 1.0f);
+            Vector2f n (q(0) / q(2), q(1) / q(2));
+
+            // The undistorted radius of each sample is found by bisection
+            const float rd = n.norm();
+            if (distorted && rd > 0.0f){
+                float lo = 0.0f, hi = rd;
+                for (unsigned int it = 0; it < 64 && distort(hi) < rd; it++){
+                    hi *= 2.0f;
+                }
+                // Fisheyes may see more than 90 degrees away from the axis
+                if (distort(hi) < rd){
+                    bounded = false;
+                    break;
+                }
+                for (unsigned int it = 0; it < 32; it++){
+                    const float mid = 0.5f * (lo + hi);
+                    if (distort(mid) < rd){
+                        lo = mid;
+                    } else {
+                        hi = mid;
+                    }
+                }
+                n *= hi / rd;
+            }
+
+            min_x = std::min(min_x, n(0));
+            max_x = std::max(max_x, n(0));
+            min_y = std::min(min_y, n(1));
+            max_y = std::max(max_y, n(1));
+        }
+    }
+
+    if (!bounded){
+        min_x = min_y = -std::numeric_limits<float>::max();
+        max_x = max_y = std::numeric_limits<float>::max();
+    } else if (distorted){
+        // The undistorted borders are curved between samples
+        const float margin_x = 0.05f * (max_x - min_x);
+        const float margin_y = 0.05f * (max_y - min_y);
+        min_x -= margin_x;
+        max_x += margin_x;
+        min_y -= margin_y;
+        max_y += margin_y;
+    }
+
+    // Planes through the camera center, in camera coordinates
+    Vector3f normals[5];
+    normals[0] = Vector3f( 1.0f,  0.0f, -min_x);
+    normals[1] = Vector3f(-1.0f,  0.0f,  max_x);
+    normals[2] = Vector3f( 0.0f,  1.0f, -min_y);
+    normals[3] = Vector3f( 0.0f, -1.0f,  max_y);
+    normals[4] = Vector3f( 0.0f,  0.0f,  1.0f);
+
+    for (unsigned int i = 0; i < 5; i++){
+        Vector3f n = R_.transpose() * normals[i];
+        if (!std::isfinite(n.squaredNorm())){
+            // This side does not bound anything
+            _planes[i] = Vector4f(0.0f, 0.0f, 0.0f, 0.0f);
+            continue;
+        }
+        n.normalize();
+        _planes[i] = Vector4f(n(0), n(1), n(2), -n.dot(position_));
+    }
+}
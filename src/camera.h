@@ -30,6 +30,28 @@
 
 #include "mesh3d.h"
 
+// Lens models. Every one of them has its own projection kernels
+enum CameraModel {
+    PINHOLE, // No distortion
+    RADIAL,  // Pinhole with radial distortion (k1, k2)
+    FISHEYE  // Equidistant fisheye, with the same distortion applied to the angle
+};
+
+struct CameraProjection;
+typedef void (*ProjectKernel)(const CameraProjection& _p, const float* _xyz, size_t _n, float* _uv, float* _depth);
+
+// Projection parameters of a camera, laid out for the projection kernels.
+// Matrices are stored in row-major order
+struct CameraProjection {
+    float kr[9];  // K R
+    float r[9];   // R
+    float k[9];   // K
+    float c[3];   // Camera position
+    float k1, k2; // Distortion coefficients
+    float maxR2;  // Squared radius (angle for fisheyes) past which distortion stops growing
+    CameraModel model;
+};
+
 class Camera {
 
  public:
@@ -38,7 +60,8 @@ class Camera {
 
     // Read parameters from text line
     void loadCameraParameters(const std::string& _textline);
-    void loadBundlerCameraParameters(std::ifstream& _stream, const std::string& _imageName);
+    // Bundler files do not include the image dimensions (width, height)
+    void loadBundlerCameraParameters(std::ifstream& _stream, const Vector2i& _imageDim);
     bool loadImageDimensions(const std::string& _imageName);
 
     // Data access
@@ -66,10 +89,15 @@ class Camera {
     inline Vector2f getDistortionParams() const{
         return Vector2f(k1_,k2_);
     }
+    // Only PINHOLE projections are linear in homogeneous coordinates
+    inline CameraModel getModel() const{
+        return projection_.model;
+    }
 
     // set camera position using the translation vector
     inline void setPosition(const Vector3f& _translation){
         position_ = -R_.transpose() * _translation;
+        updateProjection();
     }
 
 
@@ -81,14 +109,28 @@ class Camera {
     // last column of K is [0 0 0]'
     MatrixXf getProjectiveMatrix() const;
 
-    // Coordinates transformations from world coordinates
+    // Coordinates transformations from world coordinates. transform2TextureCoord is the
+    // pinhole projection; transform2uvCoord also applies the radial distortion
     Vector3f transform2CameraCoord(const Vector3f& _v) const;
     Vector3f transform2TextureCoord(const Vector3f& _v) const;
     Vector2f transform2uvCoord(const Vector3f& _v) const;
 
+    // Projects _n points, given as consecutive (x, y, z) triplets, into uv coordinates
+    // (consecutive (u, v) pairs) with the kernel of the camera model, vectorized when the
+    // model allows it. If _depth is not null, it gets the depth of each point in camera
+    // coordinates (w without distortion, z otherwise). Results match transform2uvCoord
+    void projectBatch(const float* _xyz, size_t _n, float* _uv, float* _depth = NULL) const;
+    void projectBatch(const std::vector<Vector3f>& _points, std::vector<Vector2f>& _uv) const;
+
     // Coordinates transformations from uv coordinates
     Vector3f get3Dpoint(const Vector2f& _p) const;
 
+    // Planes (world coordinates) bounding the region that projects inside the image:
+    // the four sides and the plane of the camera. Each plane (a, b, c, d) has a unit normal
+    // pointing inwards, so points inside have a x + b y + c z + d >= 0. With radial
+    // distortion the sides are placed conservatively, a bit outside the real borders
+    void getFrustumPlanes(Vector4f _planes[5]) const;
+
     // Ratings calculated for each triangle and vertex
     //std::vector<float> tri_ratings_;
     std::vector<float> vtx_ratings_;
@@ -100,6 +142,17 @@ class Camera {
     Vector3f position_; // C
     unsigned int imWidth_, imHeight_; //nPixX, nPixY
     float k1_, k2_; // Radial distortion coefficients
+    bool fisheye_; // The distortion is applied to the angle from the optical axis
+
+    // P = K [R t], kept up to date with K, R, the position and the distortion. Points
+    // are projected with its left 3x3 block (K R) applied to v - C, which is the same
+    // product but keeps the precision for world coordinates far from the origin
+    Matrix<float, 3, 4> P_;
+    CameraProjection projection_;
+    // Kernels of the camera model, chosen in updateProjection: one for batches
+    // and a scalar one for single points
+    ProjectKernel kernel_, pointKernel_;
+    void updateProjection();
 
 
 
@@ -31,26 +31,47 @@ class Color {
 
 public:
 
-	Color (unsigned char *_p);
+	Color (const unsigned char *_p); // Reads an RGB triplet
 	Color ();
     Color (float _red, float _green, float _blue, float _alpha = 1.0);
 
     // Data access
-    float getRed() const;
-    float getGreen() const;
-    float getBlue() const;
-    float getAlpha() const;
+    inline float getRed() const {
+        return r_;
+    }
+    inline float getGreen() const {
+        return g_;
+    }
+    inline float getBlue() const {
+        return b_;
+    }
+    inline float getAlpha() const {
+        return alpha_;
+    }
     void setRed(float _r);
     void setGreen(float _r);
     void setBlue(float _r);
     void setAlpha(float _alpha);
 
     // Operators (They do not modify the alpha channel)
-	void operator+= (const Color& _c);
-	Color operator+ (const Color& _c) const;
-	Color operator- (const Color& _c) const;
-	Color operator* (float _f) const;
-	Color operator/ (float _f) const;
+    // They are inlined, as they are used per pixel when sampling images
+	inline void operator+= (const Color& _c){
+        r_ += _c.r_;
+        g_ += _c.g_;
+        b_ += _c.b_;
+    }
+	inline Color operator+ (const Color& _c) const {
+        return Color(r_ + _c.r_, g_ + _c.g_, b_ + _c.b_, alpha_);
+    }
+	inline Color operator- (const Color& _c) const {
+        return Color(r_ - _c.r_, g_ - _c.g_, b_ - _c.b_, alpha_);
+    }
+	inline Color operator* (float _f) const {
+        return Color(r_ * _f, g_ * _f, b_ * _f, alpha_);
+    }
+	inline Color operator/ (float _f) const {
+        return Color(r_ / _f, g_ / _f, b_ / _f, alpha_);
+    }
 	bool operator== (const Color& _c) const;
 
     bool equals(const Color& _c) const;
@@ -67,5 +88,24 @@ private:
 
 };
 
+inline Color::Color (){
+	r_ = g_ = b_ = 0.0;
+	alpha_ = 1.0;
+}
+
+inline Color::Color (float _red, float _green, float _blue, float _alpha){
+	r_ = _red;
+	g_ = _green;
+	b_ = _blue;
+	alpha_ = _alpha;
+}
+
+inline Color::Color (const unsigned char *_p){
+	r_ = (float) _p[0];
+	g_ = (float) _p[1];
+	b_ = (float) _p[2];
+	alpha_ = 1.0;
+}
+
 
 #endif
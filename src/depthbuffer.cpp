@@ -0,0 +1,234 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <cmath>
+#include <algorithm>
+
+#include "depthbuffer.h"
+
+const unsigned int DepthBuffer::NONE;
+
+DepthBuffer::DepthBuffer(){
+    min_s_ = min_t_ = 0.0f;
+    scale_ = 1.0f;
+    width_ = height_ = 0;
+}
+
+DepthBuffer::~DepthBuffer(){
+}
+
+void DepthBuffer::setWindow(float _min_s, float _min_t, float _max_s, float _max_t, float _scale){
+
+    min_s_ = _min_s;
+    min_t_ = _min_t;
+    scale_ = _scale;
+    width_ = _max_s > _min_s ? (unsigned int) std::ceil((_max_s - _min_s) * _scale) : 0;
+    height_ = _max_t > _min_t ? (unsigned int) std::ceil((_max_t - _min_t) * _scale) : 0;
+
+    invDepth_.assign((size_t) width_ * height_, 0.0f);
+    ids_.assign((size_t) width_ * height_, NONE);
+    levelOffset_.clear();
+    levelWidth_.clear();
+    levelHeight_.clear();
+}
+
+template <typename F>
+void DepthBuffer::rasterize(const Vector2f _st[3], const float _depth[3], F _f) const {
+
+    // Vertices in buffer coordinates: pixel (i, j) has its center at (i + 0.5, j + 0.5)
+    float x[3], y[3];
+    for (unsigned int j = 0; j < 3; j++){
+        x[j] = (_st[j](0) - min_s_) * scale_;
+        y[j] = (_st[j](1) - min_t_) * scale_;
+        if (!std::isfinite(x[j]) || !std::isfinite(y[j])){
+            return;
+        }
+    }
+
+    float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+    if (area == 0.0f){
+        return;
+    }
+
+    const float min_x = std::min(std::min(x[0], x[1]), x[2]);
+    const float max_x = std::max(std::max(x[0], x[1]), x[2]);
+    const float min_y = std::min(std::min(y[0], y[1]), y[2]);
+    const float max_y = std::max(std::max(y[0], y[1]), y[2]);
+    if (max_x < 0.5f || max_y < 0.5f || min_x > width_ - 0.5f || min_y > height_ - 0.5f){
+        return;
+    }
+    const unsigned int first_i = (unsigned int) std::max(std::ceil(min_x - 0.5f), 0.0f);
+    const unsigned int first_j = (unsigned int) std::max(std::ceil(min_y - 0.5f), 0.0f);
+    const unsigned int last_i = (unsigned int) std::min(std::floor(max_x - 0.5f), width_ - 1.0f);
+    const unsigned int last_j = (unsigned int) std::min(std::floor(max_y - 0.5f), height_ - 1.0f);
+
+    // Edge functions, normalized so they are the barycentric coordinates of each vertex.
+    // They are computed at the start of each row and then grow linearly along it
+    const float inv_area = 1.0f / area;
+    const float b0_i = (y[1] - y[2]) * inv_area;
+    const float b1_i = (y[2] - y[0]) * inv_area;
+    const float b2_i = (y[0] - y[1]) * inv_area;
+    const float iz0 = 1.0f / _depth[0], iz1 = 1.0f / _depth[1], iz2 = 1.0f / _depth[2];
+
+    for (unsigned int j = first_j; j <= last_j; j++){
+        const float py = j + 0.5f;
+        const float px = first_i + 0.5f;
+        float b0 = ((x[1] - px) * (y[2] - py) - (x[2] - px) * (y[1] - py)) * inv_area;
+        float b1 = ((x[2] - px) * (y[0] - py) - (x[0] - px) * (y[2] - py)) * inv_area;
+        float b2 = 1.0f - b0 - b1;
+        const size_t row = (size_t) j * width_;
+        for (unsigned int i = first_i; i <= last_i; i++, b0 += b0_i, b1 += b1_i, b2 += b2_i){
+            if (b0 > 0.0f && b1 > 0.0f && b2 > 0.0f){
+                if (!_f(row + i, b0 * iz0 + b1 * iz1 + b2 * iz2)){
+                    return;
+                }
+            }
+        }
+    }
+}
+
+void DepthBuffer::drawTriangle(unsigned int _id, const Vector2f _st[3], const float _depth[3]){
+
+    float* invDepth = invDepth_.data();
+    unsigned int* ids = ids_.data();
+    rasterize(_st, _depth, [=](size_t _pixel, float _iz){
+        if (_iz > invDepth[_pixel]){
+            invDepth[_pixel] = _iz;
+            ids[_pixel] = _id;
+        }
+        return true;
+    });
+}
+
+bool DepthBuffer::isOccluded(unsigned int _id, const Vector2f _st[3], const float _depth[3], float _tolerance) const {
+
+    bool occluded = false;
+    const float factor = 1.0f + _tolerance;
+    rasterize(_st, _depth, [&](size_t _pixel, float _iz){
+        occluded = ids_[_pixel] != _id && invDepth_[_pixel] > _iz * factor;
+        return !occluded;
+    });
+    return occluded;
+}
+
+void DepthBuffer::buildPyramid(){
+
+    levelOffset_.assign(1, 0);
+    levelWidth_.assign(1, width_);
+    levelHeight_.assign(1, height_);
+    if (width_ == 0 || height_ == 0){
+        return;
+    }
+
+    size_t size = 0;
+    while (levelWidth_.back() > 1 || levelHeight_.back() > 1){
+        levelOffset_.push_back(size);
+        levelWidth_.push_back((levelWidth_.back() + 1) / 2);
+        levelHeight_.push_back((levelHeight_.back() + 1) / 2);
+        size += (size_t) levelWidth_.back() * levelHeight_.back();
+    }
+    pyramid_.resize(size);
+
+    // Inverse depths: the farthest surface is the smallest one
+    for (unsigned int l = 1; l < levelOffset_.size(); l++){
+        const float* src = l == 1 ? invDepth_.data() : pyramid_.data() + levelOffset_[l - 1];
+        float* dst = pyramid_.data() + levelOffset_[l];
+        const unsigned int src_w = levelWidth_[l - 1], src_h = levelHeight_[l - 1];
+        for (unsigned int j = 0; j < levelHeight_[l]; j++){
+            const float* row0 = src + (size_t) (2 * j) * src_w;
+            const float* row1 = 2 * j + 1 < src_h ? row0 + src_w : row0;
+            for (unsigned int i = 0; i < levelWidth_[l]; i++){
+                const unsigned int i1 = 2 * i + 1 < src_w ? 2 * i + 1 : 2 * i;
+                dst[(size_t) j * levelWidth_[l] + i] = std::min(std::min(row0[2 * i], row0[i1]), std::min(row1[2 * i], row1[i1]));
+            }
+        }
+    }
+}
+
+bool DepthBuffer::isHidden(float _min_s, float _min_t, float _max_s, float _max_t, float _depth, float _tolerance) const {
+
+    if (levelOffset_.empty() || !(_depth > 0.0f)){
+        return false;
+    }
+
+    // Pixels whose center is in the region, as in rasterize
+    const float min_x = (_min_s - min_s_) * scale_, max_x = (_max_s - min_s_) * scale_;
+    const float min_y = (_min_t - min_t_) * scale_, max_y = (_max_t - min_t_) * scale_;
+    if (!(max_x >= 0.5f && max_y >= 0.5f && min_x <= width_ - 0.5f && min_y <= height_ - 0.5f)){
+        return false;
+    }
+    unsigned int first_i = (unsigned int) std::max(std::ceil(min_x - 0.5f), 0.0f);
+    unsigned int first_j = (unsigned int) std::max(std::ceil(min_y - 0.5f), 0.0f);
+    unsigned int last_i = (unsigned int) std::min(std::floor(max_x - 0.5f), width_ - 1.0f);
+    unsigned int last_j = (unsigned int) std::min(std::floor(max_y - 0.5f), height_ - 1.0f);
+    if (first_i > last_i || first_j > last_j){
+        return false;
+    }
+
+    // The coarsest level where the region spans at most 2x2 pixels is checked
+    unsigned int l = 0;
+    while ((last_i - first_i > 1 || last_j - first_j > 1) && l + 1 < levelOffset_.size()){
+        first_i /= 2;
+        first_j /= 2;
+        last_i /= 2;
+        last_j /= 2;
+        l++;
+    }
+
+    const float* level = l == 0 ? invDepth_.data() : pyramid_.data() + levelOffset_[l];
+    const float iz = (1.0f + _tolerance) / _depth;
+    for (unsigned int j = first_j; j <= last_j; j++){
+        for (unsigned int i = first_i; i <= last_i; i++){
+            if (!(level[(size_t) j * levelWidth_[l] + i] > iz)){
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+unsigned int DepthBuffer::getTriangle(const Vector2f& _p) const {
+
+    const float x = (_p(0) - min_s_) * scale_;
+    const float y = (_p(1) - min_t_) * scale_;
+    if (!(x >= 0.0f && y >= 0.0f && x < width_ && y < height_)){
+        return NONE;
+    }
+    return ids_[(size_t) y * width_ + (size_t) x];
+}
+
+float DepthBuffer::interpolateDepth(const Vector2f& _p, const Vector2f _st[3], const float _depth[3]){
+
+    const Vector2f e1 = _st[1] - _st[0];
+    const Vector2f e2 = _st[2] - _st[0];
+    const Vector2f ep = _p - _st[0];
+    const float area = e1(0) * e2(1) - e2(0) * e1(1);
+    if (area == 0.0f){
+        return std::min(std::min(_depth[0], _depth[1]), _depth[2]);
+    }
+    const float b1 = (ep(0) * e2(1) - e2(0) * ep(1)) / area;
+    const float b2 = (e1(0) * ep(1) - ep(0) * e1(1)) / area;
+    const float b0 = 1.0f - b1 - b2;
+    return 1.0f / (b0 / _depth[0] + b1 / _depth[1] + b2 / _depth[2]);
+}
@@ -0,0 +1,99 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef DEPTHBUFFER_H
+#define DEPTHBUFFER_H
+
+#include <vector>
+#include <climits>
+
+#include "mesh3d.h"
+
+// Depth buffer where the triangles of a mesh are rasterized as seen from a camera.
+// It covers a window of the image (uv coordinates) at a given number of pixels per
+// image pixel, and every pixel keeps the inverse depth and the identifier of the
+// nearest triangle whose projection contains its center: 8 bytes per pixel.
+// Inverse depths are interpolated linearly in the image, which is exact for pinhole
+// projections. A depth pyramid can be built over it to check whole regions at once.
+class DepthBuffer {
+
+public:
+
+    static const unsigned int NONE = UINT_MAX;
+
+    DepthBuffer();
+    virtual ~DepthBuffer();
+
+    // Covers [_min_s, _max_s] x [_min_t, _max_t] with _scale pixels per image pixel,
+    // and clears the buffer. Memory is reused from one window to the next
+    void setWindow(float _min_s, float _min_t, float _max_s, float _max_t, float _scale);
+
+    // Draws triangle _id, whose vertices project to _st with depths _depth (positive)
+    void drawTriangle(unsigned int _id, const Vector2f _st[3], const float _depth[3]);
+
+    // Whether a pixel of the triangle is covered by another surface nearer than
+    // its own depth there, by more than the relative tolerance _tolerance
+    bool isOccluded(unsigned int _id, const Vector2f _st[3], const float _depth[3], float _tolerance) const;
+
+    // Builds a depth pyramid from what has been drawn so far. Each level keeps, for every
+    // 2x2 block of pixels of the level below, the farthest of their surfaces (pixels
+    // with nothing count as infinitely far), until a single pixel covers everything
+    void buildPyramid();
+
+    // Whether every pixel whose center is in [_min_s, _max_s] x [_min_t, _max_t] is covered,
+    // according to the pyramid, by a surface nearer than _depth by more than the relative
+    // tolerance _tolerance. It is false if there is no such pixel. Anything in that region
+    // at a depth of _depth or more, and drawn after the pyramid was built, would be hidden
+    bool isHidden(float _min_s, float _min_t, float _max_s, float _max_t, float _depth, float _tolerance) const;
+
+    // Nearest triangle at the pixel containing _p, NONE if there is none
+    unsigned int getTriangle(const Vector2f& _p) const;
+
+    // Depth at _p of the plane of a triangle that projects to _st with depths _depth
+    static float interpolateDepth(const Vector2f& _p, const Vector2f _st[3], const float _depth[3]);
+
+    inline size_t getBytes() const {
+        return (invDepth_.capacity() + pyramid_.capacity()) * sizeof(float) + ids_.capacity() * sizeof(unsigned int);
+    }
+
+private:
+
+    // Calls _f(pixel, inverse depth) for every pixel whose center is strictly inside the triangle
+    template <typename F>
+    void rasterize(const Vector2f _st[3], const float _depth[3], F _f) const;
+
+    float min_s_, min_t_, scale_;
+    unsigned int width_, height_;
+    std::vector<float> invDepth_; // 0 where there is nothing
+    std::vector<unsigned int> ids_;
+
+    // Levels of the pyramid: level 0 is invDepth_, and level l > 0 starts at
+    // position levelOffset_[l] of pyramid_. Empty if it has not been built
+    std::vector<float> pyramid_;
+    std::vector<size_t> levelOffset_;
+    std::vector<unsigned int> levelWidth_, levelHeight_;
+
+};
+
+#endif // DEPTHBUFFER_H
@@ -24,55 +24,254 @@
 
 #include <cstring>
 #include <cassert>
+#include <climits>
+#include <algorithm>
 
 #include "image.h"
+#include "imageencoder.h"
+
+// Vectorized samplers are compiled for x86 only, each one with its own
+// target attribute, so the rest of the code does not depend on -mavx2
+#if defined(__GNUC__) && defined(__SSE2__)
+#define IMAGE_X86_KERNELS
+#include <immintrin.h>
+#endif
 
 Image::Image(){
+    width_ = height_ = stride_ = 0;
+    level_ = fullWidth_ = fullHeight_ = 0;
+    rowOffset_ = columnOffset_ = 0;
+    data_ = nullptr;
+}
+
+Image::Image(const std::string& _fileName) : Image(_fileName, 0){
 }
 
-Image::Image(const std::string& _fileName){
+Image::Image(const std::string& _fileName, unsigned int _level){
+
+    width_ = height_ = stride_ = 0;
+    level_ = fullWidth_ = fullHeight_ = 0;
+    rowOffset_ = columnOffset_ = 0;
+    data_ = nullptr;
+    name_ = _fileName;
+
+    // The JPEG decoder can scale the image by 1/2, 1/4 or 1/8 while decoding it
+    // (FreeImage takes the requested size in the upper 16 bits of the flags).
+    // The header is read first to know the full resolution
+    int flags = 0;
+    unsigned int fullWidth = 0, fullHeight = 0;
+    _level = std::min(_level, 3u);
+    if (_level > 0 && FreeImage_GetFileType(_fileName.c_str(), 0) == FIF_JPEG){
+        fipImage header;
+        if (header.load(_fileName.c_str(), FIF_LOAD_NOPIXELS)){
+            fullWidth = header.getWidth();
+            fullHeight = header.getHeight();
+            // JPEG blocks start at the top of the picture, and mip levels at the bottom
+            // row (row 0). Both grids only match if the height is a multiple of the scale
+            while (_level > 0 && fullHeight % (1 << _level) != 0){
+                _level--;
+            }
+            const unsigned int size = std::max(fullWidth, fullHeight) >> _level;
+            if (_level > 0 && size > 0 && size <= 0xFFFF){
+                flags = size << 16;
+            }
+        }
+    }
 
-	if(!this->imageFile_.load(_fileName.c_str())){
+    fipImage imageFile;
+    if(!imageFile.load(_fileName.c_str(), flags)){
 		std::cerr << "Image " << _fileName << " could not be read" << std::endl;
 		std::cerr << "Filename length " << _fileName.length() << std::endl;
+        return;
 	}
 
-	width_ = imageFile_.getWidth();
-	height_ = imageFile_.getHeight();
-    name_ = _fileName;
+    if (imageFile.getBitsPerPixel() != 24 && !imageFile.convertTo24Bits()){
+        std::cerr << "Image " << _fileName << " could not be converted to 24 bits" << std::endl;
+        return;
+    }
+
+	width_ = imageFile.getWidth();
+	height_ = imageFile.getHeight();
+    stride_ = 3 * width_;
+    level_ = 0;
+    fullWidth_ = width_;
+    fullHeight_ = height_;
+    rowOffset_ = columnOffset_ = 0;
+
+    // Scaled images have the size of one of the mip levels
+    if (flags != 0){
+        for (unsigned int level = 1; level <= _level; level++){
+            const unsigned int scale = 1 << level;
+            if ((fullWidth + scale - 1) / scale == width_ && (fullHeight + scale - 1) / scale == height_){
+                level_ = level;
+                fullWidth_ = fullWidth;
+                fullHeight_ = fullHeight;
+            }
+        }
+    }
+    if (flags != 0 && level_ == 0 && (width_ != fullWidth || height_ != fullHeight)){
+        // The decoder picked a scale we cannot tell, so it is decoded again at full resolution
+        *this = Image(_fileName, 0);
+        return;
+    }
+
+    pixels_.resize((size_t) stride_ * height_ + 1);
+    data_ = pixels_.data();
+
+    // FreeImage stores BGR or RGB depending on the platform
+    for (unsigned int row = 0; row < height_; row++){
+        const BYTE* src = imageFile.getScanLine(row);
+        unsigned char* dst = getRow(row);
+        for (unsigned int col = 0; col < width_; col++, src += 3, dst += 3){
+            dst[0] = src[FI_RGBA_RED];
+            dst[1] = src[FI_RGBA_GREEN];
+            dst[2] = src[FI_RGBA_BLUE];
+        }
+    }
 }
 
 Image::Image(unsigned int _height, unsigned int _width, Color _background){
 
     width_ = _width;
     height_ = _height;
+    stride_ = 3 * width_;
+    level_ = 0;
+    fullWidth_ = width_;
+    fullHeight_ = height_;
+    rowOffset_ = columnOffset_ = 0;
+    pixels_.resize((size_t) stride_ * height_ + 1);
+    data_ = pixels_.data();
+
+    const unsigned char r = toByte(_background.getRed());
+    const unsigned char g = toByte(_background.getGreen());
+    const unsigned char b = toByte(_background.getBlue());
+    for (size_t i = 0; i < (size_t) stride_ * height_; i += 3){
+        pixels_[i] = r;
+        pixels_[i + 1] = g;
+        pixels_[i + 2] = b;
+    }
 
-    fipImage tmp(FIT_BITMAP,width_,height_, 24);
+}
 
-    RGBQUAD color;
-    color.rgbBlue = _background.getBlue();
-    color.rgbGreen = _background.getGreen();
-    color.rgbRed = _background.getRed();
-    FreeImage_FillBackground(tmp, &color);
+Image::Image(unsigned int _height, unsigned int _width, unsigned int _stride, unsigned char* _data, const std::shared_ptr<void>& _owner, const std::string& _name){
+    width_ = _width;
+    height_ = _height;
+    stride_ = _stride;
+    level_ = 0;
+    fullWidth_ = width_;
+    fullHeight_ = height_;
+    rowOffset_ = columnOffset_ = 0;
+    data_ = _data;
+    external_ = _owner;
+    name_ = _name;
+}
 
-    imageFile_ = tmp;
+Image::Image(const Image& _other) : pixels_(_other.pixels_), external_(_other.external_){
+    rebind(_other);
+}
 
+Image::Image(Image&& _other) : pixels_(std::move(_other.pixels_)), external_(std::move(_other.external_)){
+    rebind(_other);
+    _other.width_ = _other.height_ = _other.stride_ = 0;
+    _other.data_ = nullptr;
 }
 
-Color Image::getColor (unsigned int _row, unsigned int _column) const{
+Image& Image::operator= (const Image& _other){
+    if (this != &_other){
+        pixels_ = _other.pixels_;
+        external_ = _other.external_;
+        rebind(_other);
+    }
+    return *this;
+}
 
-    assert(_row < height_);
-    assert(_column < width_);
+Image& Image::operator= (Image&& _other){
+    if (this != &_other){
+        pixels_ = std::move(_other.pixels_);
+        external_ = std::move(_other.external_);
+        rebind(_other);
+        _other.width_ = _other.height_ = _other.stride_ = 0;
+        _other.data_ = nullptr;
+    }
+    return *this;
+}
 
+void Image::rebind(const Image& _other){
+    width_ = _other.width_;
+    height_ = _other.height_;
+    stride_ = _other.stride_;
+    level_ = _other.level_;
+    fullWidth_ = _other.fullWidth_;
+    fullHeight_ = _other.fullHeight_;
+    rowOffset_ = _other.rowOffset_;
+    columnOffset_ = _other.columnOffset_;
+    name_ = _other.name_;
+    data_ = external_ ? _other.data_ : pixels_.data();
+}
 
-    RGBQUAD col;
-    if(!imageFile_.getPixelColor(_column,_row, &col)){
-        std::cerr << _column << " " << _row << std::endl;
-        std::cerr << name_ << std::endl;
+Image Image::downsample() const {
+
+    if (width_ == 0 || height_ == 0){
+        return Image();
+    }
+
+    // Pixel i of the next level averages pixels 2i and 2i+1 of the full image.
+    // Those outside the window (or the image) are replaced by the closest one
+    const unsigned int rowOffset = rowOffset_ / 2;
+    const unsigned int columnOffset = columnOffset_ / 2;
+    Image half ((rowOffset_ + height_ + 1) / 2 - rowOffset, (columnOffset_ + width_ + 1) / 2 - columnOffset);
+    half.level_ = level_ + 1;
+    half.fullWidth_ = fullWidth_;
+    half.fullHeight_ = fullHeight_;
+    half.rowOffset_ = rowOffset;
+    half.columnOffset_ = columnOffset;
+    half.name_ = name_;
+
+    for (unsigned int row = 0; row < half.height_; row++){
+        const int r0 = 2 * (rowOffset + row) - rowOffset_;
+        const unsigned char* src0 = getRow(std::max(r0, 0));
+        const unsigned char* src1 = getRow(std::min(r0 + 1, (int) height_ - 1));
+        unsigned char* dst = half.getRow(row);
+        for (unsigned int col = 0; col < half.width_; col++, dst += 3){
+            const int c0 = 2 * (columnOffset + col) - columnOffset_;
+            const unsigned int p0 = 3 * std::max(c0, 0);
+            const unsigned int p1 = 3 * std::min(c0 + 1, (int) width_ - 1);
+            for (unsigned int ch = 0; ch < 3; ch++){
+                dst[ch] = (src0[p0 + ch] + src0[p1 + ch] + src1[p0 + ch] + src1[p1 + ch] + 2) / 4;
+            }
+        }
     }
-    Color color ((float)col.rgbRed, (float)col.rgbGreen, (float)col.rgbBlue);
-    return color;
 
+    return half;
+}
+
+Image Image::crop(unsigned int _row, unsigned int _column, unsigned int _height, unsigned int _width) const {
+
+    _row = std::min(_row, height_);
+    _column = std::min(_column, width_);
+    _height = std::min(_height, height_ - _row);
+    _width = std::min(_width, width_ - _column);
+
+    Image window;
+    if (external_){
+        // The window points into the same memory. Its last pixel is followed
+        // by at least one more byte, so the padding is still there
+        window = Image(_height, _width, stride_, data_ + (size_t) _row * stride_ + 3 * _column, external_, name_);
+    } else {
+        window = Image(_height, _width);
+        for (unsigned int row = 0; row < _height; row++){
+            memcpy(window.getRow(row), getPixel(_row + row, _column), 3 * _width);
+        }
+    }
+
+    window.level_ = level_;
+    window.fullWidth_ = fullWidth_;
+    window.fullHeight_ = fullHeight_;
+    window.rowOffset_ = rowOffset_ + _row;
+    window.columnOffset_ = columnOffset_ + _column;
+    window.name_ = name_;
+
+    return window;
 }
 
 Color Image::interpolate (float _row, float _column, InterpolateMode _mode) const {
@@ -152,22 +351,335 @@ Color Image::interpolate (float _row, float _column, InterpolateMode _mode) cons
 }
 
 
-void Image::setColor (const Color& _color, unsigned int _row, unsigned int _column){
-    
-    RGBQUAD col;
-    col.rgbBlue = _color.getBlue();
-    col.rgbGreen = _color.getGreen();
-    col.rgbRed = _color.getRed();
+typedef void (*SampleKernel)(const Image&, const float*, const float*, size_t, float*, InterpolateMode);
+
+// Reference kernel: one sample at a time
+static void sampleScalar(const Image& _image, const float* _rows, const float* _columns, size_t _n, float* _rgb, InterpolateMode _mode){
+    for (size_t i = 0; i < _n; i++){
+        const Color color = _image.interpolate(_rows[i], _columns[i], _mode);
+        _rgb[3 * i]     = color.getRed();
+        _rgb[3 * i + 1] = color.getGreen();
+        _rgb[3 * i + 2] = color.getBlue();
+    }
+}
+
+#ifdef IMAGE_X86_KERNELS
+
+// Bicubic weights of the four taps (-1, 0, 1, 2) for a fractional position t.
+// They are the expansion of the per-row formula used in Image::interpolate
+static inline void cubicWeights(float _t, float _w[4]){
+    _w[0] = _t * (-1.0f + _t * (2.0f - _t));
+    _w[1] = 1.0f + _t * _t * (_t - 2.0f);
+    _w[2] = _t * (1.0f + _t * (1.0f - _t));
+    _w[3] = _t * _t * (_t - 1.0f);
+}
+
+static inline int load32(const unsigned char* _p){
+    int v;
+    memcpy(&v, _p, 4);
+    return v;
+}
+
+__attribute__((target("sse4.1")))
+static inline __m128 channelSSE(__m128i _pixels, int _channel){
+    const __m128i shifted = _mm_srl_epi32(_pixels, _mm_cvtsi32_si128(8 * _channel));
+    return _mm_cvtepi32_ps(_mm_and_si128(shifted, _mm_set1_epi32(0xFF)));
+}
+
+__attribute__((target("sse4.1")))
+static void sampleSSE(const Image& _image, const float* _rows, const float* _columns, size_t _n, float* _rgb, InterpolateMode _mode){
+
+    const unsigned char* data = _image.getRow(0);
+    const int stride = _image.getStride();
+    const __m128i width = _mm_set1_epi32(_image.getWidth());
+    const __m128i height = _mm_set1_epi32(_image.getHeight());
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128 half = _mm_set1_ps(0.5f);
+
+    size_t i = 0;
+    for (; i + 4 <= _n; i += 4){
+
+        const __m128 r = _mm_sub_ps(_mm_loadu_ps(_rows + i), half);
+        const __m128 c = _mm_sub_ps(_mm_loadu_ps(_columns + i), half);
+        const __m128 r_floor = _mm_floor_ps(r);
+        const __m128 c_floor = _mm_floor_ps(c);
+        const __m128 x = _mm_sub_ps(r, r_floor);
+        const __m128 y = _mm_sub_ps(c, c_floor);
+        const __m128i r_base = _mm_max_epi32(_mm_cvtps_epi32(r_floor), zero);
+        const __m128i c_base = _mm_max_epi32(_mm_cvtps_epi32(c_floor), zero);
+
+        // Samples in the edges of the image are left to the scalar kernel
+        __m128i inside;
+        if (_mode == BILINEAR){
+            inside = _mm_and_si128(_mm_cmplt_epi32(_mm_add_epi32(r_base, one), height),
+                                   _mm_cmplt_epi32(_mm_add_epi32(c_base, one), width));
+        } else {
+            inside = _mm_and_si128(_mm_cmplt_epi32(_mm_add_epi32(r_base, _mm_set1_epi32(3)), height),
+                                   _mm_cmplt_epi32(_mm_add_epi32(c_base, _mm_set1_epi32(2)), width));
+            inside = _mm_and_si128(inside, _mm_and_si128(_mm_cmpgt_epi32(r_base, zero), _mm_cmpgt_epi32(c_base, zero)));
+        }
+        if (_mm_movemask_ps(_mm_castsi128_ps(inside)) != 0xF){
+            sampleScalar(_image, _rows + i, _columns + i, 4, _rgb + 3 * i, _mode);
+            continue;
+        }
+
+        int offset[4];
+        _mm_storeu_si128((__m128i*) offset, _mm_add_epi32(_mm_mullo_epi32(r_base, _mm_set1_epi32(stride)),
+                                                          _mm_mullo_epi32(c_base, _mm_set1_epi32(3))));
 
-    imageFile_.setPixelColor(_column,_row,&col);
+        float out[3][4];
+
+        if (_mode == BILINEAR){
+
+            int a[4], b[4], cc[4], d[4];
+            for (unsigned int k = 0; k < 4; k++){
+                const unsigned char* p = data + offset[k];
+                a[k]  = load32(p);              // f(0,0)
+                b[k]  = load32(p + stride);     // f(1,0)
+                cc[k] = load32(p + 3);          // f(0,1)
+                d[k]  = load32(p + stride + 3); // f(1,1)
+            }
+            const __m128i pa = _mm_loadu_si128((const __m128i*) a);
+            const __m128i pb = _mm_loadu_si128((const __m128i*) b);
+            const __m128i pc = _mm_loadu_si128((const __m128i*) cc);
+            const __m128i pd = _mm_loadu_si128((const __m128i*) d);
+
+            for (int ch = 0; ch < 3; ch++){
+                const __m128 A = channelSSE(pa, ch);
+                const __m128 B = channelSSE(pb, ch);
+                const __m128 C = channelSSE(pc, ch);
+                const __m128 D = channelSSE(pd, ch);
+                // Same expression as the scalar version: A + (B-A)x + (C-A)y + (A+D-B-C)xy
+                __m128 f = _mm_add_ps(A, _mm_mul_ps(_mm_sub_ps(B, A), x));
+                f = _mm_add_ps(f, _mm_mul_ps(_mm_sub_ps(C, A), y));
+                f = _mm_add_ps(f, _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_sub_ps(_mm_add_ps(A, D), B), C), x), y));
+                _mm_storeu_ps(out[ch], f);
+            }
+
+        } else {
+
+            float wx[4][4], wy[4][4]; // [tap][lane]
+            float xs[4], ys[4];
+            _mm_storeu_ps(xs, x);
+            _mm_storeu_ps(ys, y);
+            for (unsigned int k = 0; k < 4; k++){
+                float w[4];
+                cubicWeights(xs[k], w);
+                for (unsigned int t = 0; t < 4; t++) wx[t][k] = w[t];
+                cubicWeights(ys[k], w);
+                for (unsigned int t = 0; t < 4; t++) wy[t][k] = w[t];
+            }
+
+            __m128 acc[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+            for (int tr = 0; tr < 4; tr++){
+                __m128 row[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+                for (int tc = 0; tc < 4; tc++){
+                    int v[4];
+                    for (unsigned int k = 0; k < 4; k++){
+                        v[k] = load32(data + offset[k] + (tr - 1) * stride + (tc - 1) * 3);
+                    }
+                    const __m128i pv = _mm_loadu_si128((const __m128i*) v);
+                    const __m128 w = _mm_loadu_ps(wy[tc]);
+                    for (int ch = 0; ch < 3; ch++){
+                        row[ch] = _mm_add_ps(row[ch], _mm_mul_ps(w, channelSSE(pv, ch)));
+                    }
+                }
+                const __m128 w = _mm_loadu_ps(wx[tr]);
+                for (int ch = 0; ch < 3; ch++){
+                    acc[ch] = _mm_add_ps(acc[ch], _mm_mul_ps(w, row[ch]));
+                }
+            }
+            for (int ch = 0; ch < 3; ch++){
+                _mm_storeu_ps(out[ch], acc[ch]);
+            }
+        }
+
+        for (unsigned int k = 0; k < 4; k++){
+            _rgb[3 * (i + k)]     = out[0][k];
+            _rgb[3 * (i + k) + 1] = out[1][k];
+            _rgb[3 * (i + k) + 2] = out[2][k];
+        }
+    }
+
+    sampleScalar(_image, _rows + i, _columns + i, _n - i, _rgb + 3 * i, _mode);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 channelAVX2(__m256i _pixels, int _channel){
+    const __m256i shifted = _mm256_srl_epi32(_pixels, _mm_cvtsi32_si128(8 * _channel));
+    return _mm256_cvtepi32_ps(_mm256_and_si256(shifted, _mm256_set1_epi32(0xFF)));
+}
+
+__attribute__((target("avx2")))
+static inline void cubicWeightsAVX2(__m256 _t, __m256 _w[4]){
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 two = _mm256_set1_ps(2.0f);
+    const __m256 t2 = _mm256_mul_ps(_t, _t);
+    _w[0] = _mm256_mul_ps(_t, _mm256_add_ps(_mm256_set1_ps(-1.0f), _mm256_mul_ps(_t, _mm256_sub_ps(two, _t))));
+    _w[1] = _mm256_add_ps(one, _mm256_mul_ps(t2, _mm256_sub_ps(_t, two)));
+    _w[2] = _mm256_mul_ps(_t, _mm256_add_ps(one, _mm256_mul_ps(_t, _mm256_sub_ps(one, _t))));
+    _w[3] = _mm256_mul_ps(t2, _mm256_sub_ps(_t, one));
+}
+
+__attribute__((target("avx2")))
+static void sampleAVX2(const Image& _image, const float* _rows, const float* _columns, size_t _n, float* _rgb, InterpolateMode _mode){
+
+    const int* data = (const int*) _image.getRow(0);
+    const int stride = _image.getStride();
+    const __m256i width = _mm256_set1_epi32(_image.getWidth());
+    const __m256i height = _mm256_set1_epi32(_image.getHeight());
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i vstride = _mm256_set1_epi32(stride);
+    const __m256i three = _mm256_set1_epi32(3);
+    const __m256 half = _mm256_set1_ps(0.5f);
+
+    size_t i = 0;
+    for (; i + 8 <= _n; i += 8){
+
+        const __m256 r = _mm256_sub_ps(_mm256_loadu_ps(_rows + i), half);
+        const __m256 c = _mm256_sub_ps(_mm256_loadu_ps(_columns + i), half);
+        const __m256 r_floor = _mm256_floor_ps(r);
+        const __m256 c_floor = _mm256_floor_ps(c);
+        const __m256 x = _mm256_sub_ps(r, r_floor);
+        const __m256 y = _mm256_sub_ps(c, c_floor);
+        const __m256i r_base = _mm256_max_epi32(_mm256_cvtps_epi32(r_floor), zero);
+        const __m256i c_base = _mm256_max_epi32(_mm256_cvtps_epi32(c_floor), zero);
+
+        // Samples in the edges of the image are left to the scalar kernel
+        __m256i inside;
+        if (_mode == BILINEAR){
+            inside = _mm256_and_si256(_mm256_cmpgt_epi32(height, _mm256_add_epi32(r_base, one)),
+                                      _mm256_cmpgt_epi32(width, _mm256_add_epi32(c_base, one)));
+        } else {
+            inside = _mm256_and_si256(_mm256_cmpgt_epi32(height, _mm256_add_epi32(r_base, three)),
+                                      _mm256_cmpgt_epi32(width, _mm256_add_epi32(c_base, _mm256_set1_epi32(2))));
+            inside = _mm256_and_si256(inside, _mm256_and_si256(_mm256_cmpgt_epi32(r_base, zero), _mm256_cmpgt_epi32(c_base, zero)));
+        }
+        if (_mm256_movemask_ps(_mm256_castsi256_ps(inside)) != 0xFF){
+            sampleScalar(_image, _rows + i, _columns + i, 8, _rgb + 3 * i, _mode);
+            continue;
+        }
+
+        const __m256i offset = _mm256_add_epi32(_mm256_mullo_epi32(r_base, vstride), _mm256_mullo_epi32(c_base, three));
+
+        __m256 out[3];
+
+        if (_mode == BILINEAR){
+
+            const __m256i pa = _mm256_i32gather_epi32(data, offset, 1);                                       // f(0,0)
+            const __m256i pb = _mm256_i32gather_epi32(data, _mm256_add_epi32(offset, vstride), 1);            // f(1,0)
+            const __m256i pc = _mm256_i32gather_epi32(data, _mm256_add_epi32(offset, three), 1);              // f(0,1)
+            const __m256i pd = _mm256_i32gather_epi32(data, _mm256_add_epi32(offset, _mm256_add_epi32(vstride, three)), 1); // f(1,1)
+
+            for (int ch = 0; ch < 3; ch++){
+                const __m256 A = channelAVX2(pa, ch);
+                const __m256 B = channelAVX2(pb, ch);
+                const __m256 C = channelAVX2(pc, ch);
+                const __m256 D = channelAVX2(pd, ch);
+                // Same expression as the scalar version: A + (B-A)x + (C-A)y + (A+D-B-C)xy
+                __m256 f = _mm256_add_ps(A, _mm256_mul_ps(_mm256_sub_ps(B, A), x));
+                f = _mm256_add_ps(f, _mm256_mul_ps(_mm256_sub_ps(C, A), y));
+                f = _mm256_add_ps(f, _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(A, D), B), C), x), y));
+                out[ch] = f;
+            }
+
+        } else {
+
+            __m256 wx[4], wy[4];
+            cubicWeightsAVX2(x, wx);
+            cubicWeightsAVX2(y, wy);
+
+            out[0] = out[1] = out[2] = _mm256_setzero_ps();
+            for (int tr = 0; tr < 4; tr++){
+                __m256 row[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+                const __m256i row_offset = _mm256_add_epi32(offset, _mm256_set1_epi32((tr - 1) * stride - 3));
+                for (int tc = 0; tc < 4; tc++){
+                    const __m256i pv = _mm256_i32gather_epi32(data, _mm256_add_epi32(row_offset, _mm256_set1_epi32(3 * tc)), 1);
+                    for (int ch = 0; ch < 3; ch++){
+                        row[ch] = _mm256_add_ps(row[ch], _mm256_mul_ps(wy[tc], channelAVX2(pv, ch)));
+                    }
+                }
+                for (int ch = 0; ch < 3; ch++){
+                    out[ch] = _mm256_add_ps(out[ch], _mm256_mul_ps(wx[tr], row[ch]));
+                }
+            }
+        }
+
+        float res[3][8];
+        for (int ch = 0; ch < 3; ch++){
+            _mm256_storeu_ps(res[ch], out[ch]);
+        }
+        for (unsigned int k = 0; k < 8; k++){
+            _rgb[3 * (i + k)]     = res[0][k];
+            _rgb[3 * (i + k) + 1] = res[1][k];
+            _rgb[3 * (i + k) + 2] = res[2][k];
+        }
+    }
+
+    sampleScalar(_image, _rows + i, _columns + i, _n - i, _rgb + 3 * i, _mode);
+}
+
+#endif
+
+// The kernel is chosen once, depending on what the CPU supports
+static SampleKernel selectSampleKernel(){
+#ifdef IMAGE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")){
+        return sampleAVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")){
+        return sampleSSE;
+    }
+#endif
+    return sampleScalar;
+}
+
+void Image::interpolate (const float* _rows, const float* _columns, size_t _n, float* _rgb, InterpolateMode _mode) const {
+
+    static const SampleKernel kernel = selectSampleKernel();
+
+    if (_mode != BILINEAR && _mode != BICUBIC){
+        sampleScalar(*this, _rows, _columns, _n, _rgb, _mode);
+        return;
+    }
+
+    // Vectorized kernels address pixels with 32-bit offsets
+    if (getSizeInBytes() >= (size_t) INT_MAX - 4 * (size_t) stride_){
+        sampleScalar(*this, _rows, _columns, _n, _rgb, _mode);
+        return;
+    }
+
+    kernel(*this, _rows, _columns, _n, _rgb, _mode);
 }
 
 void Image::save(const std::string& _fileName){
 
-    char * name = new char[_fileName.length()+1];
-    strcpy(name, _fileName.c_str());
+    // JPEG and PNG files are compressed in parallel bands straight from the pixels
+    if (ImageEncoder::handles(_fileName)){
+        if (!ImageEncoder().save(*this, _fileName)){
+            std::cerr << "Image " << _fileName << " could not be saved" << std::endl;
+        }
+        return;
+    }
 
-    this->imageFile_.convertTo24Bits();
-    this->imageFile_.save(name);
+    // Other formats go through FreeImage
+    fipImage imageFile(FIT_BITMAP, width_, height_, 24);
+
+    for (unsigned int row = 0; row < height_; row++){
+        const unsigned char* src = getRow(row);
+        BYTE* dst = imageFile.getScanLine(row);
+        for (unsigned int col = 0; col < width_; col++, src += 3, dst += 3){
+            dst[FI_RGBA_RED] = src[0];
+            dst[FI_RGBA_GREEN] = src[1];
+            dst[FI_RGBA_BLUE] = src[2];
+        }
+    }
+
+    if (!imageFile.save(_fileName.c_str())){
+        std::cerr << "Image " << _fileName << " could not be saved" << std::endl;
+    }
 
 }
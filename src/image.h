@@ -27,42 +27,142 @@
 
 #include <FreeImagePlus.h>
 #include <iostream>
+#include <vector>
+#include <memory>
+#include <cassert>
 #include <math.h>
 
 #include "color.h"
 
 typedef enum {BICUBIC, BILINEAR} InterpolateMode;
 
+// Images keep their pixels in a contiguous buffer of interleaved 8-bit RGB
+// triplets, so FreeImage is only used to load and save them. Rows follow the
+// FreeImage convention: row 0 is the bottom row of the picture. The buffer is
+// either owned by the image or external memory (e.g. a memory-mapped file).
 class Image {
 
 public:
 
     Image();
     Image(const std::string& _fileName);
+    // Decodes the image at mip level _level, or at the closest level below it the
+    // decoder can produce directly (JPEG images, up to level 3). Check getLevel()
+    Image(const std::string& _fileName, unsigned int _level);
     Image(unsigned int _height, unsigned int _width, Color _background = Color(127,127,127,1)); // Images are set to grey if no other color is specified
+    // Wraps external pixels without copying them. _owner keeps the memory alive, and
+    // _data must hold _height rows of _stride bytes plus the padding byte
+    Image(unsigned int _height, unsigned int _width, unsigned int _stride, unsigned char* _data, const std::shared_ptr<void>& _owner, const std::string& _name = "");
+    Image(const Image& _other);
+    Image(Image&& _other);
+    Image& operator= (const Image& _other);
+    Image& operator= (Image&& _other);
 
     // Data access
-    Color getColor (unsigned int _row, unsigned int _column) const;
-    void setColor (const Color& _color, unsigned int _row, unsigned int _column);
-    
+    inline Color getColor (unsigned int _row, unsigned int _column) const {
+        assert(_row < height_);
+        assert(_column < width_);
+        return Color(getPixel(_row, _column));
+    }
+    inline void setColor (const Color& _color, unsigned int _row, unsigned int _column){
+        assert(_row < height_);
+        assert(_column < width_);
+        unsigned char* p = getPixel(_row, _column);
+        p[0] = toByte(_color.getRed());
+        p[1] = toByte(_color.getGreen());
+        p[2] = toByte(_color.getBlue());
+    }
+
+    // Raw access: each row has getStride() bytes, 3 per pixel (R, G, B)
+    inline const unsigned char* getRow (unsigned int _row) const {
+        return data_ + (size_t) _row * stride_;
+    }
+    inline unsigned char* getRow (unsigned int _row){
+        return data_ + (size_t) _row * stride_;
+    }
+    inline const unsigned char* getPixel (unsigned int _row, unsigned int _column) const {
+        return data_ + (size_t) _row * stride_ + 3 * _column;
+    }
+    inline unsigned char* getPixel (unsigned int _row, unsigned int _column){
+        return data_ + (size_t) _row * stride_ + 3 * _column;
+    }
+    inline unsigned int getStride () const {
+        return stride_;
+    }
+
     // gets the color of the specified position (_row, _column)
     // by interpolating its value through bicubic interpolation
     Color interpolate (float _row, float _column, InterpolateMode _mode = BICUBIC) const;
 
+    // Batched version of interpolate: samples the _n positions given by
+    // _rows and _columns, and writes the results as packed RGB triplets
+    // in _rgb (3 * _n floats). AVX2 or SSE kernels are used when the CPU
+    // supports them, otherwise it falls back to interpolating one by one
+    void interpolate (const float* _rows, const float* _columns, size_t _n, float* _rgb, InterpolateMode _mode = BICUBIC) const;
+
     inline unsigned int getWidth () const {
         return width_;
     }
     inline unsigned int getHeight () const {
         return height_;
     }
+    // Memory used by the pixel data
+    inline size_t getSizeInBytes () const {
+        return (size_t) stride_ * height_ + 1;
+    }
+    // Mip level of the image (0 is full resolution) and dimensions of the
+    // full resolution image it comes from
+    inline unsigned int getLevel () const {
+        return level_;
+    }
+    inline unsigned int getFullWidth () const {
+        return fullWidth_;
+    }
+    inline unsigned int getFullHeight () const {
+        return fullHeight_;
+    }
+    // Images can be a window of a bigger one: this is the position of their
+    // first row and column, measured in pixels of their own mip level
+    inline unsigned int getRowOffset () const {
+        return rowOffset_;
+    }
+    inline unsigned int getColumnOffset () const {
+        return columnOffset_;
+    }
+    // Next mip level: half the resolution, each pixel averaging a 2x2 block
+    // (blocks are aligned with the full image, not with the window)
+    Image downsample() const;
+    // Window of the image, clamped to its bounds. Images in external memory
+    // share it with the window, the rest copy the pixels
+    Image crop(unsigned int _row, unsigned int _column, unsigned int _height, unsigned int _width) const;
+    // True if the pixels live in external memory
+    inline bool isExternal () const {
+        return external_ != nullptr;
+    }
 
     // I/0
     void save(const std::string& _fileName);
 
 private:
 
-    fipImage imageFile_;
-    unsigned int width_, height_;
+    // Colors are clamped to [0, 255] before being stored
+    static inline unsigned char toByte (float _value){
+        return (unsigned char) (_value < 0.0f ? 0.0f : (_value > 255.0f ? 255.0f : _value));
+    }
+
+    // Points data_ to the right buffer after a copy or a move
+    void rebind(const Image& _other);
+
+    // There is an extra byte at the end of the buffer, so any pixel
+    // can be read as a 32-bit word by the vectorized samplers
+    std::vector<unsigned char> pixels_;
+    // External buffers are kept alive by this pointer
+    std::shared_ptr<void> external_;
+    // Either pixels_.data() or the external buffer
+    unsigned char* data_;
+    unsigned int width_, height_, stride_;
+    unsigned int level_, fullWidth_, fullHeight_;
+    unsigned int rowOffset_, columnOffset_;
     std::string name_;
 
 };
@@ -0,0 +1,288 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <sstream>
+
+#include "imagecache.h"
+
+ImageCache::ImageCache(size_t _budget){
+    budget_ = _budget;
+    used_ = 0;
+    hits_ = misses_ = evictions_ = prefetches_ = 0;
+}
+
+ImageCache::~ImageCache(){
+}
+
+void ImageCache::setBudget(size_t _budget){
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_ = _budget;
+    evict();
+}
+
+size_t ImageCache::getBudget() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return budget_;
+}
+
+void ImageCache::setStore(const std::string& _directory){
+    store_.reset(new ImageStore(_directory));
+}
+
+void ImageCache::setRegion(const std::string& _fileName, unsigned int _row, unsigned int _column, unsigned int _height, unsigned int _width){
+
+    std::vector<unsigned int> region (4);
+    region[0] = _row;
+    region[1] = _column;
+    region[2] = _height;
+    region[3] = _width;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::vector<unsigned int>& current = regions_[_fileName];
+    if (current == region){
+        return;
+    }
+    current = region;
+    drop(_fileName);
+}
+
+void ImageCache::setBaseLevel(const std::string& _fileName, unsigned int _level){
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::map<std::string, unsigned int>::iterator it = baseLevels_.find(_fileName);
+    if (it == baseLevels_.end() ? _level == 0 : it->second == _level){
+        return;
+    }
+    baseLevels_[_fileName] = _level;
+    drop(_fileName);
+}
+
+void ImageCache::drop(const std::string& _fileName){
+
+    // Every level of the image is dropped
+    std::list<Entry>::iterator it = lru_.begin();
+    while (it != lru_.end()){
+        if (it->name == _fileName || it->name.compare(0, _fileName.size() + 1, _fileName + "@") == 0){
+            used_ -= it->bytes;
+            index_.erase(it->name);
+            it = lru_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+std::shared_ptr<const Image> ImageCache::get(const std::string& _fileName, unsigned int _level){
+    return load(_fileName, _level, false);
+}
+
+void ImageCache::prefetch(const std::string& _fileName, unsigned int _level){
+    // A failed prefetch is not an error by itself: the image is decoded
+    // again when it is needed, and the error is reported there
+    try {
+        load(_fileName, _level, true);
+    } catch (...) {
+    }
+}
+
+std::shared_ptr<const Image> ImageCache::load(const std::string& _fileName, unsigned int _level, bool _prefetch){
+
+    std::promise<std::shared_ptr<const Image> > promise;
+
+    // Every level is stored as a different image
+    std::string key = _fileName;
+    if (_level > 0){
+        std::stringstream ss;
+        ss << _fileName << "@" << _level;
+        key = ss.str();
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        std::unordered_map<std::string, std::list<Entry>::iterator>::iterator it = index_.find(key);
+        if (it != index_.end()){
+            if (_prefetch){
+                return it->second->image;
+            }
+            hits_++;
+            // The image becomes the most recently used one
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return it->second->image;
+        }
+
+        std::map<std::string, PendingImage>::iterator pit = pending_.find(key);
+        if (pit != pending_.end()){
+            // Somebody else is already decoding it
+            if (!_prefetch){
+                hits_++;
+            }
+            PendingImage pending = pit->second;
+            lock.unlock();
+            return pending.get();
+        }
+
+        if (_prefetch){
+            prefetches_++;
+        } else {
+            misses_++;
+        }
+        pending_[key] = promise.get_future().share();
+    }
+
+    // If decoding fails (for instance, out of memory), the image is no longer pending, so the
+    // threads waiting for it get the error and later requests try again
+    std::shared_ptr<const Image> image;
+    try {
+        std::vector<unsigned int> region;
+        unsigned int baseLevel = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            std::map<std::string, std::vector<unsigned int> >::const_iterator rit = regions_.find(_fileName);
+            if (rit != regions_.end()){
+                region = rit->second;
+            }
+            std::map<std::string, unsigned int>::const_iterator bit = baseLevels_.find(_fileName);
+            if (bit != baseLevels_.end()){
+                baseLevel = bit->second;
+            }
+        }
+
+        // Decoding happens outside the lock, so other threads can keep on reading.
+        // Mip levels above the base level are built from the previous one, which is cached as well
+        if (_level > 0 && _level > baseLevel){
+            image = std::make_shared<const Image>(load(_fileName, _level - 1, _prefetch)->downsample());
+        } else {
+            if (_level > 0){
+                Image decoded (_fileName, _level);
+                while (decoded.getLevel() < _level && decoded.getWidth() > 0){
+                    decoded = decoded.downsample();
+                }
+                image = std::make_shared<const Image>(std::move(decoded));
+            } else if (store_){
+                image = store_->load(_fileName);
+            } else {
+                image = std::make_shared<const Image>(_fileName);
+            }
+
+            // Only the window is kept (its bounds are given at full resolution)
+            if (!region.empty()){
+                const unsigned int scale = 1 << _level;
+                const unsigned int row = region[0] / scale;
+                const unsigned int col = region[1] / scale;
+                const unsigned int last_row = (region[0] + region[2] + scale - 1) / scale;
+                const unsigned int last_col = (region[1] + region[3] + scale - 1) / scale;
+                if (last_row - row < image->getHeight() || last_col - col < image->getWidth()){
+                    image = std::make_shared<const Image>(image->crop(row, col, last_row - row, last_col - col));
+                }
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+
+            Entry entry;
+            entry.name = key;
+            entry.image = image;
+            entry.bytes = image->getSizeInBytes();
+
+            lru_.push_front(entry);
+            try {
+                index_[key] = lru_.begin();
+            } catch (...) {
+                lru_.pop_front();
+                throw;
+            }
+            used_ += entry.bytes;
+            pending_.erase(key);
+
+            evict();
+        }
+    } catch (...) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.erase(key);
+        }
+        promise.set_exception(std::current_exception());
+        throw;
+    }
+
+    promise.set_value(image);
+
+    return image;
+}
+
+void ImageCache::clear(){
+    std::lock_guard<std::mutex> lock(mutex_);
+    lru_.clear();
+    index_.clear();
+    used_ = 0;
+}
+
+size_t ImageCache::getUsedBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return used_;
+}
+
+size_t ImageCache::getNImages() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return lru_.size();
+}
+
+unsigned long ImageCache::getHits() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return hits_;
+}
+
+unsigned long ImageCache::getMisses() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return misses_;
+}
+
+unsigned long ImageCache::getEvictions() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return evictions_;
+}
+
+unsigned long ImageCache::getPrefetches() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return prefetches_;
+}
+
+void ImageCache::evict(){
+
+    if (budget_ == 0){
+        return;
+    }
+
+    while (used_ > budget_ && lru_.size() > 1){
+        const Entry& last = lru_.back();
+        used_ -= last.bytes;
+        index_.erase(last.name);
+        lru_.pop_back();
+        evictions_++;
+    }
+}
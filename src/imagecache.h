@@ -0,0 +1,125 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef IMAGECACHE_H
+#define IMAGECACHE_H
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <unordered_map>
+
+#include "image.h"
+#include "imagestore.h"
+
+// Thread-safe image cache with a memory budget (in bytes) and
+// least-recently-used eviction. Images are handed out as shared
+// pointers, so an image that gets evicted while some thread is
+// still sampling it stays alive until that thread releases it.
+class ImageCache {
+
+public:
+
+    ImageCache(size_t _budget = 0);
+    virtual ~ImageCache();
+
+    // Memory budget in bytes. 0 means there is no limit
+    void setBudget(size_t _budget);
+    size_t getBudget() const;
+
+    // Images are decoded through an on-disk store of decoded images kept
+    // in _directory. Must be called before the cache is used
+    void setStore(const std::string& _directory);
+
+    // Only the window starting at (_row, _column), of _height x _width pixels, of the
+    // image is kept once decoded (full resolution coordinates). Cached copies of the
+    // image are dropped if the window changes
+    void setRegion(const std::string& _fileName, unsigned int _row, unsigned int _column, unsigned int _height, unsigned int _width);
+    // Lowest mip level that will be requested for the image. It is decoded straight at
+    // that level when the format allows it (see Image). Cached copies are dropped if it changes
+    void setBaseLevel(const std::string& _fileName, unsigned int _level);
+
+    // Returns the requested image, decoding it in case it is not in the cache.
+    // If another thread is already decoding the same image, it waits for it
+    // instead of decoding it twice. Levels above 0 are mip levels, which are
+    // cached on their own and built from the previous level when missing
+    std::shared_ptr<const Image> get(const std::string& _fileName, unsigned int _level = 0);
+
+    // Decodes the image and stores it in the cache, in case it is not there yet.
+    // Meant for prefetching: it neither counts as a hit or a miss, nor does it
+    // change the order of the images already in the cache. Errors are ignored
+    void prefetch(const std::string& _fileName, unsigned int _level = 0);
+
+    // Removes every image from the cache (statistics are kept)
+    void clear();
+
+    // Statistics
+    size_t getUsedBytes() const;
+    size_t getNImages() const;
+    unsigned long getHits() const;
+    unsigned long getMisses() const;
+    unsigned long getEvictions() const;
+    unsigned long getPrefetches() const;
+
+private:
+
+    struct Entry {
+        std::string name; // file name, plus "@level" for mip levels
+        std::shared_ptr<const Image> image;
+        size_t bytes;
+    };
+
+    typedef std::shared_future<std::shared_ptr<const Image> > PendingImage;
+
+    // Common path of get and prefetch
+    std::shared_ptr<const Image> load(const std::string& _fileName, unsigned int _level, bool _prefetch);
+
+    // Removes every level of the image from the cache. mutex_ must be locked
+    void drop(const std::string& _fileName);
+    // Removes the least recently used images until the budget is met.
+    // The most recent one is never removed. mutex_ must be locked
+    void evict();
+
+    // Most recently used images are at the front of the list
+    std::list<Entry> lru_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+    // Images that are being decoded right now
+    std::map<std::string, PendingImage> pending_;
+    // Windows of the images: row, column, height and width
+    std::map<std::string, std::vector<unsigned int> > regions_;
+    std::map<std::string, unsigned int> baseLevels_;
+
+    // Optional store of decoded images
+    std::unique_ptr<ImageStore> store_;
+
+    mutable std::mutex mutex_;
+
+    size_t budget_, used_;
+    unsigned long hits_, misses_, evictions_, prefetches_;
+
+};
+
+#endif // IMAGECACHE_H
@@ -0,0 +1,383 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csetjmp>
+#include <climits>
+#include <algorithm>
+#include <omp.h>
+
+#include <jpeglib.h>
+#include <zlib.h>
+
+#include "imageencoder.h"
+
+// jpeg_set_defaults subsamples the chroma by 2 in both directions, so the
+// blocks (MCUs) the picture is coded in are 16x16 pixels
+static const unsigned int JPEG_MCU_SIZE = 16;
+
+static const unsigned char PNG_SIGNATURE[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+
+// libjpeg reports errors through a callback that must not return
+struct JPEGErrorManager {
+    jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+static void jpegErrorExit(j_common_ptr _cinfo){
+    (*_cinfo->err->output_message)(_cinfo);
+    longjmp(((JPEGErrorManager*) _cinfo->err)->jump, 1);
+}
+
+static void putBigEndian(unsigned char* _dst, unsigned int _value){
+    _dst[0] = (_value >> 24) & 0xFF;
+    _dst[1] = (_value >> 16) & 0xFF;
+    _dst[2] = (_value >> 8) & 0xFF;
+    _dst[3] = _value & 0xFF;
+}
+
+static bool writePNGChunk(FILE* _file, const char* _type, const unsigned char* _data, size_t _length){
+    unsigned char header[8];
+    putBigEndian(header, (unsigned int) _length);
+    memcpy(header + 4, _type, 4);
+    unsigned long crc = crc32(0L, header + 4, 4);
+    if (_length > 0){
+        crc = crc32(crc, _data, (uInt) _length);
+    }
+    unsigned char footer[4];
+    putBigEndian(footer, (unsigned int) crc);
+    return fwrite(header, 1, 8, _file) == 8 && fwrite(_data, 1, _length, _file) == _length && fwrite(footer, 1, 4, _file) == 4;
+}
+
+static inline unsigned char paeth(int _a, int _b, int _c){
+    const int p = _a + _b - _c;
+    const int pa = abs(p - _a), pb = abs(p - _b), pc = abs(p - _c);
+    if (pa <= pb && pa <= pc){
+        return _a;
+    }
+    return pb <= pc ? _b : _c;
+}
+
+ImageEncoder::ImageEncoder(unsigned int _bandRows, int _jpegQuality){
+    bandRows_ = std::max(JPEG_MCU_SIZE, (_bandRows + JPEG_MCU_SIZE - 1) / JPEG_MCU_SIZE * JPEG_MCU_SIZE);
+    jpegQuality_ = _jpegQuality;
+}
+
+ImageEncoder::~ImageEncoder(){
+}
+
+bool ImageEncoder::handles(const std::string& _fileName){
+
+    const size_t dot = _fileName.find_last_of('.');
+    if (dot == std::string::npos){
+        return false;
+    }
+    std::string extension = _fileName.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    return extension.compare("jpg") == 0 || extension.compare("jpeg") == 0 || extension.compare("png") == 0;
+}
+
+bool ImageEncoder::save(const Image& _image, const std::string& _fileName) const {
+
+    if (!handles(_fileName) || _image.getWidth() == 0 || _image.getHeight() == 0){
+        return false;
+    }
+
+    FILE* file = fopen(_fileName.c_str(), "wb");
+    if (file == NULL){
+        return false;
+    }
+
+    std::string extension = _fileName.substr(_fileName.find_last_of('.') + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+
+    bool ok;
+    if (extension.compare("png") == 0){
+        ok = savePNG(_image, file);
+    } else {
+        ok = saveJPEG(_image, file);
+    }
+
+    return fclose(file) == 0 && ok;
+}
+
+bool ImageEncoder::saveJPEG(const Image& _image, FILE* _file) const {
+
+    const unsigned int width = _image.getWidth();
+    const unsigned int height = _image.getHeight();
+
+    // Each band is one restart interval, which holds at most 65535 blocks
+    const unsigned int mcusPerRow = (width + JPEG_MCU_SIZE - 1) / JPEG_MCU_SIZE;
+    if (mcusPerRow > 65535){
+        return false;
+    }
+    const unsigned int mcuRows = std::max(1u, std::min(bandRows_ / JPEG_MCU_SIZE, 65535 / mcusPerRow));
+    const unsigned int bandRows = mcuRows * JPEG_MCU_SIZE;
+    const unsigned int restartInterval = mcuRows * mcusPerRow;
+
+    const unsigned int nBands = (height + bandRows - 1) / bandRows;
+    const unsigned int group = 2 * omp_get_max_threads();
+    std::vector<std::vector<unsigned char> > bands (group);
+
+    for (unsigned int first = 0; first < nBands; first += group){
+
+        const unsigned int last = std::min(nBands, first + group);
+        bool ok = true;
+
+        #pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+        for (unsigned int b = first; b < last; b++){
+            const unsigned int row = b * bandRows;
+            ok = encodeJPEGBand(_image, row, std::min(bandRows, height - row), restartInterval, bands[b - first]) && ok;
+        }
+        if (!ok){
+            return false;
+        }
+
+        for (unsigned int b = first; b < last; b++){
+
+            const std::vector<unsigned char>& band = bands[b - first];
+
+            // Headers are skipped up to the start of the scan (SOS), whose
+            // entropy-coded data runs until the end marker (EOI)
+            size_t pos = 2, sof = 0;
+            while (pos + 4 <= band.size() && band[pos] == 0xFF && band[pos + 1] != 0xDA){
+                if (band[pos + 1] == 0xC0){
+                    sof = pos;
+                }
+                pos += 2 + ((band[pos + 2] << 8) | band[pos + 3]);
+            }
+            if (pos + 4 > band.size() || band[pos] != 0xFF || sof == 0){
+                return false;
+            }
+            const size_t scan = pos + 2 + ((band[pos + 2] << 8) | band[pos + 3]);
+            const size_t end = band.size() - 2;
+
+            if (b == 0){
+                // The headers of the first band are used, with the height of the whole picture
+                std::vector<unsigned char> header (band.begin(), band.begin() + scan);
+                header[sof + 5] = (height >> 8) & 0xFF;
+                header[sof + 6] = height & 0xFF;
+                if (fwrite(header.data(), 1, header.size(), _file) != header.size()){
+                    return false;
+                }
+            } else {
+                const unsigned char restart[2] = {0xFF, (unsigned char) (0xD0 + ((b - 1) & 7))};
+                if (fwrite(restart, 1, 2, _file) != 2){
+                    return false;
+                }
+            }
+            if (fwrite(band.data() + scan, 1, end - scan, _file) != end - scan){
+                return false;
+            }
+        }
+    }
+
+    const unsigned char eoi[2] = {0xFF, 0xD9};
+    return fwrite(eoi, 1, 2, _file) == 2;
+}
+
+bool ImageEncoder::encodeJPEGBand(const Image& _image, unsigned int _first, unsigned int _rows, unsigned int _restartInterval, std::vector<unsigned char>& _out) const {
+
+    jpeg_compress_struct cinfo;
+    JPEGErrorManager jerr;
+    unsigned char* buffer = NULL;
+    unsigned long size = 0;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = jpegErrorExit;
+    if (setjmp(jerr.jump)){
+        jpeg_destroy_compress(&cinfo);
+        free(buffer);
+        return false;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &buffer, &size);
+
+    cinfo.image_width = _image.getWidth();
+    cinfo.image_height = _rows;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    // Standard Huffman tables, so every band is coded with the same ones
+    jpeg_set_quality(&cinfo, jpegQuality_, TRUE);
+    cinfo.optimize_coding = FALSE;
+    cinfo.restart_interval = _restartInterval;
+
+    jpeg_start_compress(&cinfo, TRUE);
+
+    // Picture rows go top-down and image rows bottom-up. Rows are read in place
+    JSAMPROW rows[JPEG_MCU_SIZE];
+    while (cinfo.next_scanline < cinfo.image_height){
+        const unsigned int n = std::min(JPEG_MCU_SIZE, cinfo.image_height - cinfo.next_scanline);
+        for (unsigned int i = 0; i < n; i++){
+            rows[i] = (JSAMPROW) _image.getRow(_image.getHeight() - 1 - (_first + cinfo.next_scanline + i));
+        }
+        jpeg_write_scanlines(&cinfo, rows, n);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    _out.assign(buffer, buffer + size);
+    free(buffer);
+
+    return true;
+}
+
+bool ImageEncoder::savePNG(const Image& _image, FILE* _file) const {
+
+    const unsigned int width = _image.getWidth();
+    const unsigned int height = _image.getHeight();
+
+    // 8-bit RGB, not interlaced
+    unsigned char ihdr[13];
+    putBigEndian(ihdr, width);
+    putBigEndian(ihdr + 4, height);
+    ihdr[8] = 8;
+    ihdr[9] = 2;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    if (fwrite(PNG_SIGNATURE, 1, 8, _file) != 8 || !writePNGChunk(_file, "IHDR", ihdr, 13)){
+        return false;
+    }
+
+    const unsigned int nBands = (height + bandRows_ - 1) / bandRows_;
+    const unsigned int group = 2 * omp_get_max_threads();
+    std::vector<std::vector<unsigned char> > bands (group);
+    std::vector<unsigned long> adlers (group);
+    const size_t rowBytes = 1 + 3 * (size_t) width;
+
+    unsigned long adler = adler32(0L, Z_NULL, 0);
+
+    for (unsigned int first = 0; first < nBands; first += group){
+
+        const unsigned int last = std::min(nBands, first + group);
+        bool ok = true;
+
+        #pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+        for (unsigned int b = first; b < last; b++){
+            const unsigned int row = b * bandRows_;
+            ok = encodePNGBand(_image, row, std::min(bandRows_, height - row), b == nBands - 1, bands[b - first], adlers[b - first]) && ok;
+        }
+        if (!ok){
+            return false;
+        }
+
+        // The zlib header goes before the first band and the checksum of the
+        // whole stream after the last one
+        for (unsigned int b = first; b < last; b++){
+            std::vector<unsigned char>& band = bands[b - first];
+            const unsigned int rows = std::min(bandRows_, height - b * bandRows_);
+            adler = adler32_combine(adler, adlers[b - first], (z_off_t) (rows * rowBytes));
+            if (b == 0){
+                const unsigned char zlibHeader[2] = {0x78, 0x9C};
+                band.insert(band.begin(), zlibHeader, zlibHeader + 2);
+            }
+            if (b == nBands - 1){
+                unsigned char checksum[4];
+                putBigEndian(checksum, (unsigned int) adler);
+                band.insert(band.end(), checksum, checksum + 4);
+            }
+            if (!writePNGChunk(_file, "IDAT", band.data(), band.size())){
+                return false;
+            }
+        }
+    }
+
+    return writePNGChunk(_file, "IEND", NULL, 0);
+}
+
+bool ImageEncoder::encodePNGBand(const Image& _image, unsigned int _first, unsigned int _rows, bool _last, std::vector<unsigned char>& _out, unsigned long& _adler) const {
+
+    const unsigned int width = _image.getWidth();
+    const unsigned int height = _image.getHeight();
+    const size_t lineBytes = 3 * (size_t) width;
+
+    // Each row is filtered with the filter that gives the smallest sum of
+    // absolute differences, as libpng does. Filters look at the row above,
+    // which belongs to the previous band for the first row
+    std::vector<unsigned char> filtered (_rows * (lineBytes + 1));
+    std::vector<unsigned char> candidate (lineBytes + 1);
+    const std::vector<unsigned char> zeros (lineBytes, 0);
+
+    for (unsigned int r = 0; r < _rows; r++){
+
+        const unsigned int row = _first + r;
+        const unsigned char* cur = _image.getRow(height - 1 - row);
+        const unsigned char* up = row > 0 ? _image.getRow(height - row) : zeros.data();
+        unsigned char* dst = &filtered[r * (lineBytes + 1)];
+
+        unsigned long best = ULONG_MAX;
+        for (unsigned char filter = 0; filter < 5; filter++){
+            candidate[0] = filter;
+            unsigned long sum = 0;
+            for (size_t i = 0; i < lineBytes; i++){
+                const int a = i >= 3 ? cur[i - 3] : 0;
+                const int b = up[i];
+                const int c = i >= 3 ? up[i - 3] : 0;
+                unsigned char value;
+                switch (filter){
+                    case 0: value = cur[i]; break;
+                    case 1: value = cur[i] - a; break;
+                    case 2: value = cur[i] - b; break;
+                    case 3: value = cur[i] - ((a + b) >> 1); break;
+                    default: value = cur[i] - paeth(a, b, c); break;
+                }
+                candidate[i + 1] = value;
+                sum += value < 128 ? value : 256 - value;
+            }
+            if (sum < best){
+                best = sum;
+                memcpy(dst, candidate.data(), lineBytes + 1);
+            }
+        }
+    }
+
+    _adler = adler32(adler32(0L, Z_NULL, 0), filtered.data(), (uInt) filtered.size());
+
+    // Raw deflate stream. Bands other than the last end with a sync flush, which
+    // aligns them to a byte so the next band can start a fresh stream after them
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK){
+        return false;
+    }
+
+    _out.resize(deflateBound(&stream, filtered.size()) + 16);
+    stream.next_in = filtered.data();
+    stream.avail_in = filtered.size();
+    stream.next_out = _out.data();
+    stream.avail_out = _out.size();
+
+    const int result = deflate(&stream, _last ? Z_FINISH : Z_SYNC_FLUSH);
+    const bool ok = (_last ? result == Z_STREAM_END : result == Z_OK) && stream.avail_in == 0;
+    _out.resize(_out.size() - stream.avail_out);
+    deflateEnd(&stream);
+
+    return ok;
+}
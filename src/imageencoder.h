@@ -0,0 +1,70 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef IMAGEENCODER_H
+#define IMAGEENCODER_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include "image.h"
+
+// Writes JPEG and PNG files straight from the pixels of an Image, without
+// converting them to a FreeImage bitmap first. The picture is split in bands
+// of rows that are compressed in parallel and written to disk in order, so
+// only a few compressed bands are held in memory at a time:
+//  - JPEG: each band is one restart interval of the file, so bands are
+//    encoded independently and joined with restart markers.
+//  - PNG: each band is an independent deflate stream ended with a sync
+//    flush, and the bands go in consecutive IDAT chunks.
+class ImageEncoder {
+
+public:
+
+    // _bandRows is rounded up to a multiple of the JPEG block height
+    ImageEncoder(unsigned int _bandRows = 256, int _jpegQuality = 75);
+    virtual ~ImageEncoder();
+
+    // True for the formats the encoder writes (by file extension)
+    static bool handles(const std::string& _fileName);
+
+    // Returns false if the file could not be written
+    bool save(const Image& _image, const std::string& _fileName) const;
+
+private:
+
+    bool saveJPEG(const Image& _image, FILE* _file) const;
+    bool savePNG(const Image& _image, FILE* _file) const;
+
+    // Compresses the picture rows [_first, _first + _rows), counted from the top
+    bool encodeJPEGBand(const Image& _image, unsigned int _first, unsigned int _rows, unsigned int _restartInterval, std::vector<unsigned char>& _out) const;
+    bool encodePNGBand(const Image& _image, unsigned int _first, unsigned int _rows, bool _last, std::vector<unsigned char>& _out, unsigned long& _adler) const;
+
+    unsigned int bandRows_;
+    int jpegQuality_;
+
+};
+
+#endif // IMAGEENCODER_H
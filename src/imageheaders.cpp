@@ -0,0 +1,178 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <cstdio>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <FreeImagePlus.h>
+
+#include "imageheaders.h"
+
+static const char SIDECAR_MAGIC[] = "SSMVtex image headers 1";
+
+ImageHeaders::ImageHeaders(const std::string& _sidecar){
+    sidecar_ = _sidecar;
+    nReused_ = nProbed_ = 0;
+}
+
+ImageHeaders::~ImageHeaders(){
+}
+
+void ImageHeaders::probe(const std::vector<std::string>& _fileNames, unsigned int _nThreads){
+
+    headers_.resize(_fileNames.size());
+    for (unsigned int i = 0; i < headers_.size(); i++){
+        headers_[i].name = _fileNames[i];
+        headers_[i].width = headers_[i].height = 0;
+        headers_[i].size = 0;
+        headers_[i].mtime = 0;
+    }
+
+    std::vector<Header> entries;
+    readSidecar(entries);
+
+    std::atomic<unsigned int> next (0), reused (0), probed (0);
+
+    // Threads take the images in order, one at a time
+    auto worker = [&](){
+        for (unsigned int i = next++; i < headers_.size(); i = next++){
+
+            Header& header = headers_[i];
+            struct stat info;
+            if (stat(header.name.c_str(), &info) != 0){
+                continue; // Missing image
+            }
+            header.size = info.st_size;
+            header.mtime = info.st_mtime;
+
+            // Entries of the sidecar are only valid if the image has not changed
+            Header key;
+            key.name = header.name;
+            std::vector<Header>::const_iterator it = std::lower_bound(entries.begin(), entries.end(), key,
+                [](const Header& _a, const Header& _b){ return _a.name < _b.name; });
+            if (it != entries.end() && it->name == header.name && it->size == header.size && it->mtime == header.mtime){
+                header.width = it->width;
+                header.height = it->height;
+                reused++;
+                continue;
+            }
+
+            fipImage input;
+            if (input.load(header.name.c_str(), FIF_LOAD_NOPIXELS)){
+                header.width = input.getWidth();
+                header.height = input.getHeight();
+            }
+            probed++;
+        }
+    };
+
+    const unsigned int nThreads = std::min(_nThreads, (unsigned int) headers_.size());
+    if (nThreads <= 1){
+        worker();
+    } else {
+        std::vector<std::thread> threads;
+        for (unsigned int t = 0; t < nThreads; t++){
+            threads.push_back(std::thread(worker));
+        }
+        for (unsigned int t = 0; t < threads.size(); t++){
+            threads[t].join();
+        }
+    }
+
+    nReused_ = reused;
+    nProbed_ = probed;
+
+    if (nProbed_ > 0){
+        writeSidecar();
+    }
+}
+
+bool ImageHeaders::readSidecar(std::vector<Header>& _entries) const {
+
+    _entries.clear();
+    if (sidecar_.empty()){
+        return false;
+    }
+
+    std::ifstream file (sidecar_.c_str());
+    std::string line;
+    if (!file.is_open() || !std::getline(file, line) || line.compare(SIDECAR_MAGIC) != 0){
+        return false;
+    }
+
+    // Each line: width height size mtime name
+    while (std::getline(file, line)){
+        std::stringstream ss (line);
+        Header entry;
+        if (!(ss >> entry.width >> entry.height >> entry.size >> entry.mtime) || ss.get() != ' '){
+            continue;
+        }
+        std::getline(ss, entry.name);
+        if (!entry.name.empty()){
+            _entries.push_back(entry);
+        }
+    }
+
+    std::sort(_entries.begin(), _entries.end(), [](const Header& _a, const Header& _b){ return _a.name < _b.name; });
+    return true;
+}
+
+void ImageHeaders::writeSidecar() const {
+
+    if (sidecar_.empty()){
+        return;
+    }
+
+    // Other processes may be using the same image list
+    std::stringstream tempName;
+    tempName << sidecar_ << ".tmp" << getpid();
+
+    std::ofstream file (tempName.str().c_str());
+    if (!file.is_open()){
+        std::cerr << "Image headers: " << sidecar_ << " could not be written" << std::endl;
+        return;
+    }
+
+    file << SIDECAR_MAGIC << "\n";
+    for (unsigned int i = 0; i < headers_.size(); i++){
+        const Header& header = headers_[i];
+        if (header.width > 0 && header.height > 0){
+            file << header.width << " " << header.height << " " << header.size << " " << header.mtime << " " << header.name << "\n";
+        }
+    }
+    file.close();
+
+    if (file.fail() || rename(tempName.str().c_str(), sidecar_.c_str()) != 0){
+        std::cerr << "Image headers: " << sidecar_ << " could not be written" << std::endl;
+        remove(tempName.str().c_str());
+    }
+}
@@ -0,0 +1,89 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef IMAGEHEADERS_H
+#define IMAGEHEADERS_H
+
+#include <vector>
+#include <string>
+
+// Dimensions of a list of images, read from their headers only. Headers are
+// probed by a pool of threads, since on network storage most of the time is
+// spent waiting for the files to open. Results are kept in a sidecar text file,
+// next to the image list, and reused in later runs for the images whose size
+// and modification time have not changed.
+class ImageHeaders {
+
+public:
+
+    // No sidecar is used if _sidecar is empty
+    ImageHeaders(const std::string& _sidecar);
+    virtual ~ImageHeaders();
+
+    // Reads the dimensions of every image, with _nThreads threads
+    void probe(const std::vector<std::string>& _fileNames, unsigned int _nThreads);
+
+    // Data access, in the order of the list given to probe()
+    inline unsigned int getNImages() const {
+        return headers_.size();
+    }
+    // False if the image does not exist or its header cannot be read
+    inline bool isValid(unsigned int _i) const {
+        return headers_[_i].width > 0 && headers_[_i].height > 0;
+    }
+    inline unsigned int getWidth(unsigned int _i) const {
+        return headers_[_i].width;
+    }
+    inline unsigned int getHeight(unsigned int _i) const {
+        return headers_[_i].height;
+    }
+    // Headers taken from the sidecar and read from the images
+    inline unsigned int getNReused() const {
+        return nReused_;
+    }
+    inline unsigned int getNProbed() const {
+        return nProbed_;
+    }
+
+private:
+
+    struct Header {
+        std::string name;
+        unsigned int width, height; // 0 if the image could not be read
+        unsigned long long size;
+        long long mtime;
+    };
+
+    // Entries of the sidecar, sorted by name. Returns false if there is none
+    bool readSidecar(std::vector<Header>& _entries) const;
+    // Writes the headers to the sidecar (through a temporary file and a rename)
+    void writeSidecar() const;
+
+    std::string sidecar_;
+    std::vector<Header> headers_;
+    unsigned int nReused_, nProbed_;
+
+};
+
+#endif // IMAGEHEADERS_H
@@ -0,0 +1,96 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <algorithm>
+
+#include "imageprefetcher.h"
+
+ImagePrefetcher::ImagePrefetcher(ImageCache& _cache, unsigned int _nThreads, unsigned int _lookahead) : cache_(_cache){
+    position_ = next_ = 0;
+    lookahead_ = _lookahead;
+    stop_ = false;
+
+    for (unsigned int i = 0; i < _nThreads; i++){
+        threads_.push_back(std::thread(&ImagePrefetcher::run, this));
+    }
+}
+
+ImagePrefetcher::~ImagePrefetcher(){
+    stop();
+}
+
+void ImagePrefetcher::setSchedule(const std::vector<ScheduledImage>& _schedule){
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        schedule_ = _schedule;
+        position_ = next_ = 0;
+    }
+    condition_.notify_all();
+}
+
+void ImagePrefetcher::advance(size_t _position){
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (_position <= position_){
+            return;
+        }
+        position_ = _position;
+        // Images the consumer has already gone through are not worth decoding
+        next_ = std::max(next_, position_);
+    }
+    condition_.notify_all();
+}
+
+void ImagePrefetcher::stop(){
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    condition_.notify_all();
+
+    for (unsigned int i = 0; i < threads_.size(); i++){
+        threads_[i].join();
+    }
+    threads_.clear();
+}
+
+void ImagePrefetcher::run(){
+
+    while (true){
+
+        ScheduledImage image;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!stop_ && (next_ >= schedule_.size() || next_ >= position_ + lookahead_)){
+                condition_.wait(lock);
+            }
+            if (stop_){
+                return;
+            }
+            image = schedule_[next_++];
+        }
+
+        cache_.prefetch(image.first, image.second);
+    }
+}
@@ -0,0 +1,76 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef IMAGEPREFETCHER_H
+#define IMAGEPREFETCHER_H
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "imagecache.h"
+
+// File name and mip level of a scheduled image
+typedef std::pair<std::string, unsigned int> ScheduledImage;
+
+// Pool of threads decoding images into an ImageCache before they are needed.
+// It follows a schedule (the list of images in the order they will be used)
+// and stays at most _lookahead entries ahead of the position reported by the
+// consumer, so prefetched images are not evicted before they are used.
+class ImagePrefetcher {
+
+public:
+
+    // No threads are created if _nThreads is 0
+    ImagePrefetcher(ImageCache& _cache, unsigned int _nThreads, unsigned int _lookahead);
+    virtual ~ImagePrefetcher();
+
+    // Sets the images that will be used, in order. Prefetching starts right away
+    void setSchedule(const std::vector<ScheduledImage>& _schedule);
+    // The consumer has reached entry _position of the schedule
+    void advance(size_t _position);
+    // Pending work is dropped and the threads are joined
+    void stop();
+
+private:
+
+    void run();
+
+    ImageCache& cache_;
+    std::vector<std::thread> threads_;
+
+    std::vector<ScheduledImage> schedule_;
+    size_t position_; // Where the consumer is
+    size_t next_;     // Next entry to be prefetched
+    unsigned int lookahead_;
+    bool stop_;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+
+};
+
+#endif // IMAGEPREFETCHER_H
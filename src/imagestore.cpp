@@ -0,0 +1,164 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <iomanip>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "imagestore.h"
+
+// Header of the stored files. Pixels start right after it
+struct StoredImageHeader {
+    char magic[8];
+    unsigned int width, height, stride, reserved;
+    unsigned long long size; // size of the original file
+    long long mtime;         // modification time of the original file
+};
+
+static const char STORE_MAGIC[8] = {'S','S','M','V','R','A','W','1'};
+
+ImageStore::ImageStore(const std::string& _directory){
+    directory_ = _directory;
+    if (mkdir(directory_.c_str(), 0755) != 0 && errno != EEXIST){
+        std::cerr << "Image store " << directory_ << " could not be created" << std::endl;
+    }
+}
+
+ImageStore::~ImageStore(){
+}
+
+std::shared_ptr<const Image> ImageStore::load(const std::string& _fileName){
+
+    unsigned long long size;
+    long long mtime;
+    const std::string storedName = storedFileName(_fileName, size, mtime);
+
+    if (!storedName.empty()){
+        std::shared_ptr<const Image> image = map(storedName, size, mtime);
+        if (image){
+            return image;
+        }
+    }
+
+    std::shared_ptr<const Image> image = std::make_shared<const Image>(_fileName);
+
+    if (!storedName.empty() && image->getWidth() > 0){
+        write(*image, storedName, size, mtime);
+    }
+
+    return image;
+}
+
+std::string ImageStore::storedFileName(const std::string& _fileName, unsigned long long& _size, long long& _mtime) const {
+
+    struct stat info;
+    if (stat(_fileName.c_str(), &info) != 0){
+        return std::string();
+    }
+    _size = info.st_size;
+    _mtime = info.st_mtime;
+
+    // 64-bit FNV-1a of path, size and modification time
+    std::stringstream key;
+    key << _fileName << '\n' << _size << '\n' << _mtime;
+    const std::string keyString = key.str();
+    unsigned long long hash = 14695981039346656037ULL;
+    for (unsigned int i = 0; i < keyString.size(); i++){
+        hash ^= (unsigned char) keyString[i];
+        hash *= 1099511628211ULL;
+    }
+
+    std::stringstream name;
+    name << directory_ << "/" << std::hex << std::setw(16) << std::setfill('0') << hash << ".raw";
+    return name.str();
+}
+
+std::shared_ptr<const Image> ImageStore::map(const std::string& _storedName, unsigned long long _size, long long _mtime) const {
+
+    const int fd = open(_storedName.c_str(), O_RDONLY);
+    if (fd < 0){
+        return std::shared_ptr<const Image>();
+    }
+
+    struct stat info;
+    StoredImageHeader header;
+    if (fstat(fd, &info) != 0 || read(fd, &header, sizeof(header)) != (ssize_t) sizeof(header)
+        || memcmp(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC)) != 0
+        || header.size != _size || header.mtime != _mtime || header.stride < 3 * header.width
+        || (size_t) info.st_size != sizeof(header) + (size_t) header.stride * header.height + 1){
+        close(fd);
+        return std::shared_ptr<const Image>();
+    }
+
+    // Private mapping: pages are shared with the page cache, and nothing
+    // gets written back to the store if someone modifies the image
+    const size_t length = info.st_size;
+    void* address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED){
+        return std::shared_ptr<const Image>();
+    }
+
+    std::shared_ptr<void> mapping (address, [length](void* _address){ munmap(_address, length); });
+    unsigned char* pixels = (unsigned char*) address + sizeof(header);
+
+    return std::make_shared<const Image>(header.height, header.width, header.stride, pixels, mapping, _storedName);
+}
+
+void ImageStore::write(const Image& _image, const std::string& _storedName, unsigned long long _size, long long _mtime) const {
+
+    StoredImageHeader header;
+    memcpy(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+    header.width = _image.getWidth();
+    header.height = _image.getHeight();
+    header.stride = _image.getStride();
+    header.reserved = 0;
+    header.size = _size;
+    header.mtime = _mtime;
+
+    // Other processes may be filling the store at the same time
+    std::stringstream tempName;
+    tempName << _storedName << ".tmp" << getpid();
+
+    FILE* file = fopen(tempName.str().c_str(), "wb");
+    if (file == NULL){
+        std::cerr << "Image store: " << tempName.str() << " could not be written" << std::endl;
+        return;
+    }
+
+    const size_t bytes = _image.getSizeInBytes();
+    const bool ok = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(_image.getRow(0), 1, bytes, file) == bytes;
+
+    if (fclose(file) != 0 || !ok || rename(tempName.str().c_str(), _storedName.c_str()) != 0){
+        std::cerr << "Image store: " << _storedName << " could not be written" << std::endl;
+        remove(tempName.str().c_str());
+    }
+}
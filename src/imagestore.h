@@ -0,0 +1,67 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef IMAGESTORE_H
+#define IMAGESTORE_H
+
+#include <string>
+#include <memory>
+
+#include "image.h"
+
+// On-disk store of decoded images, so repeated runs over the same pictures
+// do not have to decode them again. Each image is saved uncompressed in its
+// own file (a small header followed by the RGB rows), named after a hash of
+// the image path, size and modification time. Stored images are memory-mapped
+// and handed out without copying their pixels.
+class ImageStore {
+
+public:
+
+    // The directory is created if it does not exist
+    ImageStore(const std::string& _directory);
+    virtual ~ImageStore();
+
+    // Returns the image, mapping it from the store if it is there, or decoding
+    // it and adding it to the store otherwise
+    std::shared_ptr<const Image> load(const std::string& _fileName);
+
+    inline const std::string& getDirectory() const {
+        return directory_;
+    }
+
+private:
+
+    // Name of the stored file for the image, empty if the image cannot be found
+    std::string storedFileName(const std::string& _fileName, unsigned long long& _size, long long& _mtime) const;
+    // Maps a stored image. Returns an empty pointer if it is not valid
+    std::shared_ptr<const Image> map(const std::string& _storedName, unsigned long long _size, long long _mtime) const;
+    // Writes the decoded image to the store (through a temporary file and a rename)
+    void write(const Image& _image, const std::string& _storedName, unsigned long long _size, long long _mtime) const;
+
+    std::string directory_;
+
+};
+
+#endif // IMAGESTORE_H
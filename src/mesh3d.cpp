@@ -475,6 +475,9 @@ void Mesh3D::addTriangle(const Triangle& _triangle)
 {
     tri_.push_back(_triangle);
     ++nTri_;
+    if (topology_.isBuilt()){
+        topology_.clear();
+    }
 }
 
 // unsigned int Mesh3D::getNVtx() const{
@@ -536,7 +539,21 @@ void Mesh3D::replaceTriangles(const std::vector<Triangle>& _newTriangles){
     tri_.clear();
     tri_ = _newTriangles;
     nTri_ = tri_.size();
+    topology_.clear();
+
+}
+
+void Mesh3D::subdivideTriangles(const std::vector<Triangle>& _newTriangles, const std::vector<unsigned int>& _parent){
+
+    tri_ = _newTriangles;
+    nTri_ = tri_.size();
+    if (topology_.isBuilt()){
+        topology_.subdivide(tri_, _parent, nVtx_);
+    }
+}
 
+void Mesh3D::buildTopology(){
+    topology_.build(tri_, nVtx_);
 }
 
 
@@ -31,6 +31,7 @@
 
 #include "triangle.h"
 #include "color.h"
+#include "meshtopology.h"
 
 class Mesh3D {
 
@@ -54,10 +55,16 @@ class Mesh3D {
     inline const Vector3f& getVertex(unsigned int _index) const{
         return vtx_[_index];
     }
+    inline const std::vector<Vector3f>& getVertices() const{
+        return vtx_;
+    }
     //Triangle getTriangle(unsigned int _index) const;
     inline const Triangle& getTriangle(unsigned int _index) const{
         return tri_[_index];
     }
+    inline const std::vector<Triangle>& getTriangles() const{
+        return tri_;
+    }
     inline unsigned int getNVtx() const {
         return nVtx_;
     }
@@ -65,11 +72,22 @@ class Mesh3D {
         return nTri_;
     }
 
+    // Adding triangles drops the topology, adding vertices keeps it
     void addVector(const Vector3f& _vector);
     void addTriangle(const Triangle& _triangle);
 
     // set new list of Triangles
     void replaceTriangles(const std::vector<Triangle>& _newTriangles);
+    // set new list of Triangles, each of them inside the triangle _parent[k] of the current
+    // list, and update the topology without building it again (see MeshTopology::subdivide)
+    void subdivideTriangles(const std::vector<Triangle>& _newTriangles, const std::vector<unsigned int>& _parent);
+
+    // Adjacency of the triangles. It has to be built before it is used, and is kept up to
+    // date by subdivideTriangles(); the rest of the changes to the triangles drop it
+    void buildTopology();
+    inline const MeshTopology& getTopology() const {
+        return topology_;
+    }
 
     void setTriangleUV(unsigned int _index, const Vector3d& _u, const Vector3d& _v);
 
@@ -90,6 +108,7 @@ class Mesh3D {
     std::vector<Vector3f> vtx_;
     std::vector<Triangle> tri_;
     unsigned int nVtx_, nTri_;
+    MeshTopology topology_;
 
 };
 
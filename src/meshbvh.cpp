@@ -0,0 +1,398 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "meshbvh.h"
+
+// Packets of four rays are traced with the SSE2 baseline of the target
+#if defined(__GNUC__) && defined(__SSE2__)
+#define MESHBVH_SSE
+#include <immintrin.h>
+#endif
+
+// Number of bins along each axis where the surface area heuristic is evaluated
+static const unsigned int SAH_BINS = 16;
+// Subtrees with more triangles than this are built by another task
+static const unsigned int PARALLEL_BUILD = 4096;
+
+// Surface area of a box, up to a factor 2
+static inline float halfArea(const Vector3f& _lo, const Vector3f& _hi){
+    const Vector3f d = (_hi - _lo).cwiseMax(Vector3f::Zero());
+    return d(0) * d(1) + d(1) * d(2) + d(2) * d(0);
+}
+
+// Inverse of a direction, keeping the components that are 0 finite so that
+// the slab tests never multiply 0 by infinity
+static inline float safeInverse(float _d){
+    return 1.0f / (std::fabs(_d) > 1e-30f ? _d : std::copysign(1e-30f, _d));
+}
+
+MeshBVH::MeshBVH(){
+    maxLeafTriangles_ = 4;
+}
+
+MeshBVH::~MeshBVH(){
+}
+
+void MeshBVH::build(const Mesh3D& _mesh, unsigned int _maxLeafTriangles){
+
+    const unsigned int nTri = _mesh.getNTri();
+    maxLeafTriangles_ = std::max(_maxLeafTriangles, 1u);
+
+    nodes_.clear();
+    tris_.clear();
+
+    if (nTri == 0){
+        return;
+    }
+
+    std::vector<Ref> refs (nTri);
+
+    #pragma omp parallel for
+    for (unsigned int t = 0; t < nTri; t++){
+        const Triangle& tri = _mesh.getTriangle(t);
+        const Vector3f& a = _mesh.getVertex(tri.getIndex(0));
+        const Vector3f& b = _mesh.getVertex(tri.getIndex(1));
+        const Vector3f& c = _mesh.getVertex(tri.getIndex(2));
+        refs[t].lo = a.cwiseMin(b).cwiseMin(c);
+        refs[t].hi = a.cwiseMax(b).cwiseMax(c);
+        refs[t].centroid = (a + b + c) / 3;
+        refs[t].triangle = t;
+    }
+
+    // The two halves of large nodes are built by different tasks
+    #pragma omp parallel
+    {
+        #pragma omp single
+        buildNode(refs, 0, nTri, nodes_);
+    }
+
+    // Leaves cover consecutive runs of the references, which are stored in that order
+    tris_.resize(9 * (size_t) nTri);
+
+    #pragma omp parallel for
+    for (unsigned int i = 0; i < nTri; i++){
+        const Triangle& tri = _mesh.getTriangle(refs[i].triangle);
+        const Vector3f& a = _mesh.getVertex(tri.getIndex(0));
+        const Vector3f e1 = _mesh.getVertex(tri.getIndex(1)) - a;
+        const Vector3f e2 = _mesh.getVertex(tri.getIndex(2)) - a;
+        float* data = &tris_[9 * (size_t) i];
+        for (unsigned int k = 0; k < 3; k++){
+            data[k]     = a(k);
+            data[3 + k] = e1(k);
+            data[6 + k] = e2(k);
+        }
+    }
+}
+
+void MeshBVH::buildNode(std::vector<Ref>& _refs, unsigned int _begin, unsigned int _end, std::vector<Node>& _nodes) const {
+
+    const unsigned int index = _nodes.size();
+    const unsigned int n = _end - _begin;
+    _nodes.push_back(Node());
+
+    Vector3f lo = _refs[_begin].lo, hi = _refs[_begin].hi;
+    Vector3f c_lo = _refs[_begin].centroid, c_hi = c_lo;
+    for (unsigned int i = _begin + 1; i < _end; i++){
+        lo = lo.cwiseMin(_refs[i].lo);
+        hi = hi.cwiseMax(_refs[i].hi);
+        c_lo = c_lo.cwiseMin(_refs[i].centroid);
+        c_hi = c_hi.cwiseMax(_refs[i].centroid);
+    }
+
+    // Slightly larger, for rounding errors in the slab tests
+    const float pad = 1e-5f * (hi - lo).maxCoeff() + std::numeric_limits<float>::min();
+    for (unsigned int k = 0; k < 3; k++){
+        _nodes[index].lo[k] = lo(k) - pad;
+        _nodes[index].hi[k] = hi(k) + pad;
+    }
+
+    if (n <= maxLeafTriangles_){
+        _nodes[index].count = n;
+        _nodes[index].offset = _begin;
+        return;
+    }
+
+    // Split with the lowest cost, counting one triangle test per triangle
+    // and the probability of entering each side (proportional to its area)
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1;
+    unsigned int bestBin = 0;
+
+    for (unsigned int axis = 0; axis < 3; axis++){
+
+        const float extent = c_hi(axis) - c_lo(axis);
+        if (!(extent > 0)){
+            continue;
+        }
+        const float scale = SAH_BINS / extent;
+
+        unsigned int count[SAH_BINS] = {0};
+        Vector3f bin_lo[SAH_BINS], bin_hi[SAH_BINS];
+        for (unsigned int b = 0; b < SAH_BINS; b++){
+            bin_lo[b] = Vector3f::Constant(std::numeric_limits<float>::max());
+            bin_hi[b] = Vector3f::Constant(-std::numeric_limits<float>::max());
+        }
+        for (unsigned int i = _begin; i < _end; i++){
+            const unsigned int b = std::min(SAH_BINS - 1, (unsigned int) ((_refs[i].centroid(axis) - c_lo(axis)) * scale));
+            count[b]++;
+            bin_lo[b] = bin_lo[b].cwiseMin(_refs[i].lo);
+            bin_hi[b] = bin_hi[b].cwiseMax(_refs[i].hi);
+        }
+
+        // Cost of the left side of every split, then of the right one while sweeping back
+        float leftCost[SAH_BINS];
+        Vector3f s_lo = bin_lo[0], s_hi = bin_hi[0];
+        unsigned int s_count = count[0];
+        for (unsigned int b = 1; b < SAH_BINS; b++){
+            leftCost[b] = s_count * halfArea(s_lo, s_hi);
+            s_lo = s_lo.cwiseMin(bin_lo[b]);
+            s_hi = s_hi.cwiseMax(bin_hi[b]);
+            s_count += count[b];
+        }
+        s_lo = bin_lo[SAH_BINS - 1];
+        s_hi = bin_hi[SAH_BINS - 1];
+        s_count = count[SAH_BINS - 1];
+        for (unsigned int b = SAH_BINS - 1; b > 0; b--){
+            const float cost = leftCost[b] + s_count * halfArea(s_lo, s_hi);
+            if (cost < bestCost && s_count > 0 && s_count < n){
+                bestCost = cost;
+                bestAxis = axis;
+                bestBin = b;
+            }
+            s_lo = s_lo.cwiseMin(bin_lo[b - 1]);
+            s_hi = s_hi.cwiseMax(bin_hi[b - 1]);
+            s_count += count[b - 1];
+        }
+    }
+
+    // A leaf is kept if splitting does not pay off, unless it is too large
+    const float leafCost = n * halfArea(lo, hi);
+    if (n <= 4 * maxLeafTriangles_ && (bestAxis < 0 || halfArea(lo, hi) + bestCost >= leafCost)){
+        _nodes[index].count = n;
+        _nodes[index].offset = _begin;
+        return;
+    }
+
+    unsigned int mid;
+    if (bestAxis >= 0){
+        const float scale = SAH_BINS / (c_hi(bestAxis) - c_lo(bestAxis));
+        const float origin = c_lo(bestAxis);
+        const unsigned int axis = bestAxis, bin = bestBin;
+        mid = std::partition(_refs.begin() + _begin, _refs.begin() + _end, [=](const Ref& _ref){
+            return std::min(SAH_BINS - 1, (unsigned int) ((_ref.centroid(axis) - origin) * scale)) < bin;
+        }) - _refs.begin();
+    } else {
+        // Every centroid is in the same place: the triangles are split in two halves
+        mid = _begin + n / 2;
+    }
+
+    _nodes[index].count = 0;
+
+    if (n > PARALLEL_BUILD){
+        std::vector<Node> second;
+        #pragma omp task shared(_refs, second)
+        buildNode(_refs, mid, _end, second);
+        buildNode(_refs, _begin, mid, _nodes);
+        #pragma omp taskwait
+        _nodes[index].offset = _nodes.size() - index;
+        _nodes.insert(_nodes.end(), second.begin(), second.end());
+    } else {
+        buildNode(_refs, _begin, mid, _nodes);
+        _nodes[index].offset = _nodes.size() - index;
+        buildNode(_refs, mid, _end, _nodes);
+    }
+}
+
+void MeshBVH::findOccluded(const Vector3f& _origin, const std::vector<Vector3f>& _points, std::vector<char>& _occluded, float _tolerance) const {
+
+    const size_t n = _points.size();
+    _occluded.assign(n, 0);
+
+    if (nodes_.empty()){
+        return;
+    }
+
+    const float origin[3] = {_origin(0), _origin(1), _origin(2)};
+    const float tmax = 1.0f - _tolerance;
+    std::vector<unsigned int> stack;
+    stack.reserve(64);
+
+    // Consecutive points are usually close to each other, so their segments go through the same nodes
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4){
+        float dir[3][4];
+        for (unsigned int l = 0; l < 4; l++){
+            for (unsigned int k = 0; k < 3; k++){
+                dir[k][l] = _points[i + l](k) - origin[k];
+            }
+        }
+        unsigned int mask = 0xF;
+        findOccluded4(origin, dir, tmax, mask, stack);
+        for (unsigned int l = 0; l < 4; l++){
+            _occluded[i + l] = (mask >> l & 1) == 0;
+        }
+    }
+    for (; i < n; i++){
+        const float dir[3] = {_points[i](0) - origin[0], _points[i](1) - origin[1], _points[i](2) - origin[2]};
+        _occluded[i] = isOccluded(origin, dir, tmax, stack);
+    }
+}
+
+bool MeshBVH::isOccluded(const float* _origin, const float* _dir, float _tmax, std::vector<unsigned int>& _stack) const {
+
+    const float inv[3] = {safeInverse(_dir[0]), safeInverse(_dir[1]), safeInverse(_dir[2])};
+
+    _stack.clear();
+    _stack.push_back(0);
+    while (!_stack.empty()){
+
+        const unsigned int index = _stack.back();
+        _stack.pop_back();
+        const Node& node = nodes_[index];
+
+        float t0 = 0.0f, t1 = _tmax;
+        for (unsigned int k = 0; k < 3; k++){
+            const float ta = (node.lo[k] - _origin[k]) * inv[k];
+            const float tb = (node.hi[k] - _origin[k]) * inv[k];
+            t0 = std::max(t0, std::min(ta, tb));
+            t1 = std::min(t1, std::max(ta, tb));
+        }
+        if (t0 > t1){
+            continue;
+        }
+
+        if (node.count > 0){
+            for (unsigned int t = node.offset; t < node.offset + node.count; t++){
+                if (intersects(t, _origin, _dir, _tmax)){
+                    return true;
+                }
+            }
+        } else {
+            _stack.push_back(index + node.offset);
+            _stack.push_back(index + 1);
+        }
+    }
+    return false;
+}
+
+#ifdef MESHBVH_SSE
+
+void MeshBVH::findOccluded4(const float* _origin, const float _dir[3][4], float _tmax, unsigned int& _mask, std::vector<unsigned int>& _stack) const {
+
+    __m128 o[3], inv[3];
+    for (unsigned int k = 0; k < 3; k++){
+        o[k] = _mm_set1_ps(_origin[k]);
+        inv[k] = _mm_setr_ps(safeInverse(_dir[k][0]), safeInverse(_dir[k][1]), safeInverse(_dir[k][2]), safeInverse(_dir[k][3]));
+    }
+    const __m128 tmax = _mm_set1_ps(_tmax);
+
+    // A node is visited if any of the segments still unoccluded goes through it
+    _stack.clear();
+    _stack.push_back(0);
+    while (!_stack.empty() && _mask != 0){
+
+        const unsigned int index = _stack.back();
+        _stack.pop_back();
+        const Node& node = nodes_[index];
+
+        __m128 t0 = _mm_setzero_ps(), t1 = tmax;
+        for (unsigned int k = 0; k < 3; k++){
+            const __m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.lo[k]), o[k]), inv[k]);
+            const __m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.hi[k]), o[k]), inv[k]);
+            t0 = _mm_max_ps(t0, _mm_min_ps(ta, tb));
+            t1 = _mm_min_ps(t1, _mm_max_ps(ta, tb));
+        }
+        const unsigned int hit = _mm_movemask_ps(_mm_cmple_ps(t0, t1)) & _mask;
+        if (hit == 0){
+            continue;
+        }
+
+        if (node.count > 0){
+            for (unsigned int l = 0; l < 4; l++){
+                if ((hit >> l & 1) == 0){
+                    continue;
+                }
+                const float dir[3] = {_dir[0][l], _dir[1][l], _dir[2][l]};
+                for (unsigned int t = node.offset; t < node.offset + node.count; t++){
+                    if (intersects(t, _origin, dir, _tmax)){
+                        _mask &= ~(1u << l);
+                        break;
+                    }
+                }
+            }
+        } else {
+            _stack.push_back(index + node.offset);
+            _stack.push_back(index + 1);
+        }
+    }
+}
+
+#else
+
+void MeshBVH::findOccluded4(const float* _origin, const float _dir[3][4], float _tmax, unsigned int& _mask, std::vector<unsigned int>& _stack) const {
+
+    for (unsigned int l = 0; l < 4; l++){
+        const float dir[3] = {_dir[0][l], _dir[1][l], _dir[2][l]};
+        if ((_mask >> l & 1) != 0 && isOccluded(_origin, dir, _tmax, _stack)){
+            _mask &= ~(1u << l);
+        }
+    }
+}
+
+#endif
+
+bool MeshBVH::intersects(unsigned int _t, const float* _origin, const float* _dir, float _tmax) const {
+
+    // Möller-Trumbore: the crossing is at _origin + t _dir = v0 + u e1 + v e2
+    const float* v0 = &tris_[9 * (size_t) _t];
+    const float* e1 = v0 + 3;
+    const float* e2 = v0 + 6;
+
+    const float p[3] = {_dir[1] * e2[2] - _dir[2] * e2[1], _dir[2] * e2[0] - _dir[0] * e2[2], _dir[0] * e2[1] - _dir[1] * e2[0]};
+    const float det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+    if (det == 0.0f){ // Parallel to the triangle
+        return false;
+    }
+    const float invDet = 1.0f / det;
+
+    const float s[3] = {_origin[0] - v0[0], _origin[1] - v0[1], _origin[2] - v0[2]};
+    const float u = (s[0] * p[0] + s[1] * p[1] + s[2] * p[2]) * invDet;
+    if (u < 0.0f || u > 1.0f){
+        return false;
+    }
+
+    const float q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2], s[0] * e1[1] - s[1] * e1[0]};
+    const float v = (_dir[0] * q[0] + _dir[1] * q[1] + _dir[2] * q[2]) * invDet;
+    if (v < 0.0f || u + v > 1.0f){
+        return false;
+    }
+
+    const float t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * invDet;
+    return t > 0.0f && t < _tmax;
+}
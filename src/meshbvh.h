@@ -0,0 +1,100 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#ifndef MESHBVH_H
+#define MESHBVH_H
+
+#include <vector>
+
+#include "mesh3d.h"
+
+// Bounding volume hierarchy over the triangles of a mesh, used to check exactly whether
+// points are seen from a position: a point is visible if the segment that joins them
+// crosses no triangle. Nodes are split with the surface area heuristic and leaves hold a
+// few triangles. Segments sharing an origin (a camera) are traced in packets of 4.
+class MeshBVH {
+
+public:
+
+    MeshBVH();
+    virtual ~MeshBVH();
+
+    // Builds the hierarchy, in parallel, with up to _maxLeafTriangles triangles per leaf.
+    // It has to be called again whenever the surface changes, but not when its triangles
+    // are only subdivided
+    void build(const Mesh3D& _mesh, unsigned int _maxLeafTriangles = 4);
+
+    // For each point, whether the segment from _origin to it crosses a triangle. Crossings
+    // closer to the point than a fraction _tolerance of the segment are ignored, so the
+    // surface the point lies on does not hide it
+    void findOccluded(const Vector3f& _origin, const std::vector<Vector3f>& _points, std::vector<char>& _occluded, float _tolerance = 1e-4f) const;
+
+    // Data access
+    inline bool isEmpty() const {
+        return nodes_.empty();
+    }
+    inline unsigned int getNNodes() const {
+        return nodes_.size();
+    }
+    inline size_t getBytes() const {
+        return nodes_.size() * sizeof(Node) + tris_.size() * sizeof(float);
+    }
+
+private:
+
+    // Leaves have count > 0 triangles, starting at position offset of tris_.
+    // Inner nodes have count = 0: their first child follows them, and the second
+    // one is offset positions after them, so subtrees can be built on their own
+    struct Node {
+        float lo[3];
+        unsigned int count;
+        float hi[3];
+        unsigned int offset;
+    };
+
+    // Triangle references while building: bounding box and centroid
+    struct Ref {
+        Vector3f lo, hi, centroid;
+        unsigned int triangle;
+    };
+
+    // Builds the subtree of _refs[_begin, _end) at the end of _nodes
+    void buildNode(std::vector<Ref>& _refs, unsigned int _begin, unsigned int _end, std::vector<Node>& _nodes) const;
+
+    // Whether the segment _origin + t _dir, t in (0, _tmax), crosses a triangle
+    bool isOccluded(const float* _origin, const float* _dir, float _tmax, std::vector<unsigned int>& _stack) const;
+    // The same for 4 segments at once, which are set in _mask (bits). Occluded ones are cleared
+    void findOccluded4(const float* _origin, const float _dir[3][4], float _tmax, unsigned int& _mask, std::vector<unsigned int>& _stack) const;
+    // Whether the segment crosses triangle _t of tris_
+    bool intersects(unsigned int _t, const float* _origin, const float* _dir, float _tmax) const;
+
+    unsigned int maxLeafTriangles_;
+    std::vector<Node> nodes_;
+    // Triangles in leaf order, as a vertex and the two edges from it (9 floats each)
+    std::vector<float> tris_;
+
+};
+
+#endif // MESHBVH_H
@@ -0,0 +1,250 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "meshclusters.h"
+
+// Spreads the lower 10 bits of _x so there are two zero bits between each of them
+static inline unsigned int spreadBits(unsigned int _x){
+    _x &= 0x3FF;
+    _x = (_x | (_x << 16)) & 0x030000FF;
+    _x = (_x | (_x << 8))  & 0x0300F00F;
+    _x = (_x | (_x << 4))  & 0x030C30C3;
+    _x = (_x | (_x << 2))  & 0x09249249;
+    return _x;
+}
+
+MeshClusters::MeshClusters(){
+}
+
+MeshClusters::~MeshClusters(){
+}
+
+void MeshClusters::build(const Mesh3D& _mesh, unsigned int _maxTriangles){
+
+    const unsigned int nTri = _mesh.getNTri();
+    _maxTriangles = std::max(_maxTriangles, 1u);
+
+    triOffsets_.assign(1, 0);
+    vtxOffsets_.assign(1, 0);
+    tris_.clear();
+    vtx_.clear();
+    xyz_.clear();
+    bounds_.clear();
+
+    if (nTri == 0){
+        return;
+    }
+
+    Vector3f min_v = _mesh.getVertex(0), max_v = min_v;
+    for (unsigned int i = 1; i < _mesh.getNVtx(); i++){
+        min_v = min_v.cwiseMin(_mesh.getVertex(i));
+        max_v = max_v.cwiseMax(_mesh.getVertex(i));
+    }
+    const Vector3f extent = (max_v - min_v).cwiseMax(Vector3f::Constant(1e-20f));
+
+    // Sorting key of each triangle: main direction of its normal (one of six),
+    // followed by the Morton code of its centroid in a 1024^3 grid
+    std::vector<std::pair<unsigned long long, unsigned int> > keys (nTri);
+    std::vector<Vector3f> normals (nTri);
+
+    #pragma omp parallel for
+    for (unsigned int t = 0; t < nTri; t++){
+        const Triangle& tri = _mesh.getTriangle(t);
+        const Vector3f& a = _mesh.getVertex(tri.getIndex(0));
+        const Vector3f& b = _mesh.getVertex(tri.getIndex(1));
+        const Vector3f& c = _mesh.getVertex(tri.getIndex(2));
+        normals[t] = _mesh.getTriangleNormal(a, b, c);
+
+        unsigned int direction = 0;
+        if (std::isfinite(normals[t].squaredNorm())){
+            unsigned int axis;
+            normals[t].cwiseAbs().maxCoeff(&axis);
+            direction = 2 * axis + (normals[t](axis) < 0 ? 1 : 0);
+        }
+
+        const Vector3f centroid = ((a + b + c) / 3 - min_v).cwiseQuotient(extent) * 1023.0f;
+        const unsigned int code = (spreadBits((unsigned int) centroid(0)) << 2)
+                                | (spreadBits((unsigned int) centroid(1)) << 1)
+                                |  spreadBits((unsigned int) centroid(2));
+        keys[t] = std::make_pair(((unsigned long long) direction << 32) | code, t);
+    }
+
+    std::sort(keys.begin(), keys.end());
+
+    // Clusters are consecutive runs of the sorted triangles sharing the same direction
+    tris_.resize(nTri);
+    for (unsigned int t = 0; t < nTri; t++){
+        tris_[t] = keys[t].second;
+        const bool newDirection = t > 0 && (keys[t].first >> 32) != (keys[t - 1].first >> 32);
+        if (t > triOffsets_.back() && (newDirection || t - triOffsets_.back() == _maxTriangles)){
+            triOffsets_.push_back(t);
+        }
+    }
+    triOffsets_.push_back(nTri);
+    std::vector<std::pair<unsigned long long, unsigned int> >().swap(keys);
+
+    const unsigned int nClusters = triOffsets_.size() - 1;
+    bounds_.resize(nClusters);
+    std::vector<std::vector<unsigned int> > clusterVtx (nClusters);
+
+    #pragma omp parallel for schedule(dynamic, 64)
+    for (unsigned int k = 0; k < nClusters; k++){
+
+        std::vector<unsigned int>& vertices = clusterVtx[k];
+        for (unsigned int i = triOffsets_[k]; i < triOffsets_[k + 1]; i++){
+            const Triangle& tri = _mesh.getTriangle(tris_[i]);
+            for (unsigned int j = 0; j < 3; j++){
+                vertices.push_back(tri.getIndex(j));
+            }
+        }
+        std::sort(vertices.begin(), vertices.end());
+        vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+
+        // Bounding sphere centered in the bounding box
+        Vector3f lo = _mesh.getVertex(vertices[0]), hi = lo;
+        for (unsigned int i = 1; i < vertices.size(); i++){
+            lo = lo.cwiseMin(_mesh.getVertex(vertices[i]));
+            hi = hi.cwiseMax(_mesh.getVertex(vertices[i]));
+        }
+        Bounds& bounds = bounds_[k];
+        bounds.center = (lo + hi) / 2;
+        bounds.radius = 0.0f;
+        for (unsigned int i = 0; i < vertices.size(); i++){
+            bounds.radius = std::max(bounds.radius, (_mesh.getVertex(vertices[i]) - bounds.center).norm());
+        }
+        // Room for rounding errors
+        bounds.radius = bounds.radius * 1.0001f + 1e-6f * extent.maxCoeff();
+
+        // Normal cone around the average normal
+        bool valid = true;
+        Vector3f axis (0.0f, 0.0f, 0.0f);
+        for (unsigned int i = triOffsets_[k]; i < triOffsets_[k + 1]; i++){
+            const Vector3f& n = normals[tris_[i]];
+            if (!std::isfinite(n.squaredNorm())){
+                valid = false;
+                break;
+            }
+            axis += n;
+        }
+        bounds.coneCos = -1.0f;
+        bounds.coneSin = 0.0f;
+        bounds.axis = Vector3f(0.0f, 0.0f, 1.0f);
+        if (valid && axis.norm() > 1e-6f){
+            axis.normalize();
+            float minCos = 1.0f;
+            for (unsigned int i = triOffsets_[k]; i < triOffsets_[k + 1]; i++){
+                minCos = std::min(minCos, axis.dot(normals[tris_[i]]));
+            }
+            // Slightly wider, for rounding errors
+            const float angle = acos(std::max(minCos, -1.0f)) + 1e-3f;
+            if (angle < (float) M_PI / 2){
+                bounds.axis = axis;
+                bounds.coneCos = cos(angle);
+                bounds.coneSin = sin(angle);
+            }
+        }
+    }
+
+    for (unsigned int k = 0; k < nClusters; k++){
+        vtx_.insert(vtx_.end(), clusterVtx[k].begin(), clusterVtx[k].end());
+        vtxOffsets_.push_back(vtx_.size());
+        std::vector<unsigned int>().swap(clusterVtx[k]);
+    }
+
+    xyz_.resize(3 * vtx_.size());
+    #pragma omp parallel for
+    for (size_t i = 0; i < vtx_.size(); i++){
+        const Vector3f& v = _mesh.getVertex(vtx_[i]);
+        xyz_[3 * i]     = v(0);
+        xyz_[3 * i + 1] = v(1);
+        xyz_[3 * i + 2] = v(2);
+    }
+}
+
+void MeshClusters::findVisibleClusters(const Camera& _camera, std::vector<unsigned int>& _clusters) const {
+
+    _clusters.clear();
+
+    Vector4f planes[5];
+    _camera.getFrustumPlanes(planes);
+    const Vector3f& position = _camera.getPosition();
+
+    for (unsigned int k = 0; k < bounds_.size(); k++){
+        const Bounds& bounds = bounds_[k];
+
+        // Frustum: the sphere is completely outside one of the planes
+        bool inside = true;
+        for (unsigned int p = 0; p < 5 && inside; p++){
+            const Vector4f& plane = planes[p];
+            inside = plane(0) * bounds.center(0) + plane(1) * bounds.center(1) + plane(2) * bounds.center(2) + plane(3) >= -bounds.radius;
+        }
+        if (!inside){
+            continue;
+        }
+
+        // Back-facing: every triangle normal n and point p of the cluster satisfy n.(p - C) >= 0.
+        // With d = center - C, n.(p - C) >= n.d - radius >= |d| cos(phi + theta) - radius,
+        // phi being the angle between d and the cone axis and theta the cone angle
+        if (bounds.coneCos > -1.0f){
+            const Vector3f d = bounds.center - position;
+            const float dist = d.norm();
+            if (dist > bounds.radius){
+                const float cosPhi = bounds.axis.dot(d) / dist;
+                const float sinPhi = sqrt(std::max(1.0f - cosPhi * cosPhi, 0.0f));
+                // cos(phi + theta), only meaningful while phi + theta < 180 degrees
+                const float cosSum = cosPhi * bounds.coneCos - sinPhi * bounds.coneSin;
+                if (cosSum * dist >= bounds.radius){
+                    continue;
+                }
+            }
+        }
+
+        _clusters.push_back(k);
+    }
+}
+
+void MeshClusters::projectVertices(unsigned int _cluster, const Camera& _camera, std::vector<Vector2f>& _vtx_st, std::vector<float>* _vtx_depth) const {
+
+    // Clusters are small, so they are projected in blocks kept on the stack
+    const unsigned int block = 256;
+    float uv[2 * block], depth[block];
+
+    const unsigned int first = vtxOffsets_[_cluster];
+    const unsigned int last = vtxOffsets_[_cluster + 1];
+    for (unsigned int i = first; i < last; i += block){
+        const unsigned int n = std::min(block, last - i);
+        _camera.projectBatch(&xyz_[3 * (size_t) i], n, uv, _vtx_depth != NULL ? depth : NULL);
+        for (unsigned int j = 0; j < n; j++){
+            _vtx_st[vtx_[i + j]] = Vector2f(uv[2 * j], uv[2 * j + 1]);
+        }
+        if (_vtx_depth != NULL){
+            for (unsigned int j = 0; j < n; j++){
+                (*_vtx_depth)[vtx_[i + j]] = depth[j];
+            }
+        }
+    }
+}
@@ -0,0 +1,98 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef MESHCLUSTERS_H
+#define MESHCLUSTERS_H
+
+#include <vector>
+
+#include "mesh3d.h"
+#include "camera.h"
+
+// The triangles of a mesh split into small, spatially coherent clusters (meshlets).
+// Triangles are grouped by the main direction of their normal and then sorted along
+// a Morton curve, so each cluster is compact and faces roughly one way. Every cluster
+// keeps a bounding sphere and a cone bounding its normals, so whole clusters that are
+// outside the view of a camera, or that only show it their back, are skipped at once.
+class MeshClusters {
+
+public:
+
+    MeshClusters();
+    virtual ~MeshClusters();
+
+    // Splits the mesh in clusters of up to _maxTriangles triangles. It has to be called
+    // again whenever the mesh changes
+    void build(const Mesh3D& _mesh, unsigned int _maxTriangles = 128);
+
+    // Clusters that may contain a triangle inside the view frustum of the camera and
+    // facing it. Triangles in the rest are either outside the image or back-facing
+    void findVisibleClusters(const Camera& _camera, std::vector<unsigned int>& _clusters) const;
+
+    // Projects the vertices of the cluster and writes their uv coordinates in the
+    // positions of _vtx_st given by their indices in the mesh, and their depths in
+    // the same positions of _vtx_depth if it is not null
+    void projectVertices(unsigned int _cluster, const Camera& _camera, std::vector<Vector2f>& _vtx_st, std::vector<float>* _vtx_depth = NULL) const;
+
+    // Data access
+    inline unsigned int getNClusters() const {
+        return bounds_.size();
+    }
+    inline unsigned int getNTri(unsigned int _cluster) const {
+        return triOffsets_[_cluster + 1] - triOffsets_[_cluster];
+    }
+    inline const unsigned int* getTriangles(unsigned int _cluster) const {
+        return &tris_[triOffsets_[_cluster]];
+    }
+    inline unsigned int getNVtx(unsigned int _cluster) const {
+        return vtxOffsets_[_cluster + 1] - vtxOffsets_[_cluster];
+    }
+    inline const unsigned int* getVertices(unsigned int _cluster) const {
+        return &vtx_[vtxOffsets_[_cluster]];
+    }
+    inline const Vector3f& getCenter(unsigned int _cluster) const {
+        return bounds_[_cluster].center;
+    }
+
+private:
+
+    struct Bounds {
+        Vector3f center;  // Bounding sphere
+        float radius;
+        Vector3f axis;    // Normal cone: every normal is within an angle
+        float coneCos;    // of the axis, of cosine coneCos and sine coneSin.
+        float coneSin;    // No cone if coneCos = -1
+    };
+
+    // Triangles and vertices of each cluster, one after another:
+    // the ones of cluster k start at position triOffsets_[k] (vtxOffsets_[k])
+    std::vector<unsigned int> triOffsets_, tris_;
+    std::vector<unsigned int> vtxOffsets_, vtx_;
+    // Vertex positions, in the same order as vtx_, so clusters are projected in one go
+    std::vector<float> xyz_;
+    std::vector<Bounds> bounds_;
+
+};
+
+#endif // MESHCLUSTERS_H
@@ -0,0 +1,244 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <algorithm>
+
+#include "meshtopology.h"
+
+const unsigned int MeshTopology::NONE;
+
+// True if triangle _t has both _a and _b among its vertices
+static inline bool hasEdge(const Triangle& _t, int _a, int _b){
+    const Vector3i& idx = _t.getIndices();
+    return (idx(0) == _a || idx(1) == _a || idx(2) == _a) && (idx(0) == _b || idx(1) == _b || idx(2) == _b);
+}
+
+MeshTopology::MeshTopology(){
+}
+
+MeshTopology::~MeshTopology(){
+}
+
+void MeshTopology::build(const std::vector<Triangle>& _triangles, unsigned int _nVtx){
+
+    const unsigned int nTri = _triangles.size();
+
+    findVertexTriangles(_triangles, _nVtx);
+
+    // Edges of every triangle, grouped by their lowest vertex: the ones of vertex v are in
+    // edges[edgeOffsets[v]] ... edges[edgeOffsets[v + 1] - 1], as (highest vertex, 3 t + j)
+    // pairs for edge j of triangle t. Groups are counted and filled in parallel, and then
+    // sorted one by one, so edges with the same vertices end up next to each other
+    std::vector<unsigned int> edgeOffsets (_nVtx + 1, 0);
+
+    #pragma omp parallel for
+    for (unsigned int t = 0; t < nTri; t++){
+        const Vector3i& idx = _triangles[t].getIndices();
+        for (unsigned int j = 0; j < 3; j++){
+            #pragma omp atomic
+            edgeOffsets[std::min(idx(j), idx((j + 1) % 3)) + 1]++;
+        }
+    }
+    for (unsigned int v = 0; v < _nVtx; v++){
+        edgeOffsets[v + 1] += edgeOffsets[v];
+    }
+
+    std::vector<std::pair<unsigned int, unsigned int> > edges (3 * (size_t) nTri);
+    std::vector<unsigned int> edgeFill (edgeOffsets.begin(), edgeOffsets.end() - 1);
+
+    #pragma omp parallel for
+    for (unsigned int t = 0; t < nTri; t++){
+        const Vector3i& idx = _triangles[t].getIndices();
+        for (unsigned int j = 0; j < 3; j++){
+            const unsigned int a = idx(j), b = idx((j + 1) % 3);
+            unsigned int pos;
+            #pragma omp atomic capture
+            pos = edgeFill[std::min(a, b)]++;
+            edges[pos] = std::make_pair(std::max(a, b), 3 * t + j);
+        }
+    }
+    std::vector<unsigned int>().swap(edgeFill);
+
+    neighbors_.assign(3 * (size_t) nTri, NONE);
+
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (unsigned int v = 0; v < _nVtx; v++){
+        std::sort(edges.begin() + edgeOffsets[v], edges.begin() + edgeOffsets[v + 1]);
+
+        unsigned int first = edgeOffsets[v];
+        while (first < edgeOffsets[v + 1]){
+            unsigned int last = first + 1;
+            while (last < edgeOffsets[v + 1] && edges[last].first == edges[first].first){
+                last++;
+            }
+            if (last - first > 1){
+                for (unsigned int k = first; k < last; k++){
+                    const unsigned int other = (k == first) ? first + 1 : first;
+                    neighbors_[edges[k].second] = edges[other].second / 3;
+                }
+            }
+            first = last;
+        }
+    }
+
+    findRings(_triangles);
+}
+
+void MeshTopology::subdivide(const std::vector<Triangle>& _triangles, const std::vector<unsigned int>& _parent, unsigned int _nVtx){
+
+    const unsigned int nTri = _triangles.size();
+    const unsigned int nParents = neighbors_.size() / 3;
+
+    // Children of each parent, in increasing order
+    std::vector<unsigned int> childOffsets (nParents + 1, 0), children (nTri);
+    for (unsigned int k = 0; k < nTri; k++){
+        childOffsets[_parent[k] + 1]++;
+    }
+    for (unsigned int p = 0; p < nParents; p++){
+        childOffsets[p + 1] += childOffsets[p];
+    }
+    std::vector<unsigned int> childFill (childOffsets.begin(), childOffsets.end() - 1);
+    for (unsigned int k = 0; k < nTri; k++){
+        children[childFill[_parent[k]]++] = k;
+    }
+    std::vector<unsigned int>().swap(childFill);
+
+    std::vector<unsigned int> neighbors (3 * (size_t) nTri, NONE);
+
+    // An edge of a child is either inside its parent, and shared with a sibling,
+    // or on a side of it, and shared with a child of the neighbor on that side
+    #pragma omp parallel for
+    for (unsigned int k = 0; k < nTri; k++){
+        const unsigned int p = _parent[k];
+        const unsigned int candidates[4] = {p, getNeighbor(p, 0), getNeighbor(p, 1), getNeighbor(p, 2)};
+        const Vector3i& idx = _triangles[k].getIndices();
+
+        for (unsigned int j = 0; j < 3; j++){
+            const int a = idx(j), b = idx((j + 1) % 3);
+            for (unsigned int q = 0; q < 4 && neighbors[3 * (size_t) k + j] == NONE; q++){
+                if (candidates[q] == NONE){
+                    continue;
+                }
+                for (unsigned int c = childOffsets[candidates[q]]; c < childOffsets[candidates[q] + 1]; c++){
+                    if (children[c] != k && hasEdge(_triangles[children[c]], a, b)){
+                        neighbors[3 * (size_t) k + j] = children[c];
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    neighbors_.swap(neighbors);
+
+    findVertexTriangles(_triangles, _nVtx);
+    findRings(_triangles);
+}
+
+void MeshTopology::clear(){
+    std::vector<unsigned int>().swap(vtxOffsets_);
+    std::vector<unsigned int>().swap(vtxTris_);
+    std::vector<unsigned int>().swap(neighbors_);
+    std::vector<size_t>().swap(ringOffsets_);
+    std::vector<unsigned int>().swap(ring_);
+}
+
+void MeshTopology::findVertexTriangles(const std::vector<Triangle>& _triangles, unsigned int _nVtx){
+
+    const unsigned int nTri = _triangles.size();
+
+    // Counted and filled in parallel, in no particular order, and then sorted
+    vtxOffsets_.assign(_nVtx + 1, 0);
+    std::vector<unsigned int> (3 * (size_t) nTri).swap(vtxTris_);
+
+    #pragma omp parallel for
+    for (unsigned int t = 0; t < nTri; t++){
+        for (unsigned int j = 0; j < 3; j++){
+            #pragma omp atomic
+            vtxOffsets_[_triangles[t].getIndex(j) + 1]++;
+        }
+    }
+    for (unsigned int v = 0; v < _nVtx; v++){
+        vtxOffsets_[v + 1] += vtxOffsets_[v];
+    }
+
+    std::vector<unsigned int> vtxFill (vtxOffsets_.begin(), vtxOffsets_.end() - 1);
+    #pragma omp parallel for
+    for (unsigned int t = 0; t < nTri; t++){
+        for (unsigned int j = 0; j < 3; j++){
+            unsigned int pos;
+            #pragma omp atomic capture
+            pos = vtxFill[_triangles[t].getIndex(j)]++;
+            vtxTris_[pos] = t;
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for (unsigned int v = 0; v < _nVtx; v++){
+        std::sort(vtxTris_.begin() + vtxOffsets_[v], vtxTris_.begin() + vtxOffsets_[v + 1]);
+    }
+}
+
+void MeshTopology::findRings(const std::vector<Triangle>& _triangles){
+
+    const unsigned int nTri = _triangles.size();
+    ringOffsets_.assign(nTri + 1, 0);
+
+    // Rings are found twice, first to size them and then to store them
+    for (unsigned int pass = 0; pass < 2; pass++){
+
+        if (pass == 1){
+            for (unsigned int t = 0; t < nTri; t++){
+                ringOffsets_[t + 1] += ringOffsets_[t];
+            }
+            std::vector<unsigned int> (ringOffsets_[nTri]).swap(ring_);
+        }
+
+        #pragma omp parallel
+        {
+            std::vector<unsigned int> ring;
+
+            #pragma omp for schedule(dynamic, 1024)
+            for (unsigned int t = 0; t < nTri; t++){
+                ring.clear();
+                for (unsigned int j = 0; j < 3; j++){
+                    const unsigned int v = _triangles[t].getIndex(j);
+                    ring.insert(ring.end(), getVtxTriangles(v), getVtxTriangles(v) + getNVtxTri(v));
+                }
+                std::sort(ring.begin(), ring.end());
+                ring.erase(std::unique(ring.begin(), ring.end()), ring.end());
+
+                if (pass == 0){
+                    ringOffsets_[t + 1] = ring.size();
+                } else {
+                    std::copy(ring.begin(), ring.end(), ring_.begin() + ringOffsets_[t]);
+                }
+            }
+        }
+    }
+}
+
+size_t MeshTopology::getBytes() const {
+    return (vtxOffsets_.capacity() + vtxTris_.capacity() + neighbors_.capacity() + ring_.capacity()) * sizeof(unsigned int)
+           + ringOffsets_.capacity() * sizeof(size_t);
+}
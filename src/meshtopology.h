@@ -0,0 +1,107 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef MESHTOPOLOGY_H
+#define MESHTOPOLOGY_H
+
+#include <vector>
+#include <climits>
+#include <cstddef>
+
+#include "triangle.h"
+
+// Adjacency of the triangles of a mesh, shared by every stage that needs it: the
+// triangles around each vertex, the neighbor of each triangle across each of its edges
+// and the ring of triangles that share a vertex with each triangle. Everything is kept
+// one list after another (CSR), and lists are in increasing order of triangle index.
+// Edge neighbors are found by sorting the edges of every triangle by their vertices.
+class MeshTopology {
+
+public:
+
+    // No neighbor across an edge (boundary)
+    static const unsigned int NONE = UINT_MAX;
+
+    MeshTopology();
+    virtual ~MeshTopology();
+
+    // Finds the adjacency of the mesh made of _triangles, which has _nVtx vertices
+    void build(const std::vector<Triangle>& _triangles, unsigned int _nVtx);
+
+    // Updates the adjacency after splitting each triangle in smaller ones, _triangles
+    // being the new ones and _parent[k] the triangle that _triangles[k] comes from. Sides
+    // of the new triangles must lie on the sides of their parents and match the ones of
+    // the triangles on the other side, so edge neighbors are found among the children of
+    // the parent and of the parent's neighbors, without sorting the edges again
+    void subdivide(const std::vector<Triangle>& _triangles, const std::vector<unsigned int>& _parent, unsigned int _nVtx);
+
+    void clear();
+
+    inline bool isBuilt() const {
+        return !vtxOffsets_.empty();
+    }
+
+    // Triangles around vertex _v
+    inline unsigned int getNVtxTri(unsigned int _v) const {
+        return vtxOffsets_[_v + 1] - vtxOffsets_[_v];
+    }
+    inline const unsigned int* getVtxTriangles(unsigned int _v) const {
+        return &vtxTris_[vtxOffsets_[_v]];
+    }
+
+    // Triangle across edge _j of triangle _t, which goes from its vertex _j to
+    // vertex (_j + 1) % 3. Where more than two triangles share an edge, each of
+    // them gets one of the others. NONE if the edge is on the boundary
+    inline unsigned int getNeighbor(unsigned int _t, unsigned int _j) const {
+        return neighbors_[3 * (size_t) _t + _j];
+    }
+
+    // Triangles that share at least one vertex with triangle _t, _t included
+    inline unsigned int getNRing(unsigned int _t) const {
+        return ringOffsets_[_t + 1] - ringOffsets_[_t];
+    }
+    inline const unsigned int* getRing(unsigned int _t) const {
+        return &ring_[ringOffsets_[_t]];
+    }
+
+    size_t getBytes() const;
+
+private:
+
+    // Fill the triangles around each vertex and the ring of each triangle
+    void findVertexTriangles(const std::vector<Triangle>& _triangles, unsigned int _nVtx);
+    void findRings(const std::vector<Triangle>& _triangles);
+
+    // Triangles around each vertex, one vertex after another: the ones of
+    // vertex v start at position vtxOffsets_[v] of vtxTris_
+    std::vector<unsigned int> vtxOffsets_, vtxTris_;
+    // Three per triangle
+    std::vector<unsigned int> neighbors_;
+    // Rings of the triangles, one after another (they add up to more than 2^32 on large meshes)
+    std::vector<size_t> ringOffsets_;
+    std::vector<unsigned int> ring_;
+
+};
+
+#endif // MESHTOPOLOGY_H
@@ -25,11 +25,25 @@
 #include <iomanip>
 #include <algorithm>
 #include <chrono>
+#include <functional>
+#include <climits>
+#include <limits>
+#include <thread>
+#include <memory>
 
 #include <opencv2/photo/photo.hpp>
 
 #include "multitexturer.h"
 
+// Number of points sampled together when coloring, so each image
+// is visited once per batch instead of once per point
+static const unsigned int SAMPLE_BATCH_SIZE = 8192;
+
+// Segments each edge is split into when bounding the image window of a
+// distorted camera, and points projected together while doing it
+static const unsigned int EDGE_SAMPLES = 16;
+static const unsigned int EDGE_BATCH = 8192;
+
 Multitexturer::Multitexturer(){
     ca_mode_ = AREA_OCCL;
     m_mode_ = TEXTURE;
@@ -39,10 +53,14 @@ Multitexturer::Multitexturer(){
     alpha_ = 0.5;
     beta_ = 1.0;
     dimension_ = 10000000;
-    imageCacheSize_ = 75;
+    imageCacheSize_ = 4096;
+    prefetchThreads_ = 2;
     highlightOcclusions_ = false;
     powerOfTwoImSize_ = false;
     photoconsistency_ = false;
+    pruneAngle_ = 0.0;
+    depthScale_ = 1.0;
+    rayVisibility_ = false;
 
     nCam_ = nVtx_ = nTri_ = 0;
 
@@ -154,6 +172,53 @@ void Multitexturer::parseCommandLine(int argc, char *argv[]){
                             ss << stringValue;
                             ss >> intValue;
                             imageCacheSize_ = intValue;
+                        } else if (optionValue.compare("prefetch") == 0){
+                            for (unsigned int i = 2 + optionValue.length() + 1; opt[i] != '\0'; i++){
+                                if (!isdigit(opt[i])){
+                                    std::cerr << "Wrong number of prefetching threads!" << std::endl;
+                                    printHelp();
+                                }
+                                stringValue += opt[i];
+                            }
+                            unsigned int uiValue;
+                            std::stringstream ss;
+                            ss << stringValue;
+                            ss >> uiValue;
+                            prefetchThreads_ = uiValue;
+                        } else if (optionValue.compare("prune") == 0){
+                            for (unsigned int i = 2 + optionValue.length() + 1; opt[i] != '\0'; i++){
+                                stringValue += opt[i];
+                            }
+                            std::stringstream ss;
+                            ss << stringValue;
+                            ss >> floatValue;
+                            if (ss.fail() || floatValue < 0.0f || floatValue >= 90.0f){
+                                std::cerr << "Wrong pruning angle!" << std::endl;
+                                printHelp();
+                            }
+                            pruneAngle_ = floatValue;
+                        } else if (optionValue.compare("zbuffer") == 0){
+                            for (unsigned int i = 2 + optionValue.length() + 1; opt[i] != '\0'; i++){
+                                stringValue += opt[i];
+                            }
+                            std::stringstream ss;
+                            ss << stringValue;
+                            ss >> floatValue;
+                            if (ss.fail() || floatValue <= 0.0f){
+                                std::cerr << "Wrong depth buffer scale!" << std::endl;
+                                printHelp();
+                            }
+                            depthScale_ = floatValue;
+                        } else if (optionValue.compare("raycast") == 0){
+                            rayVisibility_ = true;
+                        } else if (optionValue.compare("store") == 0){
+                            for (unsigned int i = 2 + optionValue.length() + 1; opt[i] != '\0'; i++){
+                                imageStoreDir_ += opt[i];
+                            }
+                        } else if (optionValue.compare("ratings") == 0){
+                            for (unsigned int i = 2 + optionValue.length() + 1; opt[i] != '\0'; i++){
+                                ratingStoreDir_ += opt[i];
+                            }
                         } else {
                             std::cerr << "Unknown option: "  << optionValue << std::endl;
                             printHelp();
@@ -260,6 +325,12 @@ void Multitexturer::parseCommandLine(int argc, char *argv[]){
 
     }
 
+    imageCache_.setBudget((size_t) imageCacheSize_ * 1024 * 1024);
+    if (!imageStoreDir_.empty()){
+        imageCache_.setStore(imageStoreDir_);
+        std::cerr << "Decoded images are stored in " << imageStoreDir_ << std::endl;
+    }
+
     std::cerr << "Output files will be: " << std::endl;
     std::cerr << fileNameOut_ << std::endl;
     std::cerr << fileNameTexOut_ << std::endl;
@@ -278,8 +349,9 @@ void Multitexturer::evaluateCameraRatings(){
     times_ << "Evaluating camera ratings..." << std::endl;
 
     // Originally, tri_ratings was a field in Camera class. However, due to memory allocation
-    // issues, we have extracted it from there, and make a vector of vectors instead
-    std::vector<std::vector<float> > cam_tri_ratings (nCam_, std::vector<float>(nTri_, 0.0));
+    // issues, we have extracted it from there. Each camera only keeps the triangles it rates
+    RatingMatrix ratings;
+    ratings.reset(nCam_, nTri_);
 
 
     for (unsigned int c = 0 ; c < nCam_ ; c++){
@@ -288,19 +360,44 @@ void Multitexturer::evaluateCameraRatings(){
 
     auto start = std::chrono::system_clock::now();
 
-    // This step will calculate every camera-triangle ratings
-    // using the chosen system.
-    switch (ca_mode_) {
-    case NORMAL_VERTEX:
-    case NORMAL_BARICENTER:
-        evaluateNormal(cam_tri_ratings);
-        break;
-    case AREA:
-        evaluateArea(cam_tri_ratings);
-        break;
-    case AREA_OCCL:
-        evaluateAreaWithOcclusions(cam_tri_ratings);
-        break;
+    // The mesh may have been subdivided since the last time
+    clusters_.build(mesh_);
+    projections_.reset(nCam_, nVtx_);
+
+    // Ratings only depend on the mesh, the cameras and the options below,
+    // so they are taken from the store when it already has them
+    std::unique_ptr<RatingStore> store;
+    unsigned long long key = 0;
+    bool stored = false;
+    if (!ratingStoreDir_.empty()){
+        std::stringstream options;
+        options << ca_mode_ << ' ' << depthScale_ << ' ' << rayVisibility_;
+        store.reset(new RatingStore(ratingStoreDir_));
+        key = RatingStore::computeKey(mesh_, cameras_, options.str());
+        stored = store->load(key, ratings);
+    }
+
+    if (stored){
+        std::cerr << "Camera ratings taken from " << ratingStoreDir_ << std::endl;
+        cacheRatedProjections(ratings);
+    } else {
+        // This step will calculate every camera-triangle ratings
+        // using the chosen system.
+        switch (ca_mode_) {
+        case NORMAL_VERTEX:
+        case NORMAL_BARICENTER:
+            evaluateNormal(ratings);
+            break;
+        case AREA:
+            evaluateArea(ratings);
+            break;
+        case AREA_OCCL:
+            evaluateAreaWithOcclusions(ratings);
+            break;
+        }
+        if (store){
+            store->save(key, ratings);
+        }
     }
 
     auto t_tri_ratings = std::chrono::system_clock::now();
@@ -308,37 +405,25 @@ void Multitexturer::evaluateCameraRatings(){
     times_ << "Triangle ratings:" << std::endl;
     times_ << diff.count() << std::endl;
 
-    // Create vtx2tri and tri2tri
-    // vtx2vtx is a vector containing every direct neighbor for each vertex
-    std::vector<std::vector<int> > vtx2tri(nVtx_);
-    for (unsigned int i = 0; i < nTri_; i++) {
-        for (unsigned int j = 0; j < 3; j++)
-            vtx2tri[mesh_.getTriangle(i).getIndex(j)].push_back(i);
-    }
-    // tri2tri is a list containing every neigbor of each triangle
-    std::vector<std::list<int> > tri2tri (nTri_);
-    for (unsigned int i = 0; i < nVtx_; i++) {
-        for (std::vector<int>::iterator ita = vtx2tri[i].begin(); ita != vtx2tri[i].end(); ++ita) {
-            for (std::vector<int>::iterator itb = vtx2tri[i].begin(); itb != vtx2tri[i].end(); ++itb) {
-                tri2tri[*ita].push_back(*itb);
-                tri2tri[*itb].push_back(*ita);
-            }
-        }
-    }
+    std::cerr << "Camera ratings: " << ratings.getNPairs() << " rated camera-triangle pairs, ";
+    std::cerr << ratings.getBytes() / (1024 * 1024) << " MB." << std::endl;
+    times_ << "Rated camera-triangle pairs (pairs/MB):" << std::endl;
+    times_ << ratings.getNPairs() << " " << ratings.getBytes() / (1024 * 1024) << std::endl;
 
-    for (unsigned int i = 0; i < nTri_; i++) {
-        tri2tri[i].sort();
-        tri2tri[i].unique();
-    }
+    // Triangles around each vertex and around each triangle
+    const MeshTopology& topology = mesh_.getTopology();
 
+    // Normals and centroids do not change between weightings
+    NormalWeighting weighting;
+    weighting.build(mesh_, alpha_, beta_);
 
     std::cerr << "\n";
     std::cerr << "Smoothing triangle ratings... ";
 
     // Normal smoothing and weighting
     for (unsigned int i = 0; i < 3; i++){
-        smoothRatings(tri2tri, cam_tri_ratings);
-        evaluateWeightNormal(cam_tri_ratings);
+        smoothRatings(ratings);
+        evaluateWeightNormal(ratings, weighting);
     }
 
     auto t_smooth = std::chrono::system_clock::now();
@@ -349,34 +434,48 @@ void Multitexturer::evaluateCameraRatings(){
     std::cerr << "done!\n";
 
     if (fileFaceCam_.size() != 0){
-        improveFaceRatings(cam_tri_ratings);
-        evaluateWeightNormal(cam_tri_ratings);
+        improveFaceRatings(ratings);
+        evaluateWeightNormal(ratings, weighting);
     }
 
     // At this point, triangle ratings are already known,
-    // and their average is calculated to set the vertex ratings 
-    for(unsigned int c = 0; c < nCam_; c++){
-
-        for(unsigned int i = 0; i < nVtx_ ; i++){
-            std::vector<int>::iterator it;
-            float totrating = 0.0;
-            int numTri = 0;
-            for (it = vtx2tri[i].begin(); it != vtx2tri[i].end(); ++it){
-//                if (cameras_[c].tri_ratings_[*it] == 0.0){
-                if (cam_tri_ratings[c][*it] == 0){
-                    totrating = 0.0;
-                    break;
+    // and their average is calculated to set the vertex ratings.
+    // Vertices of triangles the camera does not rate are rated 0
+    #pragma omp parallel
+    {
+        std::vector<float> tri_ratings (nTri_, 0.0);
+
+        #pragma omp for schedule(dynamic)
+        for(unsigned int c = 0; c < nCam_; c++){
+
+            std::fill(cameras_[c].vtx_ratings_.begin(), cameras_[c].vtx_ratings_.end(), 0.0f);
+            ratings.scatter(c, tri_ratings);
+
+            const unsigned int* triangles = ratings.getTriangles(c);
+            for (size_t t = 0; t < ratings.getNRated(c); t++){
+                for (unsigned int j = 0; j < 3; j++){
+                    const unsigned int i = mesh_.getTriangle(triangles[t]).getIndex(j);
+                    const unsigned int* vtxTris = topology.getVtxTriangles(i);
+                    float totrating = 0.0;
+                    int numTri = 0;
+                    for (unsigned int k = 0; k < topology.getNVtxTri(i); k++){
+                        if (tri_ratings[vtxTris[k]] == 0){
+                            totrating = 0.0;
+                            break;
+                        }
+                        const float rating = tri_ratings[vtxTris[k]];
+                        totrating += rating;
+                        numTri++;
+                    }
+                    if (numTri == 0){
+                        cameras_[c].vtx_ratings_[i] = 0;
+                    } else {
+                        cameras_[c].vtx_ratings_[i] = totrating/numTri;
+                    }
                 }
-//                float rating = cameras_[c].tri_ratings_[*it];
-                const float rating = cam_tri_ratings[c][*it];
-                totrating += rating;
-                numTri++;
-            }
-            if (numTri == 0){
-                cameras_[c].vtx_ratings_[i] = 0;
-            } else {
-                cameras_[c].vtx_ratings_[i] = totrating/numTri;
             }
+
+            ratings.clear(c, tri_ratings);
         }
     }
 
@@ -386,13 +485,11 @@ void Multitexturer::evaluateCameraRatings(){
     times_ << diff.count() << std::endl;
 
     // This is probably not necessary, but just in case...
-    for (unsigned int c = 0; c < nCam_; c++){
-        std::vector<float>().swap(cam_tri_ratings[c]);
-    }
-    std::vector<std::vector<float> >().swap(cam_tri_ratings);
+    ratings.reset(0, 0);
 
     std::cerr << "\rdone!         " << std::endl;
 
+    setImageRegions();
 
 }
 
@@ -452,7 +549,20 @@ void Multitexturer::printHelp() const {
         "--dimension=<dimension> resolution of the output image measured in Mpixels. Default: 1.",
         "--width=<width> width of the output image measured in pixels. If this value is",
         "\t\tgreater than zero, then <dimension> is ignored.",
-        "--cache=<cachesize> size of the image cache. Default: 75.",
+        "--cache=<cachesize> size of the image cache in MB. Default: 4096.",
+        "--prefetch=<threads> number of threads decoding images ahead of time while",
+        "\t\tcoloring the texture atlas. 0 disables it. Default: 2.",
+        "--store=<directory> keeps decoded images in <directory>, so later runs on the",
+        "\t\tsame images map them from disk instead of decoding them again.",
+        "--ratings=<directory> keeps the camera ratings in <directory>, so later runs on the",
+        "\t\tsame mesh and cameras with the same rating options do not evaluate them again.",
+        "--zbuffer=<scale> resolution of the depth buffer used to find occlusions (-l and -p),",
+        "\t\tin pixels per image pixel. Default: 1.",
+        "--raycast\tchecks the visibility of vertices (-l and -p), of the photoconsistency",
+        "\t\tsamples and of the texels exactly, tracing rays towards the cameras.",
+        "--prune=<degrees> drops cameras whose position and viewing direction are within",
+        "\t\t<degrees> of a kept camera that sees the same parts of the mesh at a similar",
+        "\t\tresolution. Default: 0 (every camera is used).",
         "-h\t\tPrint this help message."};
 
     for (unsigned int i = 0; i < sizeof(help) / sizeof(help[0]); ++i) {
@@ -466,6 +576,20 @@ void Multitexturer::loadInputData(){
     readInputMesh();
     readImageList();
     loadCameraInfo();
+    if (pruneAngle_ > 0.0){
+        pruneCameras();
+    }
+    if (rayVisibility_){
+        auto t_start = std::chrono::high_resolution_clock::now();
+        bvh_.build(mesh_);
+        auto t_end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double> diff = t_end - t_start;
+
+        std::cerr << "Ray casting hierarchy: " << bvh_.getNNodes() << " nodes, " << bvh_.getBytes() / (1024 * 1024) << " MB (";
+        std::cerr << diff.count() << " s)." << std::endl;
+        times_ << "Building ray casting hierarchy:" << std::endl;
+        times_ << diff.count() << std::endl;
+    }
 }
 
 void Multitexturer::loadCameraInfo(){
@@ -479,14 +603,174 @@ void Multitexturer::loadCameraInfo(){
         bundler = false;
     }
 
+    // Image headers are read in parallel: Bundler cameras take their image dimensions from them,
+    // and the dimensions in camera files are checked against them. Probing is bound by the storage,
+    // so there are more threads than cores
+    ImageHeaders headers (fileNameImageList_ + ".headers");
+    auto t_start = std::chrono::high_resolution_clock::now();
+    headers.probe(imageList_, std::max(8u, 2 * std::thread::hardware_concurrency()));
+    auto t_end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = t_end - t_start;
+
+    std::cerr << "Image headers: " << headers.getNProbed() << " read, " << headers.getNReused() << " reused (";
+    std::cerr << diff.count() << " s)." << std::endl;
+    times_ << "Reading image headers:" << std::endl;
+    times_ << diff.count() << std::endl;
+
     if (bundler){
-        readBundlerFile();
+        readBundlerFile(headers);
     } else {
         readCameraFile();
     }
+
+    checkImages(headers);
+}
+
+void Multitexturer::checkImages(const ImageHeaders& _headers) const {
+
+    if (imageList_.size() < nCam_){
+        std::cerr << "There are " << nCam_ << " cameras but only " << imageList_.size() << " images!" << std::endl;
+        exit(-1);
+    }
+
+    // Every problem is reported before giving up
+    unsigned int errors = 0;
+    for (unsigned int c = 0; c < nCam_; c++){
+        if (!_headers.isValid(c)){
+            std::cerr << "Image " << imageList_[c] << " is missing or cannot be read!" << std::endl;
+            errors++;
+        } else if (_headers.getWidth(c) != cameras_[c].getImageWidth() || _headers.getHeight(c) != cameras_[c].getImageHeight()){
+            std::cerr << "Image " << imageList_[c] << " is " << _headers.getWidth(c) << "x" << _headers.getHeight(c);
+            std::cerr << ", but its camera is calibrated for " << cameras_[c].getImageWidth() << "x" << cameras_[c].getImageHeight() << "!" << std::endl;
+            errors++;
+        }
+    }
+
+    if (errors > 0){
+        std::cerr << errors << " of " << nCam_ << " images are not valid!" << std::endl;
+        exit(-1);
+    }
 }
 
 
+void Multitexturer::pruneCameras(){
+
+    std::cerr << "Pruning redundant cameras..." << std::endl;
+    auto t_start = std::chrono::high_resolution_clock::now();
+
+    clusters_.build(mesh_);
+    const unsigned int nClusters = clusters_.getNClusters();
+
+    // Clusters each camera may see, and the resolution it sees them at: pixels per unit
+    // of length at the center of the cluster. Occlusions are not taken into account
+    std::vector<std::vector<unsigned int> > visible (nCam_);
+    std::vector<std::vector<float> > resolution (nCam_);
+    std::vector<double> quality (nCam_, 0.0); // Triangles seen, weighted by their resolution
+    std::vector<unsigned long long> pairs (nCam_, 0);
+    std::vector<float> distance (nCam_, 0.0f); // Mean distance to the clusters seen
+
+    #pragma omp parallel for
+    for (unsigned int c = 0; c < nCam_; c++){
+        clusters_.findVisibleClusters(cameras_[c], visible[c]);
+        const Vector3f& position = cameras_[c].getPosition();
+        const float focal = cameras_[c].getIntrinsicParam()(0,0);
+        resolution[c].resize(visible[c].size());
+        for (unsigned int k = 0; k < visible[c].size(); k++){
+            const unsigned int cluster = visible[c][k];
+            const float d = (clusters_.getCenter(cluster) - position).norm();
+            resolution[c][k] = focal / std::max(d, std::numeric_limits<float>::min());
+            quality[c] += clusters_.getNTri(cluster) * resolution[c][k];
+            pairs[c] += clusters_.getNTri(cluster);
+            distance[c] += d;
+        }
+        if (!visible[c].empty()){
+            distance[c] /= visible[c].size();
+        }
+    }
+
+    // Cameras are considered from the one that sees the most at the highest resolution,
+    // so the kept ones are the best of each group of near-duplicates
+    std::vector<unsigned int> order (nCam_);
+    for (unsigned int c = 0; c < nCam_; c++){
+        order[c] = c;
+    }
+    std::stable_sort(order.begin(), order.end(), [&quality](unsigned int _a, unsigned int _b){ return quality[_a] > quality[_b]; });
+
+    // Two cameras are near-duplicates if their viewing directions are within the pruning
+    // angle, and so is the parallax between them as seen from the mesh
+    const float cosAngle = cos(pruneAngle_ * (float) M_PI / 180);
+    const float tanAngle = tan(pruneAngle_ * (float) M_PI / 180);
+    // A near-duplicate is only dropped if every cluster it sees is seen by a kept
+    // camera with at least this fraction of its resolution
+    const float minResolution = 0.9f;
+    const int faceCam = fileFaceCam_.empty() ? -1 : findCameraInList(fileFaceCam_);
+
+    std::vector<float> keptResolution (nClusters, 0.0f); // Best one among the kept cameras
+    std::vector<unsigned int> kept;
+    std::vector<char> keep (nCam_, 0);
+
+    for (unsigned int o = 0; o < nCam_; o++){
+        const unsigned int c = order[o];
+
+        // Cameras that see nothing are never used
+        if (visible[c].empty() && (int) c != faceCam){
+            continue;
+        }
+
+        bool duplicate = false;
+        const Vector3f direction = cameras_[c].getExtrinsicParam().row(2);
+        for (unsigned int j = 0; j < kept.size() && !duplicate; j++){
+            const Camera& other = cameras_[kept[j]];
+            duplicate = direction.dot(other.getExtrinsicParam().row(2)) >= cosAngle
+                && (cameras_[c].getPosition() - other.getPosition()).norm() <= tanAngle * distance[c];
+        }
+
+        bool covered = duplicate && (int) c != faceCam;
+        for (unsigned int k = 0; k < visible[c].size() && covered; k++){
+            covered = keptResolution[visible[c][k]] >= minResolution * resolution[c][k];
+        }
+        if (covered){
+            continue;
+        }
+
+        keep[c] = 1;
+        kept.push_back(c);
+        for (unsigned int k = 0; k < visible[c].size(); k++){
+            keptResolution[visible[c][k]] = std::max(keptResolution[visible[c][k]], resolution[c][k]);
+        }
+    }
+
+    // Kept cameras stay in their original order
+    std::vector<Camera> cameras;
+    std::vector<std::string> imageList;
+    unsigned long long allPairs = 0, keptPairs = 0;
+    for (unsigned int c = 0; c < nCam_; c++){
+        allPairs += pairs[c];
+        if (keep[c]){
+            cameras.push_back(cameras_[c]);
+            imageList.push_back(imageList_[c]);
+            keptPairs += pairs[c];
+        }
+    }
+
+    const unsigned int dropped = nCam_ - cameras.size();
+    cameras_.swap(cameras);
+    imageList_.swap(imageList);
+    nCam_ = cameras_.size();
+
+    auto t_end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = t_end - t_start;
+
+    // The rating and coloring stages are linear in the camera-triangle pairs
+    const float saved = allPairs > 0 ? (1.0f - (float) keptPairs / allPairs) * 100 : 0.0f;
+    std::cerr << "Dropped " << dropped << " of " << nCam_ + dropped << " cameras, " << saved;
+    std::cerr << "% of the camera-triangle pairs (" << diff.count() << " s)." << std::endl;
+    times_ << "Pruning cameras:" << std::endl;
+    times_ << diff.count() << std::endl;
+    times_ << "Dropped cameras (number, % of camera-triangle pairs):" << std::endl;
+    times_ << dropped << " " << saved << std::endl;
+}
+
 void Multitexturer::readCameraFile(){
 
     std::ifstream camFile(fileNameCam_.c_str());
@@ -500,12 +784,16 @@ void Multitexturer::readCameraFile(){
 
         std::cerr << "Reading " << nCam_ << " camera parameters... ";
 
-        // Now every camera calibration file is read
+        // Now every camera calibration line is read, and then parsed in parallel
+        std::vector<std::string> lines (nCam_);
         for ( unsigned int i = 0; i < nCam_ ; i++){
-            Camera c;
-            std::getline(camFile,line);
-            c.loadCameraParameters(line);
-            cameras_.push_back(c);
+            std::getline(camFile, lines[i]);
+        }
+
+        cameras_.resize(nCam_);
+        #pragma omp parallel for
+        for (unsigned int i = 0; i < nCam_; i++){
+            cameras_[i].loadCameraParameters(lines[i]);
         }
 
         std::cerr << "done!\n";
@@ -519,7 +807,7 @@ void Multitexturer::readCameraFile(){
     camFile.close();
 }
 
-void Multitexturer::readBundlerFile(){
+void Multitexturer::readBundlerFile(const ImageHeaders& _headers){
 
     std::ifstream bundlerFile(fileNameCam_.c_str());
 
@@ -537,7 +825,11 @@ void Multitexturer::readBundlerFile(){
 
         for (unsigned int i = 0; i < nCam_; i++){
             Camera c;
-            c.loadBundlerCameraParameters(bundlerFile, imageList_[i]);
+            if (i < _headers.getNImages() && _headers.isValid(i)){
+                c.loadBundlerCameraParameters(bundlerFile, Vector2i(_headers.getWidth(i), _headers.getHeight(i)));
+            } else { // Reported by checkImages()
+                c.loadBundlerCameraParameters(bundlerFile, Vector2i(0, 0));
+            }
             cameras_.push_back(c);
         }
 
@@ -582,414 +874,551 @@ void Multitexturer::readInputMesh(){
     nVtx_ = mesh_.getNVtx();
     nTri_ = mesh_.getNTri();
 
+    auto t_start = std::chrono::high_resolution_clock::now();
+    mesh_.buildTopology();
+    auto t_end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> diff = t_end - t_start;
+
+    std::cerr << "Mesh topology: " << mesh_.getTopology().getBytes() / (1024 * 1024) << " MB (";
+    std::cerr << diff.count() << " s)." << std::endl;
+    times_ << "Building mesh topology:" << std::endl;
+    times_ << diff.count() << std::endl;
+
     origMesh_ = mesh_;
 
 }
 
 
 
-void Multitexturer::evaluateNormal(std::vector<std::vector<float> >& _cam_tri_ratings){
+void Multitexturer::evaluateNormal(RatingMatrix& _ratings){
 
+    std::vector<Vector3f> normals (nTri_);
     for (unsigned int i = 0; i < nTri_; i++) {
-
-        const Triangle& thistri = mesh_.getTriangle(i);
-        // Find camera most orthogonal to this triangle
-        Vector3f n = mesh_.getTriangleNormal(i);
-        for (unsigned int j = 0; j < nCam_; j++) {
-            
-            Vector3f mf = mesh_.getVertex(thistri.getIndex(0));
-            // In case we are using the baricenter (centroid) position
-            if (ca_mode_ == NORMAL_BARICENTER) { 
-                mf += mesh_.getVertex(thistri.getIndex(1));
-                mf += mesh_.getVertex(thistri.getIndex(2));
-                mf /= 3;
-            }
-
-            mf -= cameras_[j].getPosition();
-            Vector3f nf = mf.normalized();
-            const float dp = n.dot(nf);
-
-
-            // test : true if all coordinates in [0,1]
-            std::vector<Vector2f> uv_vtx;
-            for (unsigned int k = 0; k < 3; k++) {
-                const Vector3f& vc = mesh_.getVertex(thistri.getIndex(k));
-                Vector2f uv = cameras_[j].transform2uvCoord(vc);
-                uv_vtx.push_back(uv);
-            }
-
-            bool test = true;
-            for (unsigned int k = 0; k < uv_vtx.size(); k++){
-                const Vector2f thisUV = uv_vtx[k];
-                if ( thisUV(0) < 0 || cameras_[j].getImageWidth()  < thisUV(0) ||
-                   thisUV(1) < 0 || cameras_[j].getImageHeight() < thisUV(1) ){
-                    test = false;
-                }
-            }
-
-            if (test){
-            // In case the camera is facing back, the rating assigned is 0
-//            cameras_[j].tri_ratings_[i] = (dp < 0) ? ( -1 * dp) : 0;
-                _cam_tri_ratings[j][i] = (dp < 0) ? ( -1 * dp) : 0;
-            }
-
-        }
-        std::cerr << "\r" << (float)i/nTri_*100 << std::setw(4) << std::setprecision(4) << "%      "<< std::flush;
-
+        normals[i] = mesh_.getTriangleNormal(i);
     }
-} 
-
-
-void Multitexturer::evaluateArea(std::vector<std::vector<float> >& _cam_tri_ratings){
-
-
-    std::vector<Vector2f> uv_vtx(3, Vector2f(0.0,0.0));
-    std::vector<float> tri_ratings (nTri_);
 
+    // Projections of the vertices onto the image plane of the current camera, and their depths.
+    // Only the ones in clusters that the camera may see are set
+    std::vector<Vector2f> vtx_st (nVtx_);
+    std::vector<float> vtx_depth (nVtx_);
+    std::vector<unsigned int> visible;
+    // Triangles rated by the current camera and their ratings
+    std::vector<unsigned int> camTriangles;
+    std::vector<float> camRatings;
+    unsigned long long ratedPairs = 0;
+
+    for (unsigned int j = 0; j < nCam_; j++) {
+
+        // Triangles in the rest of the clusters are outside the image or back-facing,
+        // so their rating stays 0
+        clusters_.findVisibleClusters(cameras_[j], visible);
+        camTriangles.clear();
+        camRatings.clear();
+
+        for (unsigned int k = 0; k < visible.size(); k++) {
+
+            clusters_.projectVertices(visible[k], cameras_[j], vtx_st, &vtx_depth);
+            const unsigned int* triangles = clusters_.getTriangles(visible[k]);
+            ratedPairs += clusters_.getNTri(visible[k]);
+
+            for (unsigned int t = 0; t < clusters_.getNTri(visible[k]); t++) {
+
+                const unsigned int i = triangles[t];
+                const Triangle& thistri = mesh_.getTriangle(i);
+                // Find camera most orthogonal to this triangle
+                const Vector3f& n = normals[i];
+
+                Vector3f mf = mesh_.getVertex(thistri.getIndex(0));
+                // In case we are using the baricenter (centroid) position
+                if (ca_mode_ == NORMAL_BARICENTER) { 
+                    mf += mesh_.getVertex(thistri.getIndex(1));
+                    mf += mesh_.getVertex(thistri.getIndex(2));
+                    mf /= 3;
+                }
 
-    for (unsigned int i = 0; i < nTri_; i++) {
-        
-        const Triangle& thistri = mesh_.getTriangle(i);
-        Vector3f n = mesh_.getTriangleNormal(i);
+                mf -= cameras_[j].getPosition();
+                Vector3f nf = mf.normalized();
+                const float dp = n.dot(nf);
 
-        for (unsigned int j = 0; j < nCam_; j++) {
-            
-//            cameras_[j].tri_ratings_[i] = 0;
-            _cam_tri_ratings[j][i] = 0;
-            // Calculate dot product (dp), in order to discard backfacing
-            // It only matters whether it is positive or negative
-            Vector3f mf = mesh_.getVertex(thistri.getIndex(0));
-            mf -= cameras_[j].getPosition();
-            const float dp = mf.dot(n);
-            
-            if (dp < 0) {
-                // Vertex projections to the image plane
-                for (unsigned int k=0; k<3; k++) {
-                    const Vector3f& vc = mesh_.getVertex(thistri.getIndex(k));
-                    const Vector2f uv = cameras_[j].transform2uvCoord(vc);
-                    uv_vtx[k] = uv;
-                }
 
                 // test : true if all coordinates in [0,1]
                 bool test = true;
-                for (unsigned int k = 0; k < uv_vtx.size(); k++){
-                    const Vector2f& thisUV = uv_vtx[k];
+                for (unsigned int v = 0; v < 3; v++){
+                    const Vector2f& thisUV = vtx_st[thistri.getIndex(v)];
                     if ( thisUV(0) < 0 || cameras_[j].getImageWidth()  < thisUV(0) ||
-                         thisUV(1) < 0 || cameras_[j].getImageHeight() < thisUV(1) ){
+                       thisUV(1) < 0 || cameras_[j].getImageHeight() < thisUV(1) ){
                         test = false;
                     }
                 }
 
-                if (test) {
-                    const Vector2f& v0 = uv_vtx[0];
-                    const Vector2f& v1 = uv_vtx[1];
-                    const Vector2f& v2 = uv_vtx[2];
-                    float area = (v0(1)-v2(1)) * (v1(0)-v2(0)) - (v0(0)-v2(0)) * (v1(1)-v2(1)); // should be divided by 2, but it really does not matter
-//                    cameras_[j].tri_ratings_[i] = area;
-                    _cam_tri_ratings[j][i] = area;
+                if (test){
+                // In case the camera is facing back, the rating assigned is 0
+    //            cameras_[j].tri_ratings_[i] = (dp < 0) ? ( -1 * dp) : 0;
+                    camTriangles.push_back(i);
+                    camRatings.push_back((dp < 0) ? ( -1 * dp) : 0);
                 }
 
-            } // else -> tri_ratings_ stays 0
-        }
-
-        if (0 == i % 1024){
-            std::cerr << "\r" << (float)i/nTri_*100 << std::setw(4) << std::setprecision(4) << "%      "<< std::flush;
+            }
         }
+        _ratings.store(j, camTriangles, camRatings);
+        cacheProjections(j, _ratings, vtx_st, vtx_depth);
+        std::cerr << "\r" << (float)(j+1)/nCam_*100 << std::setw(4) << std::setprecision(4) << "%      "<< std::flush;
 
     }
 
-    std::cerr << "\rdone!          " << std::endl;
-}
+    reportCulling(ratedPairs);
+} 
 
-void Multitexturer::evaluateAreaWithOcclusions(std::vector<std::vector<float> >& _cam_tri_ratings){
 
-    // which triangles contain each vertex
-    std::vector<std::vector<int> > vtx2tri (nVtx_);
+void Multitexturer::evaluateArea(RatingMatrix& _ratings){
 
+
+    std::vector<Vector2f> uv_vtx(3, Vector2f(0.0,0.0));
+    std::vector<Vector3f> normals (nTri_);
     for (unsigned int i = 0; i < nTri_; i++) {
-        for (unsigned int j = 0; j < 3; j++){
-            vtx2tri[mesh_.getTriangle(i).getIndex(j)].push_back(i);
-        }
+        normals[i] = mesh_.getTriangleNormal(i);
     }
+    // Projections of the vertices onto the image plane of the current camera, and their depths.
+    // Only the ones in clusters that the camera may see are set
+    std::vector<Vector2f> vtx_st (nVtx_);
+    std::vector<float> vtx_depth (nVtx_);
+    std::vector<unsigned int> visible;
+    // Triangles rated by the current camera and their ratings
+    std::vector<unsigned int> camTriangles;
+    std::vector<float> camRatings;
+    unsigned long long ratedPairs = 0;
+
+    for (unsigned int j = 0; j < nCam_; j++) {
+
+        // Triangles in the rest of the clusters are outside the image or back-facing,
+        // so their rating stays 0
+        clusters_.findVisibleClusters(cameras_[j], visible);
+        camTriangles.clear();
+        camRatings.clear();
+
+        for (unsigned int k = 0; k < visible.size(); k++) {
+
+            clusters_.projectVertices(visible[k], cameras_[j], vtx_st, &vtx_depth);
+            const unsigned int* triangles = clusters_.getTriangles(visible[k]);
+            ratedPairs += clusters_.getNTri(visible[k]);
+
+            for (unsigned int t = 0; t < clusters_.getNTri(visible[k]); t++) {
+
+                const unsigned int i = triangles[t];
+                const Triangle& thistri = mesh_.getTriangle(i);
+                const Vector3f& n = normals[i];
+
+                // Calculate dot product (dp), in order to discard backfacing
+                // It only matters whether it is positive or negative
+                Vector3f mf = mesh_.getVertex(thistri.getIndex(0));
+                mf -= cameras_[j].getPosition();
+                const float dp = mf.dot(n);
+                
+                if (dp < 0) {
+                    // Vertex projections to the image plane
+                    for (unsigned int v = 0; v < 3; v++) {
+                        uv_vtx[v] = vtx_st[thistri.getIndex(v)];
+                    }
 
+                    // test : true if all coordinates in [0,1]
+                    bool test = true;
+                    for (unsigned int v = 0; v < uv_vtx.size(); v++){
+                        const Vector2f& thisUV = uv_vtx[v];
+                        if ( thisUV(0) < 0 || cameras_[j].getImageWidth()  < thisUV(0) ||
+                             thisUV(1) < 0 || cameras_[j].getImageHeight() < thisUV(1) ){
+                            test = false;
+                        }
+                    }
 
+                    if (test) {
+                        const Vector2f& v0 = uv_vtx[0];
+                        const Vector2f& v1 = uv_vtx[1];
+                        const Vector2f& v2 = uv_vtx[2];
+                        float area = (v0(1)-v2(1)) * (v1(0)-v2(0)) - (v0(0)-v2(0)) * (v1(1)-v2(1)); // should be divided by 2, but it really does not matter
+    //                    cameras_[j].tri_ratings_[i] = area;
+                        camTriangles.push_back(i);
+                        camRatings.push_back(area);
+                    }
 
-    // Occlusions are evaluated in a kind of z-buffer whose size is determined
-    // by the average size of the input images. However, this buffer is goes beyond image-pixel
-    // resolution, as the optimal case would be to calculate occlusions in float WC. The buffer
-    // is placed only in the region that the mesh covers when projected to each image.
-    float fres = 0.0;
-    for (unsigned int c = 0; c < nCam_; c++){
-        fres += std::max(cameras_[c].getImageWidth(), cameras_[c].getImageHeight());
-    }
-    const unsigned int resolution = (unsigned int) floor(fres/(float)nCam_);
-
-    // Vector containing the projection to the image plane for each vertex
-    std::vector<Vector2f> vtx_st (nVtx_);
-    // Vector containing the area of the triangle projected to the image plane
-    std::vector<float> triArea(nTri_);
-    // Vector containing a flag determining if the triangle has been discarded or not
-    std::vector<bool> validTri (nTri_);
-    // Vector containing each vertex mode:
-    //       DARK : Not seen
-    //       SHADOW : Not seen, covered by others
-    //       LIGHT : Seen
-    std::vector<VtxMode> vtxSeen (nVtx_);
+                } // else -> tri_ratings_ stays 0
+            }
+        }
+        _ratings.store(j, camTriangles, camRatings);
+        cacheProjections(j, _ratings, vtx_st, vtx_depth);
 
-    // Triangle buffer: how many triangles are in each position of the grid
-    std::vector<std::vector<unsigned int> > triBuffer (resolution * resolution);
+        std::cerr << "\r" << (float)(j+1)/nCam_*100 << std::setw(4) << std::setprecision(4) << "%      "<< std::flush;
 
+    }
 
+    std::cerr << "\rdone!          " << std::endl;
 
-    // Vector containing the position of each vertex inside the triangle buffer
-    std::vector<Vector2i> vtxInBuffer(nVtx_);
+    reportCulling(ratedPairs);
+}
 
+void Multitexturer::evaluateAreaWithOcclusions(RatingMatrix& _ratings){
+
+    // Which triangles contain each vertex
+    const MeshTopology& topology = mesh_.getTopology();
+
+    // Occlusions are evaluated in a depth buffer placed over the region of each image
+    // that the mesh covers, with depthScale_ buffer pixels per image pixel. Depths are
+    // compared with a small relative tolerance
+    const float tolerance = 1e-4f;
+    size_t depthBytes = 0;
+    unsigned long long ratedPairs = 0, hiddenPairs = 0;
+    unsigned int nDone = 0;
+
+    // Each camera only reads the mesh and writes its own ratings, so cameras are split
+    // among threads. Every thread sizes its scratch once and reuses it for all its cameras
+    #pragma omp parallel reduction(+:ratedPairs, hiddenPairs, depthBytes)
+    {
+        DepthBuffer depthBuffer;
+        size_t threadBytes = 0;
+
+        // Vector containing the projection to the image plane for each vertex, and its depth.
+        // Only the ones in clusters that the camera may see are set
+        std::vector<Vector2f> vtx_st (nVtx_);
+        std::vector<float> vtx_depth (nVtx_);
+        // Vector containing the area of the triangle projected to the image plane
+        std::vector<float> triArea(nTri_);
+        // Vector containing a flag determining if the triangle has been discarded or not
+        std::vector<bool> validTri (nTri_);
+        // Vector containing each vertex mode:
+        //       DARK : Not seen
+        //       SHADOW : Not seen, covered by others
+        //       LIGHT : Seen
+        std::vector<VtxMode> vtxSeen (nVtx_);
+
+        // Clusters that the camera may see, and their vertices, listed once
+        std::vector<unsigned int> visible;
+        std::vector<unsigned int> activeVtx;
+        std::vector<unsigned int> vtxCamera (nVtx_, UINT_MAX);
+        // Bounding box of the projection of each of those clusters (min_s, min_t, max_s, max_t),
+        // their nearest depth (0 if any vertex is behind the camera) and the order they are drawn in
+        std::vector<float> clusterBox;
+        std::vector<float> clusterDepth;
+        std::vector<std::pair<float, unsigned int> > order;
+        // Clusters that are drawn, as some of them may be hidden, and their vertices
+        std::vector<unsigned int> drawn;
+        std::vector<unsigned int> drawnVtx;
+        std::vector<unsigned int> vtxDrawn (nVtx_, UINT_MAX);
+        // Seen vertices traced with rays (--raycast)
+        std::vector<unsigned int> rayVtx;
+        std::vector<Vector3f> rayPoints;
+        std::vector<char> rayVisible;
+        // Triangles rated by the current camera and their ratings
+        std::vector<unsigned int> camTriangles;
+        std::vector<float> camRatings;
+
+
+        // For each camera
+        #pragma omp for schedule(dynamic)
+        for (unsigned int c = 0; c < nCam_; c++) {
 
-    // For each camera
-    for (unsigned int c = 0; c < nCam_; c++) {
+            const unsigned int width = cameras_[c].getImageWidth();
+            const unsigned int height = cameras_[c].getImageHeight();
+
+            // Triangles in the rest of the clusters are outside the image or back-facing:
+            // they are not valid, and their vertices stay DARK unless other triangles show them
+            clusters_.findVisibleClusters(cameras_[c], visible);
+            std::fill(validTri.begin(), validTri.end(), false);
+            std::fill(vtxSeen.begin(), vtxSeen.end(), DARK);
+            activeVtx.clear();
+            clusterBox.resize(4 * visible.size());
+            clusterDepth.resize(visible.size());
+
+            for (unsigned int k = 0; k < visible.size(); k++){
+
+                // Every vertex of the cluster is projected onto the image plane and stored
+                clusters_.projectVertices(visible[k], cameras_[c], vtx_st, &vtx_depth);
+                const unsigned int* vertices = clusters_.getVertices(visible[k]);
+                float* box = &clusterBox[4 * k];
+                box[0] = box[1] = FLT_MAX;
+                box[2] = box[3] = -FLT_MAX;
+                clusterDepth[k] = FLT_MAX;
+                for (unsigned int i = 0; i < clusters_.getNVtx(visible[k]); i++){
+                    if (vtxCamera[vertices[i]] != c){
+                        vtxCamera[vertices[i]] = c;
+                        activeVtx.push_back(vertices[i]);
+                    }
+                    const Vector2f& st = vtx_st[vertices[i]];
+                    box[0] = std::min(box[0], st(0));
+                    box[1] = std::min(box[1], st(1));
+                    box[2] = std::max(box[2], st(0));
+                    box[3] = std::max(box[3], st(1));
+                    clusterDepth[k] = std::min(clusterDepth[k], std::max(vtx_depth[vertices[i]], 0.0f));
+                }
 
-        const unsigned int width = cameras_[c].getImageWidth();
-        const unsigned int height = cameras_[c].getImageHeight();
+                // The projected area is calculated and back-facing triangles are stored.
+                // Triangles crossing the plane of the camera are not valid either
+                const unsigned int* triangles = clusters_.getTriangles(visible[k]);
+                ratedPairs += clusters_.getNTri(visible[k]);
+                for (unsigned int t = 0; t < clusters_.getNTri(visible[k]); t++){
+                    const unsigned int j = triangles[t];
+                    const Vector3i& triInx = mesh_.getTriangle(j).getIndices();
+                    const Vector2f& v0 = vtx_st[triInx(0)];
+                    const Vector2f& v1 = vtx_st[triInx(1)];
+                    const Vector2f& v2 = vtx_st[triInx(2)];
+                    triArea[j] = (v0(1) - v2(1)) * (v1(0) - v2(0)) - (v0(0) - v2(0)) * (v1(1) - v2(1));
+                    validTri[j] = triArea[j] > 0 // It's back-facing
+                        && vtx_depth[triInx(0)] > 0 && vtx_depth[triInx(1)] > 0 && vtx_depth[triInx(2)] > 0;
+                }
+            }
 
- 
-        // Every vertex is projected onto the image plane and stored
-        for (unsigned int i = 0; i < nVtx_; i++){
-            const Vector2f proj_st = cameras_[c].transform2uvCoord(mesh_.getVertex(i));
-            vtx_st[i] = proj_st;
-        }
 
+            // If a vertex is surrounded by back-facing triangles then it's occluded
+            for (unsigned int k = 0; k < activeVtx.size(); k++){
+                const unsigned int i = activeVtx[k];
+                const unsigned int* vtxTris = topology.getVtxTriangles(i);
+                bool occluded = true;
+                for (unsigned int t = 0; t < topology.getNVtxTri(i); t++) {
+                    if (validTri[vtxTris[t]]){
+                        occluded = false;
+                        break;
+                    }
+                }
+                if (occluded){
+                    vtxSeen[i] = DARK;
+                } else {
+                    vtxSeen[i] = LIGHT;
+                }
+            }
 
-        // The projected area is calculated and back-facing triangles are stored
-        for (unsigned int j = 0; j < nTri_; j++){
-            const Vector3i& triInx = mesh_.getTriangle(j).getIndices();
-            const Vector2f& v0 = vtx_st[triInx(0)];
-            const Vector2f& v1 = vtx_st[triInx(1)];
-            const Vector2f& v2 = vtx_st[triInx(2)];
-            triArea[j] = (v0(1) - v2(1)) * (v1(0) - v2(0)) - (v0(0) - v2(0)) * (v1(1) - v2(1));
-            validTri[j] = triArea[j] > 0; // It's back-facing
-        }
+            // The depth buffer covers the seen vertices, inside the image
+            float min_s, max_s, min_t, max_t;
 
+            min_s = min_t = FLT_MAX;
+            max_s = max_t = -FLT_MAX;
 
-        // If a vertex is surrounded by back-facing triangles then it's occluded
-        for (unsigned int i = 0; i < nVtx_; i++){
-            bool occluded = true;
-            for (std::vector<int>::iterator it = vtx2tri[i].begin(); it!=vtx2tri[i].end(); ++it) {
-                if (validTri[*it]){
-                    occluded = false;
-                    break;
+            for (unsigned int k = 0; k < activeVtx.size(); k++) {
+                if (vtxSeen[activeVtx[k]] != LIGHT){
+                    continue;
                 }
+                const Vector2f& st = vtx_st[activeVtx[k]];
+                min_s = std::min(min_s, st(0));
+                max_s = std::max(max_s, st(0));
+                min_t = std::min(min_t, st(1));
+                max_t = std::max(max_t, st(1));
             }
-            if (occluded){
-                vtxSeen[i] = DARK;
-            } else {
-                vtxSeen[i] = LIGHT;
+            depthBuffer.setWindow(std::max(min_s, 0.0f), std::max(min_t, 0.0f), std::min(max_s, (float) width), std::min(max_t, (float) height), depthScale_);
+            threadBytes = std::max(threadBytes, depthBuffer.getBytes());
+
+            // The valid triangles are drawn cluster by cluster, from the nearest to the farthest, in
+            // batches that double their size. Before each batch, a depth pyramid of what has been
+            // drawn is built, and the clusters that are entirely behind it are skipped: none of their
+            // triangles would be seen, and they would not hide anything either
+            order.resize(visible.size());
+            for (unsigned int k = 0; k < visible.size(); k++){
+                order[k] = std::make_pair(clusterDepth[k], k);
             }
-        }
+            std::sort(order.begin(), order.end());
 
-        // Triangle buffer is cleared
-        for (unsigned int i = 0; i < resolution; i++){
-            for (unsigned int j = 0; j < resolution; j++){
-                triBuffer[i * resolution + j].clear();
-            }
-        }
+            Vector2f tri_st[3];
+            float tri_depth[3];
+            drawn.clear();
+            drawnVtx.clear();
+            for (size_t first = 0, batch = 64; first < order.size(); first += batch, batch *= 2){
 
-        // Triangle buffer positions are now set
+                if (first > 0){
+                    depthBuffer.buildPyramid();
+                }
 
-        // Minimum and maximum back-projected values
-        float min_s, max_s, min_t, max_t;
+                for (size_t o = first; o < std::min(first + batch, order.size()); o++){
+                    const unsigned int k = order[o].second;
+                    const unsigned int* triangles = clusters_.getTriangles(visible[k]);
+                    const float* box = &clusterBox[4 * k];
 
-        min_s = min_t = FLT_MAX;
-        max_s = max_t = -FLT_MAX;
+                    if (first > 0 && depthBuffer.isHidden(box[0], box[1], box[2], box[3], clusterDepth[k], tolerance)){
+                        hiddenPairs += clusters_.getNTri(visible[k]);
+                        for (unsigned int t = 0; t < clusters_.getNTri(visible[k]); t++){
+                            validTri[triangles[t]] = false;
+                        }
+                        continue;
+                    }
 
-        for (unsigned int i = 0; i < nVtx_; i++) {
-            const Vector2f& st = vtx_st[i];
-            if (st(0) < min_s) {
-                min_s = st(0);
-            } 
-            if (st(0) > max_s){
-                max_s = st(0);
-            } 
-            if (st(1) < min_t) {
-                min_t = st(1);
-            } 
-            if (st(1) > max_t) {
-                max_t = st(1);
-            }
-        }
+                    drawn.push_back(visible[k]);
+                    const unsigned int* vertices = clusters_.getVertices(visible[k]);
+                    for (unsigned int i = 0; i < clusters_.getNVtx(visible[k]); i++){
+                        if (vtxDrawn[vertices[i]] != c){
+                            vtxDrawn[vertices[i]] = c;
+                            drawnVtx.push_back(vertices[i]);
+                        }
+                    }
 
-        // Vertices positions inside the triangle buffer
-        for (unsigned int i = 0; i < nVtx_; i++) {
-            if (vtxSeen[i] == LIGHT) {
-                const Vector2f& nst = vtx_st[i];
-                const unsigned int v_s = findPosGrid(nst(0), min_s, max_s, resolution);
-                const unsigned int v_t = findPosGrid(nst(1), min_t, max_t, resolution);
-                vtxInBuffer[i] = Vector2i(v_s,v_t);
+                    for (unsigned int t = 0; t < clusters_.getNTri(visible[k]); t++){
+                        const unsigned int i = triangles[t];
+                        if (validTri[i]){
+                            const Vector3i& triIdx = mesh_.getTriangle(i).getIndices();
+                            for (unsigned int j = 0; j < 3; j++){
+                                tri_st[j] = vtx_st[triIdx(j)];
+                                tri_depth[j] = vtx_depth[triIdx(j)];
+                            }
+                            depthBuffer.drawTriangle(i, tri_st, tri_depth);
+                        }
+                    }
+                }
             }
-        }
-
-        // Now, we fill the triangle buffer
-        for (unsigned int i = 0; i < nTri_; i++){
-            if (validTri[i]){
-                const Vector3i& triIdx = mesh_.getTriangle(i).getIndices();
-                
-                unsigned int min_si, min_ti, max_si, max_ti;
-                min_si = min_ti = INT_MAX;
-                max_si = max_ti = 0;
 
-                for (unsigned int j = 0; j < 3; j++){
-                    const Vector2i& vst = vtxInBuffer[triIdx(j)];
-                    const unsigned int v_s = vst(0);
-                    const unsigned int v_t = vst(1);
-                    if (v_s < min_si){
-                        min_si = v_s;
-                    } 
-                    if (v_s > max_si){
-                        max_si = v_s;
+            // Only the vertices and triangles of the clusters drawn are checked from here on.
+            // The rest of the vertices only belong to hidden triangles
+
+            // With --raycast, a seen vertex is hidden if its ray towards the camera crosses the mesh
+            if (rayVisibility_){
+                rayVtx.clear();
+                rayPoints.clear();
+                for (unsigned int k = 0; k < drawnVtx.size(); k++) {
+                    if (vtxSeen[drawnVtx[k]] == LIGHT){
+                        rayVtx.push_back(drawnVtx[k]);
+                        rayPoints.push_back(mesh_.getVertex(drawnVtx[k]));
                     }
-                    if (v_t < min_ti){
-                        min_ti = v_t;
-                    } 
-                    if (v_t > max_ti){
-                        max_ti = v_t;
+                }
+                findVisiblePoints(c, rayPoints, rayVisible);
+                for (unsigned int k = 0; k < rayVtx.size(); k++){
+                    if (!rayVisible[k]){
+                        vtxSeen[rayVtx[k]] = SHADOW;
                     }
                 }
+            }
 
-                const Vector2f vt0 = vtxInBuffer[triIdx(0)].cast<float>();
-                const Vector2f vt1 = vtxInBuffer[triIdx(1)].cast<float>();
-                const Vector2f vt2 = vtxInBuffer[triIdx(2)].cast<float>();
-
-
-                for (unsigned int s = min_si; s <= max_si; s++) {
-                    for (unsigned int t = min_ti; t <= max_ti; t++){
-                        if (isPinsideTri (Vector2f((float)s,(float)t), vt0, vt1, vt2)){
-                            triBuffer[s * resolution + t].push_back(i);
+            // Otherwise, a vertex is hidden if it is behind the nearest triangle at its position,
+            // unless that triangle is one of its own
+            for (unsigned int k = 0; k < drawnVtx.size(); k++) {
+                const unsigned int i = drawnVtx[k];
+                if (vtxSeen[i] == LIGHT) {
+
+                    const Vector2f& st = vtx_st[i];
+                    const unsigned int nearest = rayVisibility_ ? DepthBuffer::NONE : depthBuffer.getTriangle(st);
+                    if (nearest != DepthBuffer::NONE){
+                        const Vector3i& triIdx = mesh_.getTriangle(nearest).getIndices();
+                        if (triIdx(0) != (int) i && triIdx(1) != (int) i && triIdx(2) != (int) i){
+                            for (unsigned int j = 0; j < 3; j++){
+                                tri_st[j] = vtx_st[triIdx(j)];
+                                tri_depth[j] = vtx_depth[triIdx(j)];
+                            }
+                            const float depth = DepthBuffer::interpolateDepth(st, tri_st, tri_depth);
+                            if (isPinsideTri(st, tri_st[0], tri_st[1], tri_st[2]) && vtx_depth[i] > depth * (1 + tolerance)){
+                                vtxSeen[i] = SHADOW;
+                            }
                         }
                     }
+                    if (st(0) < 0 || st(0) > width || st(1) < 0 || st(1) > height){
+                        vtxSeen[i] = SHADOW;
+                    }
+                }
+                // If a triangles has a vertex with SHADOW mode, its discarded
+                if (vtxSeen[i] == SHADOW){
+                    const unsigned int* vtxTris = topology.getVtxTriangles(i);
+                    for (unsigned int t = 0; t < topology.getNVtxTri(i); t++){
+                        validTri[vtxTris[t]] = false;
+                    }
                 }
-
             }
-        }
-
-        // Occlusions are computed in the grid of the triangle buffer
-        for (unsigned int i = 0; i < nVtx_; i++) {
-            if (vtxSeen[i] == LIGHT) {
 
-                const Vector2i& v_grid = vtxInBuffer[i];
-                const Vector2f& st = vtx_st[i];
-                
-                // candidates: triangles in same grid part, except for the ones incident to i
-                std::vector<unsigned int> candidates = triBuffer[v_grid(0) * resolution + v_grid(1)];
-                for (std::vector<unsigned int>::iterator it = candidates.begin(); it != candidates.end(); ++it) {
-                    const Vector3i& triIdx = mesh_.getTriangle(*it).getIndices();
-                    if (isPinsideTri(st, vtx_st[triIdx(0)], vtx_st[triIdx(1)], vtx_st[triIdx(2)])){
-                        // Check if triangle vertex is eclipsed
-                        if (isVertexEclipsed(i, *it, c)){
-                            vtxSeen[i] = SHADOW;
-                        } else {
-                            validTri[*it] = false;
+            // Triangles that are partly covered by nearer surfaces are discarded as well
+            for (unsigned int k = 0; k < drawn.size(); k++){
+                const unsigned int* triangles = clusters_.getTriangles(drawn[k]);
+                for (unsigned int t = 0; t < clusters_.getNTri(drawn[k]); t++){
+                    const unsigned int i = triangles[t];
+                    if (validTri[i]){
+                        const Vector3i& triIdx = mesh_.getTriangle(i).getIndices();
+                        for (unsigned int j = 0; j < 3; j++){
+                            tri_st[j] = vtx_st[triIdx(j)];
+                            tri_depth[j] = vtx_depth[triIdx(j)];
                         }
-
+                        validTri[i] = !depthBuffer.isOccluded(i, tri_st, tri_depth, tolerance);
                     }
                 }
-                if (st(0) < 0 || st(0) > width || st(1) < 0 || st(1) > height){
-                    vtxSeen[i] = SHADOW;
-                }
             }
-            // If a triangles has a vertex with SHADOW mode, its discarded
-            if (vtxSeen[i] == SHADOW){
-                for(std::vector<int>::iterator it = vtx2tri[i].begin(); it != vtx2tri[i].end(); ++it){
-                    validTri[*it] = false;
 
+
+            // Ratings of the triangles in the culled clusters stay 0
+            camTriangles.clear();
+            camRatings.clear();
+            for (unsigned int k = 0; k < visible.size(); k++){
+                const unsigned int* triangles = clusters_.getTriangles(visible[k]);
+                for (unsigned int t = 0; t < clusters_.getNTri(visible[k]); t++){
+                    const unsigned int i = triangles[t];
+                    if (validTri[i]){
+                        camTriangles.push_back(i);
+                        camRatings.push_back(triArea[i]);
+                    }
                 }
             }
-        }
+            _ratings.store(c, camTriangles, camRatings);
+            cacheProjections(c, _ratings, vtx_st, vtx_depth);
 
-
-        for (unsigned int i = 0; i < nTri_; i++){
-            _cam_tri_ratings[c][i] = validTri[i] ? triArea[i] : 0;
+            #pragma omp critical
+            {
+                nDone++;
+                std::cerr << "\r" << (float)nDone/nCam_*100 << std::setw(4) << std::setprecision(4) << "%      "<< std::flush;
+            }
         }
 
-        std::cerr << "\r" << (float)(c+1)/nCam_*100 << std::setw(4) << std::setprecision(4) << "%      "<< std::flush;
-        
+        // Every thread keeps its own buffer, so their sizes add up
+        depthBytes += threadBytes;
     }
 
+    reportCulling(ratedPairs);
+
+    const double remaining = ratedPairs > 0 ? (double) ratedPairs : 1.0;
+    std::cerr << "Depth pyramid culling skipped " << hiddenPairs / remaining * 100 << "% of the rest." << std::endl;
+    times_ << "Hidden camera-triangle pairs (% of the rest):" << std::endl;
+    times_ << hiddenPairs / remaining * 100 << std::endl;
+    std::cerr << "Depth buffer: " << depthBytes / (1024 * 1024) << " MB." << std::endl;
+
 }
 
 
-void Multitexturer::smoothRatings(std::vector<std::list<int> > &_tri2tri, std::vector<std::vector<float> >& _cam_tri_ratings){
+void Multitexturer::smoothRatings(RatingMatrix& _ratings){
 
+    const MeshTopology& topology = mesh_.getTopology();
 
-    #pragma omp parallel for
-    for (unsigned int c = 0; c < nCam_; c++) {
-        std::vector<float> tri_rat_filter(nTri_);
-        const std::vector<float>& tri_ratings = _cam_tri_ratings[c];
-        for (unsigned int i = 0; i < nTri_; i++) {
-            
-            if (tri_ratings[i] != 0) {
+
+    #pragma omp parallel
+    {
+        // Ratings of the current camera for every triangle, so the ones of the neighbors
+        // can be looked up. Only the rated triangles are set, and back to 0 afterwards
+        std::vector<float> tri_ratings (nTri_, 0.0);
+        std::vector<float> tri_rat_filter;
+
+        #pragma omp for schedule(dynamic)
+        for (unsigned int c = 0; c < nCam_; c++) {
+
+            // Triangles rated 0 stay at 0, so only the rated ones change
+            _ratings.scatter(c, tri_ratings);
+            const unsigned int* triangles = _ratings.getTriangles(c);
+            tri_rat_filter.resize(_ratings.getNRated(c));
+
+            for (size_t t = 0; t < _ratings.getNRated(c); t++) {
+                const unsigned int i = triangles[t];
 
                 // Current vertex included in neighbors
+                const unsigned int* ring = topology.getRing(i);
                 float sumneighbors = 0; 
-                for (std::list<int>::iterator it = _tri2tri[i].begin(); it != _tri2tri[i].end(); ++it){
-                    sumneighbors += tri_ratings[*it];
+                for (unsigned int k = 0; k < topology.getNRing(i); k++){
+                    sumneighbors += tri_ratings[ring[k]];
                 }
-                tri_rat_filter[i] = sumneighbors/_tri2tri[i].size();
-            } else {
-                tri_rat_filter[i] = 0;
+                tri_rat_filter[t] = sumneighbors/topology.getNRing(i);
             }
-        }
-
-        _cam_tri_ratings[c] = tri_rat_filter;
 
+            _ratings.clear(c, tri_ratings);
+            std::copy(tri_rat_filter.begin(), tri_rat_filter.end(), _ratings.getRatings(c));
+        }
     }
 
 }
 
-void Multitexturer::evaluateWeightNormal(std::vector<std::vector<float> >& _cam_tri_ratings){
-
-    const float invalpha = 1/alpha_;
-    const float invoneminusalpha = 1 / (1-alpha_);
-
-    // triangle normal
-    //Vector3f n(0.0,0.0,0.0);
-
-    #pragma omp parallel for
-    for (unsigned int i = 0; i < nTri_; i++) {
-        Vector3f mf, mmf;
-
-        // Find camera most orthogonal to this triangle
-        const Vector3f n = mesh_.getTriangleNormal(i); // Normalized normal
-        const Triangle& thistri = mesh_.getTriangle(i);
-
-        // We calculate the baricenter (centroid) of the triangle
-        // Vector3f mf = mesh_.getVertex(thistri.getIndex(0));
-        mf = mesh_.getVertex(thistri.getIndex(0));
-        mf += mesh_.getVertex(thistri.getIndex(1));
-        mf += mesh_.getVertex(thistri.getIndex(2));
-        mf /= 3;
-
+void Multitexturer::evaluateWeightNormal(RatingMatrix& _ratings, const NormalWeighting& _weighting){
 
-        for (unsigned int j = 0; j < nCam_; j++) {
-
-            // We check the position of the camera with respect to the triangle
-            // const Vector3f mmf = mf - cameras_[j].getPosition();
-            mmf = mf - cameras_[j].getPosition();
-            const Vector3f nf = mmf.normalized();
-            float dp = n.dot(nf);
-            dp *= -1;
-
-            if (dp <= 0){
-                _cam_tri_ratings[j][i] = 0;
-
-            } else if (dp < alpha_){
-                _cam_tri_ratings[j][i] *= 0.5 * pow(dp * invalpha, beta_);
-            } else {
-                _cam_tri_ratings[j][i]  *= 1 - 0.5 * pow( (1-dp) * invoneminusalpha, beta_);
-            }
-        }
+    // Triangles rated 0 stay at 0, so only the rated ones are weighted
+    #pragma omp parallel for schedule(dynamic)
+    for (unsigned int j = 0; j < nCam_; j++) {
+        _weighting.apply(cameras_[j].getPosition(), _ratings.getTriangles(j), _ratings.getNRated(j), _ratings.getRatings(j));
+        _ratings.compact(j);
     }
 }
 
-void Multitexturer::improveFaceRatings(std::vector<std::vector<float> >& _cam_tri_rating){
+void Multitexturer::improveFaceRatings(RatingMatrix& _ratings){
 
     if (fileFaceCam_.size() == 0){
         return;
@@ -1014,27 +1443,38 @@ void Multitexturer::improveFaceRatings(std::vector<std::vector<float> >& _cam_tr
     std::cerr << "\tface_min_y = " << face_min_y << std::endl;
     std::cerr << "\tface_max_y = " << face_max_y << std::endl;
 
-    std::vector<bool> vtx_face (nVtx_);
+    std::vector<bool> vtx_face (nVtx_, false);
+
+    // Only the triangles the camera rates can be boosted, and their vertices are in the projection cache
+    const unsigned int* triangles = _ratings.getTriangles(faceCam);
+    float* ratings = _ratings.getRatings(faceCam);
+    std::vector<unsigned int> vertices;
+    for (size_t t = 0; t < _ratings.getNRated(faceCam); t++) {
+        const Triangle& thistri = mesh_.getTriangle(triangles[t]);
+        vertices.push_back(thistri.getIndex(0));
+        vertices.push_back(thistri.getIndex(1));
+        vertices.push_back(thistri.getIndex(2));
+    }
+    std::vector<Vector2f> vtx_st;
+    projectVertices(faceCam, vertices, vtx_st);
 
     // We search for vertices lying inside the face area in the image
-    for (unsigned int i = 0; i < nVtx_; i++) {
-        const Vector2f v = cameras_[faceCam].transform2uvCoord(mesh_.getVertex(i));
+    for (unsigned int i = 0; i < vertices.size(); i++) {
+        const Vector2f& v = vtx_st[i];
         const float face_x = v(0);
         const float face_y = v(1);
         if ( (face_min_x < face_x) && (face_x < face_max_x) && (face_min_y < face_y) && (face_y < face_max_y) ) {
-            vtx_face[i] = true;
-        } else {
-            vtx_face[i] = false;
+            vtx_face[vertices[i]] = true;
         }
     }
 
     // If any of the vertices of a triangle is considered "face vertex"
     // the rating of the triangle is multipied by 4
-    for (unsigned int t = 0; t < nTri_; t++) {
-        const Triangle& thistri = mesh_.getTriangle(t);
+    for (size_t t = 0; t < _ratings.getNRated(faceCam); t++) {
+        const Triangle& thistri = mesh_.getTriangle(triangles[t]);
         if ( (vtx_face[thistri.getIndex(0)]) || (vtx_face[thistri.getIndex(1)]) || (vtx_face[thistri.getIndex(2)]) ){
             //cameras_[faceCam].tri_ratings_[t] *= 4;
-            _cam_tri_rating[faceCam][t] *= 4;
+            ratings[t] *= 4;
         }
     }
 
@@ -1049,6 +1489,19 @@ unsigned int Multitexturer::findPosGrid (float _x, float _min, float _max, unsig
     return d;
 }
 
+void Multitexturer::texelBox (const Vector2f& _a, const Vector2f& _b, const Vector2f& _c, unsigned int& _xmin, unsigned int& _xmax, unsigned int& _ymin, unsigned int& _ymax) const {
+
+    const float xmax = std::max(std::max(_a(0), _b(0)), _c(0));
+    const float xmin = std::min(std::min(_a(0), _b(0)), _c(0));
+    const float ymax = std::max(std::max(_a(1), _b(1)), _c(1));
+    const float ymin = std::min(std::min(_a(1), _b(1)), _c(1));
+
+    _xmax = findPosGrid(xmax, 0, realWidth_, imWidth_);
+    _xmin = findPosGrid(xmin, 0, realHeight_, imHeight_);
+    _ymax = findPosGrid(ymax, 0, realWidth_, imWidth_);
+    _ymin = findPosGrid(ymin, 0, realHeight_, imHeight_);
+}
+
 bool Multitexturer::isVertexEclipsed (int _v, int _t, int _c) const {
 
     const Vector3f& va = mesh_.getVertex(mesh_.getTriangle(_t).getIndex(0));
@@ -1105,6 +1558,34 @@ bool Multitexturer::isVertexEclipsed (const Vector3f& _v, int _t, int _c) const
     return ((dpnacam > 0 && dpnav < 0) || (dpnacam < 0 && dpnav > 0));
 }
 
+void Multitexturer::findVisiblePoints(int _c, const std::vector<Vector3f>& _points, std::vector<char>& _visible) const {
+
+    bvh_.findOccluded(cameras_[_c].getPosition(), _points, _visible);
+    for (size_t i = 0; i < _visible.size(); i++){
+        _visible[i] = !_visible[i];
+    }
+}
+
+void Multitexturer::dropHiddenVertices(int _c, std::vector<unsigned int>& _vertices){
+
+    std::vector<Vector3f> points (_vertices.size());
+    for (unsigned int k = 0; k < _vertices.size(); k++){
+        points[k] = mesh_.getVertex(_vertices[k]);
+    }
+    std::vector<char> visible;
+    findVisiblePoints(_c, points, visible);
+
+    unsigned int kept = 0;
+    for (unsigned int k = 0; k < _vertices.size(); k++){
+        if (visible[k]){
+            _vertices[kept++] = _vertices[k];
+        } else {
+            cameras_[_c].vtx_ratings_[_vertices[k]] = 0;
+        }
+    }
+    _vertices.resize(kept);
+}
+
 bool Multitexturer::lineTriangleIntersection(const Vector3f &_a, const Vector3f &_b, const Vector3f &_v0, const Vector3f &_v1, const Vector3f &_v2, Vector3f& _intersection) const{
 
     const Vector3f p1p0 = _v1 - _v0;
@@ -1140,67 +1621,332 @@ bool Multitexturer::lineTriangleIntersection(const Vector3f &_a, const Vector3f
 }
 
 
-bool Multitexturer::isPinsideTri (const Vector2f& _p, const Vector2f& _a, const Vector2f& _b, const Vector2f& _c) const {
+bool Multitexturer::isPinsideTri (const Vector2f& _p, const Vector2f& _a, const Vector2f& _b, const Vector2f& _c) const {
+
+    const Vector2f uv = uvPtri(_p, _a, _b, _c);
+    const float u = uv(0);
+    const float v = uv(1);
+
+    return (u > 0) && (v > 0) && (u + v < 1);
+
+}
+
+Vector2f Multitexturer::uvPtri (const Vector2f& _p, const Vector2f& _a, const Vector2f& _b, const Vector2f& _c) const {
+
+    const Vector2f v0 = _c - _a;
+    const Vector2f v1 = _b - _a;
+    const Vector2f v2 = _p - _a;
+
+    const float invDenom = 1 / (v0(0) * v1(1) - v1(0) * v0(1));
+
+    const float u = invDenom * (v1(1) * v2(0) - v1(0) * v2(1));
+    const float v = invDenom * (v0(0) * v2(1) - v0(1) * v2(0));
+
+    return Vector2f(u,v);
+
+}
+
+Vector2f Multitexturer::lineIntersect(const Vector2f& _a, const Vector2f& _va, const Vector2f& _b, const Vector2f& _vb) const {
+    const float u = (_va(1) * (_b(0) -_a(0)) + _va(0) * (_a(1) - _b(1))) / (_va(0) * _vb(1) - _va(1) * _vb(0));
+    return _b + _vb * u;
+}
+
+
+
+
+int Multitexturer::findCameraInList(const std::string& _fileName) const{
+
+    for (unsigned int i = 0; i < nCam_; i++){
+        if (imageList_[i].compare(_fileName) == 0){
+            return i;
+        }
+    }
+    std::cerr << "There is no image file " << _fileName << " in the image list." << std::endl;
+    return -1;
+
+}
+
+void Multitexturer::cacheProjections(unsigned int _c, const RatingMatrix& _ratings, const std::vector<Vector2f>& _vtx_st, const std::vector<float>& _vtx_depth){
+
+    // Ratings are only smoothed and weighted from here on, so triangles rated 0 stay at 0
+    // and their vertices are only needed if they also belong to rated triangles
+    const unsigned int* triangles = _ratings.getTriangles(_c);
+    std::vector<unsigned int> vertices;
+    vertices.reserve(3 * _ratings.getNRated(_c));
+    for (size_t t = 0; t < _ratings.getNRated(_c); t++){
+        const Triangle& tri = mesh_.getTriangle(triangles[t]);
+        vertices.push_back(tri.getIndex(0));
+        vertices.push_back(tri.getIndex(1));
+        vertices.push_back(tri.getIndex(2));
+    }
+    std::sort(vertices.begin(), vertices.end());
+    vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+
+    std::vector<float> uv (2 * vertices.size()), depth (vertices.size());
+    for (unsigned int i = 0; i < vertices.size(); i++){
+        uv[2 * i]     = _vtx_st[vertices[i]](0);
+        uv[2 * i + 1] = _vtx_st[vertices[i]](1);
+        depth[i] = _vtx_depth[vertices[i]];
+    }
+    projections_.store(_c, vertices, uv.data(), depth.data());
+}
+
+void Multitexturer::cacheRatedProjections(const RatingMatrix& _ratings){
+
+    #pragma omp parallel
+    {
+        std::vector<Vector2f> vtx_st (nVtx_);
+        std::vector<float> vtx_depth (nVtx_);
+        std::vector<unsigned int> visible;
+
+        // Triangles are only rated in the clusters each camera may see
+        #pragma omp for schedule(dynamic)
+        for (unsigned int c = 0; c < nCam_; c++){
+            clusters_.findVisibleClusters(cameras_[c], visible);
+            for (unsigned int k = 0; k < visible.size(); k++){
+                clusters_.projectVertices(visible[k], cameras_[c], vtx_st, &vtx_depth);
+            }
+            cacheProjections(c, _ratings, vtx_st, vtx_depth);
+        }
+    }
+}
+
+void Multitexturer::projectVertices(int _c, const std::vector<unsigned int>& _vertices, std::vector<Vector2f>& _st) const {
+
+    _st.resize(_vertices.size());
+
+    std::vector<Vector3f> missing;
+    std::vector<unsigned int> missing_index;
+    for (unsigned int i = 0; i < _vertices.size(); i++){
+        float depth;
+        if (!projections_.find(_c, _vertices[i], _st[i], depth)){
+            missing.push_back(mesh_.getVertex(_vertices[i]));
+            missing_index.push_back(i);
+        }
+    }
+
+    if (!missing.empty()){
+        std::vector<Vector2f> missing_st;
+        cameras_[_c].projectBatch(missing, missing_st);
+        for (unsigned int i = 0; i < missing_index.size(); i++){
+            _st[missing_index[i]] = missing_st[i];
+        }
+    }
+}
+
+bool Multitexturer::triangleProjection(int _c, int _v0, int _v1, int _v2, float* _hom) const {
+
+    if (cameras_[_c].getModel() != PINHOLE){
+        return false;
+    }
+
+    const int vertices[3] = {_v0, _v1, _v2};
+    for (unsigned int j = 0; j < 3; j++){
+        Vector2f uv;
+        float depth;
+        // Without distortion, the depth is the homogeneous coordinate w
+        if (!projections_.find(_c, vertices[j], uv, depth) || !(depth > 0.0f)){
+            return false;
+        }
+        _hom[3 * j]     = uv(0) * depth;
+        _hom[3 * j + 1] = uv(1) * depth;
+        _hom[3 * j + 2] = depth;
+    }
+    return true;
+}
+
+void Multitexturer::reportCulling(unsigned long long _ratedPairs){
+
+    const double pairs = (double) nCam_ * nTri_;
+    if (pairs == 0){
+        return;
+    }
+    std::cerr << "\nCluster culling skipped " << (1.0 - _ratedPairs / pairs) * 100 << "% of the camera-triangle pairs (";
+    std::cerr << clusters_.getNClusters() << " clusters)." << std::endl;
+    times_ << "Culled camera-triangle pairs (%):" << std::endl;
+    times_ << (1.0 - _ratedPairs / pairs) * 100 << std::endl;
+}
 
-    const Vector2f uv = uvPtri(_p, _a, _b, _c);
-    const float u = uv(0);
-    const float v = uv(1);
+void Multitexturer::reportCacheUsage(){
 
-    return (u > 0) && (v > 0) && (u + v < 1);
+    std::cerr << "Image cache: " << imageCache_.getHits() << " hits, ";
+    std::cerr << imageCache_.getMisses() << " misses, ";
+    std::cerr << imageCache_.getEvictions() << " evictions, ";
+    std::cerr << imageCache_.getPrefetches() << " prefetched, ";
+    std::cerr << imageCache_.getUsedBytes() / (1024 * 1024) << "/" << imageCacheSize_ << " MB in use." << std::endl;
 
+    times_ << "Image cache (hits/misses/evictions/prefetches):" << std::endl;
+    times_ << imageCache_.getHits() << " " << imageCache_.getMisses() << " " << imageCache_.getEvictions() << " " << imageCache_.getPrefetches() << std::endl;
 }
 
-Vector2f Multitexturer::uvPtri (const Vector2f& _p, const Vector2f& _a, const Vector2f& _b, const Vector2f& _c) const {
-
-    const Vector2f v0 = _c - _a;
-    const Vector2f v1 = _b - _a;
-    const Vector2f v2 = _p - _a;
+void Multitexturer::setImageRegions(){
 
-    const float invDenom = 1 / (v0(0) * v1(1) - v1(0) * v0(1));
+    unsigned long long usedPixels = 0, totalPixels = 0;
 
-    const float u = invDenom * (v1(1) * v2(0) - v1(0) * v2(1));
-    const float v = invDenom * (v0(0) * v2(1) - v0(1) * v2(0));
+    // Atlas texels are sampled at their center anywhere in the box of their triangle, even
+    // outside of it, so the 3D points of a triangle lie in the parallelogram of its plane
+    // that the corners of the box map to
+    std::vector<Vector3f> tri_region;
+    if (m_mode_ == TEXTURE){
+        tri_region.resize(4 * nTri_);
+        for (unsigned int t = 0; t < nTri_; t++){
+            const Triangle& tri = mesh_.getTriangle(t);
+            for (unsigned int j = 0; j < 4; j++){
+                tri_region[4 * t + j] = mesh_.getVertex(tri.getIndex(std::min(j, 2u)));
+            }
+        }
+        const float maxwbyimwidth = realWidth_ / imWidth_;
+        for (unsigned int ch = 0; ch < charts_.size(); ch++){
+            const Mesh2D& chart = charts_[ch].m_;
+            for (unsigned int i = 0; i < chart.getNTri(); i++){
+                const Triangle& tpres = chart.getTriangle(i);
+                const Vector2f vt0 = chart.getVertex(tpres.getIndex(0));
+                const Vector2f vt1 = chart.getVertex(tpres.getIndex(1));
+                const Vector2f vt2 = chart.getVertex(tpres.getIndex(2));
+                const Vector3f vA = mesh_.getVertex(chart.getOrigVtx(tpres.getIndex(0)));
+                const Vector3f vAB = mesh_.getVertex(chart.getOrigVtx(tpres.getIndex(1))) - vA;
+                const Vector3f vAC = mesh_.getVertex(chart.getOrigVtx(tpres.getIndex(2))) - vA;
+
+                unsigned int xminp, xmaxp, yminp, ymaxp;
+                texelBox(vt0, vt1, vt2, xminp, xmaxp, yminp, ymaxp);
+                const unsigned int box_cols[4] = {xminp, xmaxp, xmaxp, xminp};
+                const unsigned int box_rows[4] = {yminp, yminp, ymaxp, ymaxp};
+                for (unsigned int j = 0; j < 4; j++){
+                    const Vector2f pixcenter ((float) (box_cols[j] + 0.5) * maxwbyimwidth, (float) (box_rows[j] + 0.5) * maxwbyimwidth);
+                    const Vector2f pix_uv = uvPtri(pixcenter, vt0, vt1, vt2);
+                    tri_region[4 * chart.getOrigTri(i) + j] = vAB * pix_uv(1) + vAC * pix_uv(0) + vA;
+                }
+            }
+        }
+    }
 
-    return Vector2f(u,v);
+    #pragma omp parallel for reduction(+:usedPixels,totalPixels)
+    for (unsigned int c = 0; c < nCam_; c++){
 
-}
+        const Camera& camera = cameras_[c];
+        const float height = (float) camera.getImageHeight();
+        const float width = (float) camera.getImageWidth();
+        if (camera.getImageWidth() == 0 || camera.getImageHeight() == 0){
+            continue;
+        }
 
-Vector2f Multitexturer::lineIntersect(const Vector2f& _a, const Vector2f& _va, const Vector2f& _b, const Vector2f& _vb) const {
-    const float u = (_va(1) * (_b(0) -_a(0)) + _va(0) * (_a(1) - _b(1))) / (_va(0) * _vb(1) - _va(1) * _vb(0));
-    return _b + _vb * u;
-}
+        float min_row = height, max_row = 0.0, min_col = width, max_col = 0.0;
+        unsigned int minLevel = UINT_MAX, maxLevel = 0;
 
+        // Triangles that will be sampled from this camera and their vertices
+        std::vector<unsigned int> triangles, vertices;
+        for (unsigned int t = 0; t < nTri_; t++){
+            const Triangle& tri = mesh_.getTriangle(t);
+            if (camera.vtx_ratings_[tri.getIndex(0)] == 0 && camera.vtx_ratings_[tri.getIndex(1)] == 0 && camera.vtx_ratings_[tri.getIndex(2)] == 0){
+                continue;
+            }
+            triangles.push_back(t);
+            for (unsigned int j = 0; j < 3; j++){
+                vertices.push_back(tri.getIndex(j));
+            }
+            if (m_mode_ == TEXTURE){
+                const Vector3f centroid = (mesh_.getVertex(tri.getIndex(0)) + mesh_.getVertex(tri.getIndex(1)) + mesh_.getVertex(tri.getIndex(2))) / 3;
+                const unsigned int level = mipLevel(c, centroid);
+                minLevel = std::min(minLevel, level);
+                maxLevel = std::max(maxLevel, level);
+            }
+        }
+        std::sort(vertices.begin(), vertices.end());
+        vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+        const bool seen = !vertices.empty();
+
+        std::vector<Vector2f> vtx_st;
+        projectVertices(c, vertices, vtx_st);
+        for (unsigned int i = 0; i < vertices.size(); i++){
+            const Vector2f& v_st = vtx_st[i];
+            min_row = std::min(min_row, height - v_st(1));
+            max_row = std::max(max_row, height - v_st(1));
+            min_col = std::min(min_col, v_st(0));
+            max_col = std::max(max_col, v_st(0));
+        }
 
+        // Points sampled from each triangle lie inside a polygon of its plane: the
+        // triangle itself, or the parallelogram its texel box maps to. Under radial
+        // distortion and through fisheye lenses the edges of the polygon project as
+        // curves that can bow out of the bounding box of its corners, so points along
+        // the edges are projected too
+        if (!tri_region.empty() || camera.getModel() != PINHOLE){
+            const unsigned int nCorners = tri_region.empty() ? 3 : 4;
+            const unsigned int nSamples = camera.getModel() != PINHOLE ? EDGE_SAMPLES : 1;
+            std::vector<Vector3f> corners (nCorners), points;
+            std::vector<Vector2f> points_st;
+            for (unsigned int i = 0; i < triangles.size(); i++){
+                const Triangle& tri = mesh_.getTriangle(triangles[i]);
+                for (unsigned int j = 0; j < nCorners; j++){
+                    corners[j] = tri_region.empty() ? mesh_.getVertex(tri.getIndex(j)) : tri_region[4 * triangles[i] + j];
+                }
+                for (unsigned int j = 0; j < nCorners; j++){
+                    const Vector3f& a = corners[j];
+                    const Vector3f& b = corners[(j + 1) % nCorners];
+                    for (unsigned int k = 0; k < nSamples; k++){
+                        points.push_back(a + (b - a) * ((float) k / nSamples));
+                    }
+                }
+                if (points.size() < EDGE_BATCH && i + 1 < triangles.size()){
+                    continue;
+                }
+                camera.projectBatch(points, points_st);
+                for (unsigned int k = 0; k < points_st.size(); k++){
+                    const Vector2f& p_st = points_st[k];
+                    min_row = std::min(min_row, height - p_st(1));
+                    max_row = std::max(max_row, height - p_st(1));
+                    min_col = std::min(min_col, p_st(0));
+                    max_col = std::max(max_col, p_st(0));
+                }
+                points.clear();
+            }
+        }
 
+        // The rest of the projections of this camera are never used again
+        projections_.keep(c, vertices);
 
-int Multitexturer::findCameraInList(const std::string& _fileName) const{
+        totalPixels += (unsigned long long) camera.getImageWidth() * camera.getImageHeight();
 
-    for (unsigned int i = 0; i < nCam_; i++){
-        if (imageList_[i].compare(_fileName) == 0){
-            return i;
+        if (!seen){
+            // This camera is never sampled
+            imageCache_.setRegion(imageList_[c], 0, 0, 0, 0);
+            continue;
         }
-    }
-    std::cerr << "There is no image file " << _fileName << " in the image list." << std::endl;
-    return -1;
-
-}
 
-void Multitexturer::loadImageToCache(const std::string& _fileName){
+        // Bilinear filtering needs one pixel around the samples, which is
+        // one pixel of the coarsest mip level used
+        const float margin = 2.0f * (1 << maxLevel);
+        const unsigned int row = (unsigned int) std::max(floor(min_row - margin), 0.0f);
+        const unsigned int col = (unsigned int) std::max(floor(min_col - margin), 0.0f);
+        const unsigned int last_row = (unsigned int) std::max(std::min(ceil(max_row + margin), height), 0.0f);
+        const unsigned int last_col = (unsigned int) std::max(std::min(ceil(max_col + margin), width), 0.0f);
+
+        if (last_row <= row || last_col <= col){
+            imageCache_.setRegion(imageList_[c], 0, 0, 0, 0);
+            continue;
+        }
 
+        imageCache_.setRegion(imageList_[c], row, col, last_row - row, last_col - col);
 
-    if (imageCache_.size() == imageCacheSize_){
-        // We clear as many images from the cache as num_cam_mix_/2
-        // but at a random location of the cache
-        const unsigned int index = rand() % (imageCacheSize_ - (unsigned int) (num_cam_mix_*0.5));
-        std::map<std::string, Image>::iterator it = imageCache_.begin();
-        std::map<std::string, Image>::iterator it_end = imageCache_.begin();
-        std::advance(it, index);
-        std::advance(it_end, index + (unsigned int)(num_cam_mix_*0.5));
-        imageCache_.erase(it,it_end);
+        // When every texel of this camera is sampled from a coarse mip level, the full
+        // resolution is never needed and the image can be decoded at a reduced scale.
+        // Vertex colors and the photoconsistency check sample the full resolution
+        if (m_mode_ == TEXTURE && !photoconsistency_ && minLevel != UINT_MAX){
+            imageCache_.setBaseLevel(imageList_[c], minLevel);
+        } else {
+            imageCache_.setBaseLevel(imageList_[c], 0);
+        }
+        usedPixels += (unsigned long long) (last_row - row) * (last_col - col);
     }
 
-    imageCache_[_fileName] = Image(_fileName);
+    if (totalPixels > 0){
+        std::cerr << "Image regions cover " << (float) usedPixels / totalPixels * 100 << "% of the pixels." << std::endl;
+        times_ << "Image regions (% of pixels):" << std::endl;
+        times_ << (float) usedPixels / totalPixels * 100 << std::endl;
+    }
 
+    std::cerr << "Projection cache: " << projections_.getNProjections() << " vertex projections, ";
+    std::cerr << projections_.getBytes() / (1024 * 1024) << " MB." << std::endl;
 }
 
 bool Multitexturer::findFaceInImage(float& _face_min_x, float& _face_max_x, float& _face_min_y, float& _face_max_y) const {
@@ -1621,6 +2367,8 @@ void Multitexturer::subdivideCharts(unsigned int _iterations){
     for (unsigned int iteration = 0; iteration < _iterations; iteration++){
 
         std::vector<Triangle> new3dtris;
+        // Triangle of the mesh each new one comes from
+        std::vector<unsigned int> parents;
 
         // This map keeps track of the vertices already added
         std::map<std::pair<int,int>, int> addedVtx;
@@ -1637,6 +2385,7 @@ void Multitexturer::subdivideCharts(unsigned int _iterations){
 
                 const Triangle t2d = mesh2d.getTriangle(i);
                 //const Triangle t3d = mesh_.getTriangle(mesh2d.getOrigTri(i));
+                parents.insert(parents.end(), 4, mesh2d.getOrigTri(i));
 
                 // We get the vertices of the triangle both in 2D and 3D
                 Vector2f v0,v1,v2;
@@ -1732,13 +2481,16 @@ void Multitexturer::subdivideCharts(unsigned int _iterations){
         }
 
         // We add the new 3D triangles to the mesh
-        mesh_.replaceTriangles(new3dtris);
+        mesh_.subdivideTriangles(new3dtris, parents);
         updateNumbers();
 
         std::cerr << "\r" << (float)(iteration+1)/_iterations*100 << std::setw(4) << std::setprecision(4) << "%               ";
 
     }
 
+    // Vertex projections computed before the subdivision refer to the old mesh
+    projections_.reset(nCam_, nVtx_);
+
     std::cerr << "\n";
 
 }
@@ -1748,95 +2500,380 @@ void Multitexturer::updateNumbers(){
     nVtx_ = mesh_.getNVtx();
 }
 
-void Multitexturer::checkPhotoconsistency(){
+unsigned int Multitexturer::mipLevel(int _c, const Vector3f& _point) const {
 
-    for (unsigned int i = 0; i < nVtx_; i++){
-        const Vector3f current = mesh_.getVertex(i);
+    const Camera& camera = cameras_[_c];
+    const Matrix3f& K = camera.getIntrinsicParam();
+    const float focal = std::max(fabs(K(0,0)), fabs(K(1,1)));
+    const float depth = fabs(camera.transform2CameraCoord(_point)(2));
 
-        // Cameras with a rating different than 0 are stored in this multimap
-        std::multimap<float, int> ratings;
-        for (unsigned int c = 0; c < nCam_; c++){
-            if (cameras_[c].vtx_ratings_[i] != 0){
-                ratings.insert(std::pair<float, int>(cameras_[c].vtx_ratings_[i], c));
-            }
+    // Size of an atlas texel in the image, measured in pixels
+    const float footprint = focal * (realWidth_ / imWidth_) / depth;
+    if (!(footprint >= 2.0f)){
+        return 0;
+    }
+
+    // Levels smaller than a pixel are never used
+    unsigned int level = (unsigned int) floor(log2(footprint));
+    while (level > 0 && (std::min(camera.getImageWidth(), camera.getImageHeight()) >> level) == 0){
+        level--;
+    }
+    return level;
+}
+
+void Multitexturer::sampleCamera(int _c, unsigned int _level, const std::vector<Vector2f>& _points_st, std::vector<float>& _rgb, std::vector<char>& _valid){
+
+    const size_t n = _points_st.size();
+    _rgb.assign(3 * n, 0.0f);
+    _valid.assign(n, 0);
+
+    if (n == 0){
+        return;
+    }
+
+    // cache stuff
+    const std::shared_ptr<const Image> image = imageCache_.get(imageList_[_c], _level);
+    const float height = (float) image->getHeight();
+    const float width = (float) image->getWidth();
+    // Projections are measured in full resolution pixels
+    const float fullHeight = (float) image->getFullHeight();
+    const float fullWidth = (float) image->getFullWidth();
+    const float scale = 1.0f / (float) (1 << _level);
+    // Images only keep the window the mesh projects into
+    const float rowOffset = (float) image->getRowOffset();
+    const float columnOffset = (float) image->getColumnOffset();
+    if (image->getWidth() == 0 || image->getHeight() == 0){
+        return;
+    }
+
+    std::vector<float> rows, cols;
+    std::vector<unsigned int> index;
+    rows.reserve(n);
+    cols.reserve(n);
+    index.reserve(n);
+
+    for (size_t i = 0; i < n; i++){
+        const Vector2f& v_st = _points_st[i];
+        // Projection coordinates
+        const float proj_s = v_st(0);
+        const float proj_t = v_st(1);
+
+        if (proj_s < 0.0 || proj_t < 0.0){ // This may happen and it's very wrong
+            continue;
+        }
+
+        // In case a rounding error gives us a pixel outside the image
+        float image_row = std::max(std::min((fullHeight - proj_t) * scale, fullHeight * scale), 0.0f) - rowOffset;
+        float image_col = std::max(std::min(proj_s * scale, fullWidth * scale), 0.0f) - columnOffset;
+
+        // Points inside the image but outside the window were not expected to be
+        // seen from this camera: clamping them would sample the wrong pixels
+        if (image_row < -1.0f || image_row > height + 1.0f || image_col < -1.0f || image_col > width + 1.0f){
+            continue;
         }
+        image_row = std::min (image_row, height);
+        image_col = std::min (image_col, width);
+        image_row = std::max (image_row, 0.0f);
+        image_col = std::max (image_col, 0.0f);
+
+        rows.push_back(image_row);
+        cols.push_back(image_col);
+        index.push_back(i);
+    }
+
+    std::vector<float> samples (3 * index.size());
+    image->interpolate(rows.data(), cols.data(), index.size(), samples.data(), BILINEAR);
+
+    for (size_t k = 0; k < index.size(); k++){
+        const size_t i = index[k];
+        _rgb[3 * i]     = samples[3 * k];
+        _rgb[3 * i + 1] = samples[3 * k + 1];
+        _rgb[3 * i + 2] = samples[3 * k + 2];
+        _valid[i] = 1;
+    }
+}
 
-        std::multimap<float, int>::iterator it= ratings.begin();
-        std::vector<Color> camColors;
-        Color c_ave(0.0,0.0,0.0);
-        for (; it != ratings.end(); ++it){
-            // std::cerr << "area/index: " << it->first << " " << it->second << std::endl;
-            int camera = it->second;
+void Multitexturer::blendBatch(const BlendBatch& _batch, std::vector<Color>& _colors){
 
-            // cache stuff
-            std::string imageName = imageList_[camera];
-            if (imageCache_.find(imageName) == imageCache_.end()){
-                loadImageToCache(imageName);
+    const size_t n = _batch.points.size();
+    const unsigned int nslots = num_cam_mix_;
+
+    // Slots are grouped by camera and mip level, so every image is sampled once per batch
+    std::map<std::pair<int, unsigned int>, std::vector<unsigned int> > cam_slots;
+    for (size_t s = 0; s < n * nslots; s++){
+        if (_batch.cameras[s] >= 0){
+            cam_slots[std::make_pair(_batch.cameras[s], (unsigned int) _batch.levels[s])].push_back(s);
+        }
+    }
+
+    std::vector<float> slot_rgb (3 * n * nslots, 0.0f);
+    std::vector<char> slot_valid (n * nslots, 0);
+    // With --raycast, slots whose camera does not see the point are dropped unless
+    // all of them are hidden, and the weights of the rest are scaled so they add up to the same
+    std::vector<char> slot_hidden (n * nslots, 0);
+
+    std::vector<Vector3f> points;
+    std::vector<unsigned int> points_slot;
+    std::vector<Vector2f> points_st, slots_st;
+    std::vector<float> rgb;
+    std::vector<char> valid, visible;
+    std::map<std::pair<int, unsigned int>, std::vector<unsigned int> >::const_iterator cit;
+    for (cit = cam_slots.begin(); cit != cam_slots.end(); ++cit){
+        const std::vector<unsigned int>& slots = cit->second;
+        // Only the points whose projection is not known yet are projected
+        slots_st.resize(slots.size());
+        points.clear();
+        points_slot.clear();
+        for (unsigned int k = 0; k < slots.size(); k++){
+            const unsigned int s = slots[k];
+            if (!_batch.projected.empty() && _batch.projected[s]){
+                slots_st[k] = _batch.projections[s];
+            } else {
+                points.push_back(_batch.points[s / nslots]);
+                points_slot.push_back(k);
+            }
+        }
+        if (!points.empty()){
+            cameras_[cit->first.first].projectBatch(points, points_st);
+            for (unsigned int k = 0; k < points_slot.size(); k++){
+                slots_st[points_slot[k]] = points_st[k];
+            }
+        }
+        sampleCamera(cit->first.first, cit->first.second, slots_st, rgb, valid);
+        for (unsigned int k = 0; k < slots.size(); k++){
+            const unsigned int s = slots[k];
+            slot_rgb[3 * s]     = rgb[3 * k];
+            slot_rgb[3 * s + 1] = rgb[3 * k + 1];
+            slot_rgb[3 * s + 2] = rgb[3 * k + 2];
+            slot_valid[s] = valid[k];
+        }
+        if (rayVisibility_){
+            points.resize(slots.size());
+            for (unsigned int k = 0; k < slots.size(); k++){
+                points[k] = _batch.points[slots[k] / nslots];
             }
+            findVisiblePoints(cit->first.first, points, visible);
+            for (unsigned int k = 0; k < slots.size(); k++){
+                slot_hidden[slots[k]] = !visible[k];
+            }
+        }
+    }
 
-            const Vector2f v_st = cameras_[camera].transform2uvCoord(current);
-            // Projection coordinates
-            const float proj_s = v_st(0);
-            const float proj_t = v_st(1);
+    // Samples are blended in the same order the cameras were ranked
+    _colors.assign(n, Color(0.0,0.0,0.0));
+    for (size_t i = 0; i < n; i++){
+        float weight = 0.0f, seenWeight = 0.0f;
+        for (unsigned int p = 0; p < nslots && _batch.cameras[i * nslots + p] >= 0; p++) {
+            weight += _batch.weights[i * nslots + p];
+            if (!slot_hidden[i * nslots + p]){
+                seenWeight += _batch.weights[i * nslots + p];
+            }
+        }
+        const bool dropHidden = seenWeight > 0.0f;
 
-            if (proj_s < 0.0 || proj_t < 0.0){ // This may happen and it's very wrong
+        Color col;
+        for (unsigned int p = 0; p < nslots; p++) {
+            const size_t s = i * nslots + p;
+            if (_batch.cameras[s] < 0){
+                break;
+            }
+            if (!slot_valid[s] || (dropHidden && slot_hidden[s])){
                 continue;
             }
+            const Color sample (slot_rgb[3 * s], slot_rgb[3 * s + 1], slot_rgb[3 * s + 2]);
+            if (p == 0) { // Difference : = vs. +=
+                col = sample * _batch.weights[s];
+            } else {
+                col += sample * _batch.weights[s];
+            }
+        }
+        if (dropHidden && seenWeight < weight){
+            col = col * (weight / seenWeight);
+        }
+        _colors[i] = col;
+    }
+}
 
-            float image_row = (float)imageCache_[imageName].getHeight() - proj_t;
-            float image_col = proj_s;
+void Multitexturer::buildImageSchedule(std::vector<ScheduledImage>& _schedule, std::vector<size_t>& _triPosition, unsigned int _window) const {
 
-            // In case a rounding error gives us a pixel outside the image
-            image_row = std::min (image_row, (float)imageCache_[imageName].getHeight());
-            image_col = std::min (image_col, (float)imageCache_[imageName].getWidth());
-            image_row = std::max (image_row, 0.0f);
-            image_col = std::max (image_col, 0.0f);
+    _schedule.clear();
+    _triPosition.clear();
 
-            Color col = imageCache_[imageName].interpolate(image_row, image_col, BILINEAR);
-            camColors.push_back(col);
-            c_ave += col;
-        }
+    // Schedule position (+1) where each camera and level was listed for the last time
+    std::map<std::pair<int, unsigned int>, size_t> listed;
+    std::vector<std::pair<float, int> > ranking;
+    const unsigned int nslots = num_cam_mix_;
 
-        c_ave = c_ave / (float)ratings.size(); // Average color
+    std::vector<Chart>::const_iterator unwit;
+    for (unwit = charts_.begin(); unwit != charts_.end(); ++unwit){
+        for (unsigned int i = 0; i < (*unwit).m_.getNTri(); i++){
 
+            _triPosition.push_back(_schedule.size());
+            const Triangle& tpres = (*unwit).m_.getTriangle(i);
+            const Vector3f centroid = (mesh_.getVertex((*unwit).m_.getOrigVtx(tpres.getIndex(0)))
+                                     + mesh_.getVertex((*unwit).m_.getOrigVtx(tpres.getIndex(1)))
+                                     + mesh_.getVertex((*unwit).m_.getOrigVtx(tpres.getIndex(2)))) / 3;
 
-        std::vector<Color> colDif; // color diference with respect to the average
-        std::vector<Color>::iterator cit;
-        for (cit = camColors.begin(); cit != camColors.end(); ++cit){
-            const Color cc = *cit;
-            colDif.push_back(cc - c_ave);
-        }        
+            for (unsigned int v = 0; v < 3; v++){
+                const int vtx = (*unwit).m_.getOrigVtx(tpres.getIndex(v));
 
-        float var_r, var_g, var_b; // variance
-        var_r = var_g = var_b = 0.0;
-        for (cit = camColors.begin(); cit != camColors.end(); ++cit){
-            var_r += (cit->getRed() - c_ave.getRed())     * (cit->getRed() - c_ave.getRed());
-            var_g += (cit->getGreen() - c_ave.getGreen()) * (cit->getGreen() - c_ave.getGreen());
-            var_b += (cit->getBlue() - c_ave.getBlue())   * (cit->getBlue() - c_ave.getBlue());
+                ranking.clear();
+                for (unsigned int c = 0; c < nCam_; c++){
+                    if (cameras_[c].vtx_ratings_[vtx] != 0){
+                        ranking.push_back(std::pair<float, int>(cameras_[c].vtx_ratings_[vtx], c));
+                    }
+                }
+                const unsigned int tomix = std::min((unsigned int) ranking.size(), nslots);
+                std::partial_sort(ranking.begin(), ranking.begin() + tomix, ranking.end(), std::greater<std::pair<float, int> >());
+
+                for (unsigned int p = 0; p < tomix; p++){
+                    const int c = ranking[p].second;
+                    const unsigned int level = mipLevel(c, centroid);
+                    size_t& last = listed[std::make_pair(c, level)];
+                    if (last == 0 || _schedule.size() - (last - 1) >= _window){
+                        _schedule.push_back(ScheduledImage(imageList_[c], level));
+                        last = _schedule.size();
+                    }
+                }
+            }
         }
+    }
+}
 
-        var_r = var_r / (float) camColors.size();
-        var_g = var_g / (float) camColors.size();
-        var_b = var_b / (float) camColors.size();
+void Multitexturer::paintBatch(const BlendBatch& _batch, const std::vector<unsigned int>& _rows, const std::vector<unsigned int>& _cols, Image& _image){
 
-        float dev_r, dev_g, dev_b; // Standard deviation
-        dev_r = sqrt(var_r);
-        dev_g = sqrt(var_g);
-        dev_b = sqrt(var_b);
+    std::vector<Color> colors;
+    blendBatch(_batch, colors);
 
-        it = ratings.begin();
-        std::vector<Color>::iterator dit = colDif.begin();
-        for (; dit != colDif.end(); ++dit, ++it){
-            Color cc = *dit;
-            if (fabs(cc.getRed()) > dev_r || fabs(cc.getGreen())> dev_g || fabs(cc.getBlue()) > dev_b){
-                const int camindex = it->second;
-                cameras_[camindex].vtx_ratings_[i] = 0;
+    // Texels are painted in the order they were added, as neighbouring
+    // triangles may write the same texel
+    for (unsigned int i = 0; i < colors.size(); i++){
+        // If no camera sees the triangle...
+        if (_batch.cameras[(size_t) i * num_cam_mix_] < 0){
+            if (highlightOcclusions_){
+                _image.setColor(Color(255,255,0), _rows[i], _cols[i]);
+            } else {
+                // This should do something else than painting them black...
+                // but currently it does not do anything else
+                _image.setColor(Color(0,0,0), _rows[i], _cols[i]);
+            }
+        } else {
+            // color is assigned to the pixel
+            _image.setColor(colors[i], _rows[i], _cols[i]);
+        }
+    }
+}
+
+void Multitexturer::checkPhotoconsistency(){
+
+    // Vertices are processed in blocks, so each camera is sampled
+    // once per block instead of once per vertex
+    const unsigned int block = SAMPLE_BATCH_SIZE;
+
+    std::vector<float> block_rgb;
+    std::vector<char> block_valid;
+    std::vector<Vector2f> points_st;
+    std::vector<unsigned int> points_vtx;
+    std::vector<float> rgb;
+    std::vector<char> valid;
+
+    for (unsigned int first = 0; first < nVtx_; first += block){
+
+        const unsigned int last = std::min(first + block, nVtx_);
+
+        // Colors of every vertex of the block as seen from each camera
+        block_rgb.assign(3 * (size_t) (last - first) * nCam_, 0.0f);
+        block_valid.assign((size_t) (last - first) * nCam_, 0);
+
+        for (unsigned int c = 0; c < nCam_; c++){
+            points_vtx.clear();
+            for (unsigned int i = first; i < last; i++){
+                if (cameras_[c].vtx_ratings_[i] != 0){
+                    points_vtx.push_back(i);
+                }
+            }
+            if (rayVisibility_){
+                dropHiddenVertices(c, points_vtx);
+            }
+            projectVertices(c, points_vtx, points_st);
+            sampleCamera(c, 0, points_st, rgb, valid);
+            for (unsigned int k = 0; k < points_vtx.size(); k++){
+                const size_t s = (size_t) (points_vtx[k] - first) * nCam_ + c;
+                block_rgb[3 * s]     = rgb[3 * k];
+                block_rgb[3 * s + 1] = rgb[3 * k + 1];
+                block_rgb[3 * s + 2] = rgb[3 * k + 2];
+                block_valid[s] = valid[k];
             }
         }
-        if (0 == (i+1) % 1024) { // Too much information will kill you
-            std::cerr << "\r" << (float)(i+1)/nVtx_*100 << std::setw(4) << std::setprecision(4) << "% photoconsistency check. ";
-            std::cerr << (float)imageCache_.size()/imageCacheSize_ * 100 << std::setw(4) << std::setprecision(4) << "% of cache usage (";
-            std::cerr << imageCache_.size() << "/" << imageCacheSize_ << ").      " << std::flush;
+
+        for (unsigned int i = first; i < last; i++){
+
+            // Cameras with a rating different than 0 are stored in this multimap
+            std::multimap<float, int> ratings;
+            for (unsigned int c = 0; c < nCam_; c++){
+                if (cameras_[c].vtx_ratings_[i] != 0){
+                    ratings.insert(std::pair<float, int>(cameras_[c].vtx_ratings_[i], c));
+                }
+            }
+
+            std::multimap<float, int>::iterator it= ratings.begin();
+            std::vector<Color> camColors;
+            Color c_ave(0.0,0.0,0.0);
+            for (; it != ratings.end(); ++it){
+                // std::cerr << "area/index: " << it->first << " " << it->second << std::endl;
+                int camera = it->second;
+
+                const size_t s = (size_t) (i - first) * nCam_ + camera;
+                if (!block_valid[s]){ // This may happen and it's very wrong
+                    continue;
+                }
+
+                Color col (block_rgb[3 * s], block_rgb[3 * s + 1], block_rgb[3 * s + 2]);
+                camColors.push_back(col);
+                c_ave += col;
+            }
+
+            c_ave = c_ave / (float)ratings.size(); // Average color
+
+
+            std::vector<Color> colDif; // color diference with respect to the average
+            std::vector<Color>::iterator cit;
+            for (cit = camColors.begin(); cit != camColors.end(); ++cit){
+                const Color cc = *cit;
+                colDif.push_back(cc - c_ave);
+            }        
+
+            float var_r, var_g, var_b; // variance
+            var_r = var_g = var_b = 0.0;
+            for (cit = camColors.begin(); cit != camColors.end(); ++cit){
+                var_r += (cit->getRed() - c_ave.getRed())     * (cit->getRed() - c_ave.getRed());
+                var_g += (cit->getGreen() - c_ave.getGreen()) * (cit->getGreen() - c_ave.getGreen());
+                var_b += (cit->getBlue() - c_ave.getBlue())   * (cit->getBlue() - c_ave.getBlue());
+            }
+
+            var_r = var_r / (float) camColors.size();
+            var_g = var_g / (float) camColors.size();
+            var_b = var_b / (float) camColors.size();
+
+            float dev_r, dev_g, dev_b; // Standard deviation
+            dev_r = sqrt(var_r);
+            dev_g = sqrt(var_g);
+            dev_b = sqrt(var_b);
+
+            it = ratings.begin();
+            std::vector<Color>::iterator dit = colDif.begin();
+            for (; dit != colDif.end(); ++dit, ++it){
+                Color cc = *dit;
+                if (fabs(cc.getRed()) > dev_r || fabs(cc.getGreen())> dev_g || fabs(cc.getBlue()) > dev_b){
+                    const int camindex = it->second;
+                    cameras_[camindex].vtx_ratings_[i] = 0;
+                }
+            }
+            if (0 == (i+1) % 1024) { // Too much information will kill you
+                std::cerr << "\r" << (float)(i+1)/nVtx_*100 << std::setw(4) << std::setprecision(4) << "% photoconsistency check. ";
+                std::cerr << (float)imageCache_.getUsedBytes()/imageCache_.getBudget() * 100 << std::setw(4) << std::setprecision(4) << "% of cache usage (";
+                std::cerr << imageCache_.getNImages() << " images).      " << std::flush;
+            }
         }
     }
     std::cerr << "\n";
@@ -1860,47 +2897,36 @@ void Multitexturer::checkPhotoconsistencyPerPhoto() {
     #pragma omp parallel for
     for (unsigned int c = 0; c < nCam_; c++){
 
-        std::string imageName = imageList_[c];
-        Image image(imageName);
-
+        // Images are taken from the cache, so they can be reused later on while coloring.
+        // All the vertices seen by the camera are sampled at once
+        std::vector<unsigned int> points_vtx;
         for (unsigned int i = 0; i < nVtx_; i++){
-            const Vector3f & current = mesh_.getVertex(i);
-
             if (cameras_[c].vtx_ratings_[i] > 0.0){
+                points_vtx.push_back(i);
+            }
+        }
 
-                // In this case, we save the Color information from this camera
-
-                const Vector2f v_st = cameras_[c].transform2uvCoord(current);
-                // Projection coordinates
-                const   float proj_s = v_st(0);
-                const float proj_t = v_st(1);
-
-                if (proj_s < 0.0 || proj_t < 0.0){ // This may happen and it's very wrong
-                    continue;
-                }
-
-                float image_row = (float) image.getHeight() - proj_t;
-                float image_col = proj_s;
-
-                // In case a rounding error gives us a pixel outside the image
-                image_row = std::min (image_row, (float) image.getHeight());
-                image_col = std::min (image_col, (float) image.getWidth());
-                image_row = std::max (image_row, 0.0f);
-                image_col = std::max (image_col, 0.0f);
+        if (rayVisibility_){
+            dropHiddenVertices(c, points_vtx);
+        }
 
-                Color col = image.interpolate(image_row, image_col, BILINEAR);
+        std::vector<Vector2f> points_st;
+        projectVertices(c, points_vtx, points_st);
 
-                colors_per_vtx[i][c] = col;
-                ratings_per_vtx[i][c] = cameras_[c].vtx_ratings_[i];
+        std::vector<float> rgb;
+        std::vector<char> valid;
+        sampleCamera(c, 0, points_st, rgb, valid);
 
-//                if (0 == (i+1) % 1024) { // Too much information will kill you
-//                    std::cerr << "\r" << "Image " << c+1 << "/" << nCam_ << ". Progress: ";
-//                    std::cerr << (float)(i+1)/nVtx_*100 << std::setw(4) << std::setprecision(4) << "%.       ";
-//                }
+        for (unsigned int k = 0; k < points_vtx.size(); k++){
+            if (!valid[k]){ // This may happen and it's very wrong
+                continue;
             }
-        }
-//        std::cerr << "\r" << "Image " << c+1 << "/" << nCam_ << ". Progress: 100%             ";
 
+            // In this case, we save the Color information from this camera
+            const unsigned int i = points_vtx[k];
+            colors_per_vtx[i][c] = Color(rgb[3 * k], rgb[3 * k + 1], rgb[3 * k + 2]);
+            ratings_per_vtx[i][c] = cameras_[c].vtx_ratings_[i];
+        }
     }
 
     #pragma omp parallel for
@@ -1987,93 +3013,80 @@ void Multitexturer::colorVertices(std::vector<Color>& _meshcolors){
 
     checkPhotoconsistency();
 
+    // Vertices are colored in batches: first the cameras of every vertex are ranked,
+    // then each image is sampled once for the whole batch
+    const unsigned int nslots = num_cam_mix_;
+    BlendBatch batch;
+    std::vector<Color> colors;
 
-    for (unsigned int i = 0; i < nVtx_; i++){
-
-        std::multimap<float, int> ratings_cam;
-        const Vector3f current = mesh_.getVertex(i);
-
-
-        // Best cameras are assigned
-        ratings_cam.clear();
-        for (unsigned int c = 0; c < nCam_; c++) {
-            if (cameras_[c].vtx_ratings_[i] != 0){
-                ratings_cam.insert(std::pair<float,int>(cameras_[c].vtx_ratings_[i],c));
-            }
-        }
-
-        // Number of cameras to mix is the minimun between:
-        // our input value and the number of cameras available for the current pixel
-        const unsigned int tomix = ratings_cam.size() < (unsigned int) num_cam_mix_ ? ratings_cam.size() : num_cam_mix_;
+    for (unsigned int first = 0; first < nVtx_; first += SAMPLE_BATCH_SIZE){
 
-        // Calculation of the weights
-        std::vector<int> cameras_order;
-        std::vector<float> weights_order;
-        if (tomix != 0) {
-            unsigned int p;
-            float sumratings = 0;
-            cameras_order.resize(tomix);
-            weights_order.resize(tomix);
+        const unsigned int last = std::min(first + SAMPLE_BATCH_SIZE, nVtx_);
 
-            // Naïve way of calculating weights... could be improved
-            std::multimap<float, int>::iterator it;
-            for (it = ratings_cam.end(), p = 0; p < tomix; ++p) {
-                it--;
-                sumratings += (*it).first;
-                cameras_order[p] = (*it).second;
-            }
-            for (it = ratings_cam.end(), p = 0; p < tomix; ++p) {
-                it--;
-                weights_order[p] = (*it).first/sumratings;
-            }
-        }
-
-        Color col;
-        for (unsigned int p = 0; p < tomix; p++) {
-            int camera = cameras_order[p];
-            float weight = weights_order[p];
+        batch.points.clear();
+        batch.cameras.assign((size_t) (last - first) * nslots, -1);
+        batch.weights.assign((size_t) (last - first) * nslots, 0.0f);
+        batch.levels.assign((size_t) (last - first) * nslots, 0);
+        batch.projections.resize((size_t) (last - first) * nslots);
+        batch.projected.assign((size_t) (last - first) * nslots, 0);
 
-            // cache stuff
-            std::string imageName = imageList_[camera];
-            if (imageCache_.find(imageName) == imageCache_.end()){
-                loadImageToCache(imageName);
-            }
+        for (unsigned int i = first; i < last; i++){
 
-            const Vector2f v_st = cameras_[camera].transform2uvCoord(current);
-            // Projection coordinates
-            const float proj_s = v_st(0);
-            const float proj_t = v_st(1);
+            std::multimap<float, int> ratings_cam;
+            batch.points.push_back(mesh_.getVertex(i));
 
-            if (proj_s < 0.0 || proj_t < 0.0){ // This may happen and it's very wrong
-                continue;
+            // Best cameras are assigned
+            for (unsigned int c = 0; c < nCam_; c++) {
+                if (cameras_[c].vtx_ratings_[i] != 0){
+                    ratings_cam.insert(std::pair<float,int>(cameras_[c].vtx_ratings_[i],c));
+                }
             }
 
-            float image_row = (float)imageCache_[imageName].getHeight() - proj_t;
-            float image_col = proj_s;
-
-            // In case a rounding error gives us a pixel outside the image
-            image_row = std::min (image_row, (float)imageCache_[imageName].getHeight());
-            image_col = std::min (image_col, (float)imageCache_[imageName].getWidth());
-            image_row = std::max (image_row, 0.0f);
-            image_col = std::max (image_col, 0.0f);
+            // Number of cameras to mix is the minimun between:
+            // our input value and the number of cameras available for the current pixel
+            const unsigned int tomix = ratings_cam.size() < nslots ? ratings_cam.size() : nslots;
+
+            // Calculation of the weights
+            if (tomix != 0) {
+                unsigned int p;
+                float sumratings = 0;
+                int* cameras_order = &batch.cameras[(size_t) (i - first) * nslots];
+                float* weights_order = &batch.weights[(size_t) (i - first) * nslots];
+
+                // Naïve way of calculating weights... could be improved
+                std::multimap<float, int>::iterator it;
+                for (it = ratings_cam.end(), p = 0; p < tomix; ++p) {
+                    it--;
+                    sumratings += (*it).first;
+                    cameras_order[p] = (*it).second;
+                }
+                for (it = ratings_cam.end(), p = 0; p < tomix; ++p) {
+                    it--;
+                    weights_order[p] = (*it).first/sumratings;
+                }
 
-            if (p == 0) { // Difference : = vs. +=
-                col = imageCache_[imageName].interpolate(image_row, image_col, BILINEAR) * weight;
-            } else {
-                col += imageCache_[imageName].interpolate(image_row, image_col, BILINEAR) * weight;   
+                // The rating stage already projected the vertex into these cameras
+                for (p = 0; p < tomix; ++p) {
+                    const size_t s = (size_t) (i - first) * nslots + p;
+                    float depth;
+                    batch.projected[s] = projections_.find(cameras_order[p], i, batch.projections[s], depth);
+                }
             }
         }
 
-        // color is assigned to the vertex
-        _meshcolors[i] = col;
+        // colors are assigned to the vertices
+        blendBatch(batch, colors);
+        std::copy(colors.begin(), colors.end(), _meshcolors.begin() + first);
 
-        std::cerr << "\r" << (float)(i+1)/nVtx_*100 << std::setw(4) << std::setprecision(4) << "% of vertices colored. ";
-        std::cerr << (float)imageCache_.size()/imageCacheSize_ * 100 << std::setw(4) << std::setprecision(4) << "% of cache usage (";
-        std::cerr << imageCache_.size() << "/" << imageCacheSize_ << ").      " << std::flush;
+        std::cerr << "\r" << (float)last/nVtx_*100 << std::setw(4) << std::setprecision(4) << "% of vertices colored. ";
+        std::cerr << (float)imageCache_.getUsedBytes()/imageCache_.getBudget() * 100 << std::setw(4) << std::setprecision(4) << "% of cache usage (";
+        std::cerr << imageCache_.getNImages() << " images).      " << std::flush;
     }
 
     std::cerr << "\n";
 
+    reportCacheUsage();
+
 }
 
 
@@ -2086,6 +3099,36 @@ Image Multitexturer::colorTextureAtlas(const ArrayXXi& _pix_triangle) {
     // pix_ratings: this vector contains a rating for each camera. It will be re-used for every pixel
     std::vector<float> pix_ratings (nCam_, 0.0);
 
+    // Texels are colored in batches, so each image is sampled once per batch
+    const unsigned int nslots = num_cam_mix_;
+    BlendBatch batch;
+    std::vector<unsigned int> batch_rows, batch_cols;
+    std::vector<int> tri_levels (nCam_, -1);
+    // Homogeneous projections of the triangle vertices in each camera, taken from the
+    // projection cache the first time they are needed (-1: not yet, 0: unavailable)
+    std::vector<float> tri_hom (9 * nCam_);
+    std::vector<char> tri_hom_state (nCam_, -1);
+
+    // Images are decoded in the background, ahead of the triangles that need them.
+    // The look-ahead is limited to what fits in half of the cache
+    size_t imageBytes = 1;
+    for (unsigned int c = 0; c < nCam_; c++){
+        imageBytes = std::max(imageBytes, (size_t) cameras_[c].getImageWidth() * cameras_[c].getImageHeight() * 3);
+    }
+    unsigned int lookahead = nCam_;
+    if (imageCache_.getBudget() != 0){
+        lookahead = std::min((size_t) nCam_, imageCache_.getBudget() / 2 / imageBytes);
+    }
+    lookahead = std::max(lookahead, 1u);
+
+    std::vector<ScheduledImage> schedule;
+    std::vector<size_t> tri_position;
+    ImagePrefetcher prefetcher (imageCache_, prefetchThreads_, lookahead);
+    if (prefetchThreads_ > 0){
+        buildImageSchedule(schedule, tri_position, lookahead);
+        prefetcher.setSchedule(schedule);
+    }
+
     // ratings_cam:
     std::multimap<float,int> ratings_cam;
 
@@ -2111,31 +3154,18 @@ Image Multitexturer::colorTextureAtlas(const ArrayXXi& _pix_triangle) {
             const Vector2f vt1 = (*unwit).m_.getVertex(tpres.getIndex(1));
             const Vector2f vt2 = (*unwit).m_.getVertex(tpres.getIndex(2));
 
-            float xmax, xmin, ymax, ymin;
-
-            // maximum x value
-            xmax = vt0(0) > vt1(0) ? vt0(0) : vt1(0);
-            xmax = xmax > vt2(0) ? xmax : vt2(0);
-            // minimum x value
-            xmin = vt0(0) < vt1(0) ? vt0(0) : vt1(0);
-            xmin = xmin < vt2(0) ? xmin : vt2(0);
-            // maximum y value
-            ymax = vt0(1) > vt1(1) ? vt0(1) : vt1(1);
-            ymax = ymax > vt2(1) ? ymax : vt2(1);
-            // minimum y value
-            ymin = vt0(1) < vt1(1) ? vt0(1) : vt1(1);
-            ymin = ymin < vt2(1) ? ymin : vt2(1);
-
-            unsigned int xmaxp = findPosGrid(xmax, 0, realWidth_, imWidth_);
-            unsigned int xminp = findPosGrid(xmin, 0, realHeight_, imHeight_);
-            unsigned int ymaxp = findPosGrid(ymax, 0, realWidth_, imWidth_);
-            unsigned int yminp = findPosGrid(ymin, 0, realHeight_, imHeight_);
-
+            unsigned int xminp, xmaxp, yminp, ymaxp;
+            texelBox(vt0, vt1, vt2, xminp, xmaxp, yminp, ymaxp);
 
             const int vt0_orig3D = (*unwit).m_.getOrigVtx(tpres.getIndex(0));
             const int vt1_orig3D = (*unwit).m_.getOrigVtx(tpres.getIndex(1));
             const int vt2_orig3D = (*unwit).m_.getOrigVtx(tpres.getIndex(2));
 
+            // Mip level of each camera for this triangle, computed the first time it is needed
+            const Vector3f centroid = (mesh_.getVertex(vt0_orig3D) + mesh_.getVertex(vt1_orig3D) + mesh_.getVertex(vt2_orig3D)) / 3;
+            std::fill(tri_levels.begin(), tri_levels.end(), -1);
+            std::fill(tri_hom_state.begin(), tri_hom_state.end(), -1);
+
             for (unsigned int colp = xminp; colp <= xmaxp; colp++){
                 for (unsigned int rowp = yminp; rowp <= ymaxp; rowp++){
                     if (colp == imWidth_ || rowp == imHeight_) continue;
@@ -2213,13 +3243,18 @@ Image Multitexturer::colorTextureAtlas(const ArrayXXi& _pix_triangle) {
 
 
                         // Calculation of the weights
-                        std::vector<int> cameras_order;
-                        std::vector<float> weights_order;
+                        batch_rows.push_back(rowp);
+                        batch_cols.push_back(colp);
+                        batch.cameras.resize(batch.cameras.size() + nslots, -1);
+                        batch.weights.resize(batch.weights.size() + nslots, 0.0f);
+                        batch.levels.resize(batch.levels.size() + nslots, 0);
+                        batch.projections.resize(batch.projections.size() + nslots);
+                        batch.projected.resize(batch.projected.size() + nslots, 0);
                         if (tomix != 0) {
                             unsigned int p;
                             float sumratings = 0;
-                            cameras_order.resize(tomix);
-                            weights_order.resize(tomix);
+                            int* cameras_order = &batch.cameras[batch.cameras.size() - nslots];
+                            float* weights_order = &batch.weights[batch.weights.size() - nslots];
 
                             // Naïve way of calculating weights... could be improved
                             std::multimap<float, int>::iterator it;
@@ -2232,6 +3267,13 @@ Image Multitexturer::colorTextureAtlas(const ArrayXXi& _pix_triangle) {
                                 it--;
                                 weights_order[p] = (*it).first/sumratings;
                             }
+                            unsigned char* levels_order = &batch.levels[batch.levels.size() - nslots];
+                            for (p = 0; p < tomix; ++p) {
+                                if (tri_levels[cameras_order[p]] < 0){
+                                    tri_levels[cameras_order[p]] = mipLevel(cameras_order[p], centroid);
+                                }
+                                levels_order[p] = tri_levels[cameras_order[p]];
+                            }
                         }
 
                         // Color Assignment:
@@ -2250,75 +3292,62 @@ Image Multitexturer::colorTextureAtlas(const ArrayXXi& _pix_triangle) {
 
                         // we use the 2D u,v, coodinates to assign the 3D pixcenter
                         const Vector3f pixcenter3D = vAB * pix_uv(1) + vAC * pix_uv(0) + vA; //
-                        // Colors
-                        Color col;
-
-                        // If no camera sees the triangle...
-                        if (tomix == 0){
-                            if (highlightOcclusions_){
-                                imout.setColor(Color(255,255,0),rowp,colp);
-                            } else {
-                                // This should do something else than painting them black...
-                                // but currently it does not do anything else
-                                imout.setColor(Color(0,0,0),rowp,colp);
-                            }
-                            continue;
-                        }
 
-                        for (unsigned int p = 0; p < tomix; p++) {
-                            int camera = cameras_order[p];
-                            float weight = weights_order[p];
-
-                            // cache stuff
-                            std::string imageName = imageList_[camera];
-                            if (imageCache_.find(imageName) == imageCache_.end()){
-                                loadImageToCache(imageName);
+                        // Projections are linear in homogeneous coordinates, so the texel projection
+                        // is interpolated from the cached vertex projections instead of recomputed
+                        const float b0 = 1 - pix_uv(1) - pix_uv(0), b1 = pix_uv(1), b2 = pix_uv(0);
+                        const size_t first_slot = batch.projected.size() - nslots;
+                        for (unsigned int p = 0; p < tomix; ++p) {
+                            const int c = batch.cameras[first_slot + p];
+                            if (tri_hom_state[c] < 0){
+                                tri_hom_state[c] = triangleProjection(c, vt0_orig3D, vt1_orig3D, vt2_orig3D, &tri_hom[9 * c]);
                             }
-
-                            // Vector3f v = pixcenter3D.CoordTransform(&cam[camera]);
-                            const Vector2f v_st = cameras_[camera].transform2uvCoord(pixcenter3D);
-                            // Projection coordinates
-                            const float proj_s = v_st(0);
-                            const float proj_t = v_st(1);
-
-                            if (proj_s < 0.0 || proj_t < 0.0){ // This may happen and it's very wrong
+                            if (!tri_hom_state[c]){
                                 continue;
                             }
-
-                            float image_row = (float)imageCache_[imageName].getHeight() - proj_t;
-                            float image_col = proj_s;
-                            
-                            // In case a rounding error gives us a pixel outside the image
-                            image_row = std::min (image_row, (float)imageCache_[imageName].getHeight());
-                            image_col = std::min (image_col, (float)imageCache_[imageName].getWidth());
-                            image_row = std::max (image_row, 0.0f);
-                            image_col = std::max (image_col, 0.0f);
-
-                            if (p == 0) { // Difference : = vs. +=
-                                col = imageCache_[imageName].interpolate(image_row, image_col, BILINEAR) * weight;
-                                //col = imageCache_[imageName].interpolate(image_row, image_col) * weight;
-                            } else {
-                                col += imageCache_[imageName].interpolate(image_row, image_col, BILINEAR) * weight;   
-                                //col += imageCache_[imageName].interpolate(image_row, image_col) * weight;   
-                            }
+                            const float* hom = &tri_hom[9 * c];
+                            const float w = b0 * hom[2] + b1 * hom[5] + b2 * hom[8];
+                            batch.projections[first_slot + p] = Vector2f((b0 * hom[0] + b1 * hom[3] + b2 * hom[6]) / w,
+                                                                         (b0 * hom[1] + b1 * hom[4] + b2 * hom[7]) / w);
+                            batch.projected[first_slot + p] = 1;
                         }
 
-                        // color is assigned to the pixel
-                        imout.setColor(col, rowp, colp);
+                        // The color is blended later on, together with the rest of the batch
+                        batch.points.push_back(pixcenter3D);
                     }
                 }
             }
 
+            if (batch.points.size() >= SAMPLE_BATCH_SIZE){
+                paintBatch(batch, batch_rows, batch_cols, imout);
+                if (prefetchThreads_ > 0){
+                    prefetcher.advance(trcnt < (int) tri_position.size() ? tri_position[trcnt] : schedule.size());
+                }
+                batch.points.clear();
+                batch.cameras.clear();
+                batch.weights.clear();
+                batch.levels.clear();
+                batch.projections.clear();
+                batch.projected.clear();
+                batch_rows.clear();
+                batch_cols.clear();
+            }
+
             if (0 == trcnt % 1024) {
                 std::cerr << "\r" << (float)trcnt/nTri_*100 << std::setw(4) << std::setprecision(4) << "% of triangles colored. ";
-                std::cerr << (float)imageCache_.size()/imageCacheSize_ * 100 << std::setw(4) << std::setprecision(4) << "% of cache usage (";
-                std::cerr << imageCache_.size() << "/" << imageCacheSize_ << ").      " << std::flush;
+                std::cerr << (float)imageCache_.getUsedBytes()/imageCache_.getBudget() * 100 << std::setw(4) << std::setprecision(4) << "% of cache usage (";
+                std::cerr << imageCache_.getNImages() << " images).      " << std::flush;
             }
         }
     }
 
+    paintBatch(batch, batch_rows, batch_cols, imout);
+    prefetcher.stop();
+
     std::cerr << "\n";
 
+    reportCacheUsage();
+
     return imout;
 
 }
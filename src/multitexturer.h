@@ -36,6 +36,16 @@
 
 #include "camera.h"
 #include "image.h"
+#include "imagecache.h"
+#include "imageprefetcher.h"
+#include "imageheaders.h"
+#include "depthbuffer.h"
+#include "meshbvh.h"
+#include "meshclusters.h"
+#include "projectioncache.h"
+#include "ratingmatrix.h"
+#include "normalweighting.h"
+#include "ratingstore.h"
 #include "unwrapper.h"
 #include "packer.h"
 
@@ -101,7 +111,12 @@ private:
     // Access camera data
     void loadCameraInfo();
     void readCameraFile();
-    void readBundlerFile(); // Only for the camera information
+    void readBundlerFile(const ImageHeaders& _headers); // Only for the camera information
+    // Every image must exist and have the dimensions of its camera
+    void checkImages(const ImageHeaders& _headers) const;
+    // Drops cameras that are near-duplicates of others (position and viewing direction
+    // within pruneAngle_) when the kept ones see everything they see at a similar resolution
+    void pruneCameras();
 
 
     // Geometry stuff
@@ -113,8 +128,15 @@ private:
     // Line: _a, _b
     // Triangle: _v0, _v1, v2
     bool lineTriangleIntersection(const Vector3f& _a, const Vector3f& _b, const Vector3f& _v0, const Vector3f& _v1, const Vector3f& _v2, Vector3f& _intersection) const;
+    // Whether each point is seen by camera _c: the segment from the camera to it crosses no
+    // triangle of the mesh. Exact, but it needs the hierarchy built with --raycast
+    void findVisiblePoints(int _c, const std::vector<Vector3f>& _points, std::vector<char>& _visible) const;
+    // Removes from _vertices the ones hidden from camera _c by the mesh, and clears their ratings
+    void dropHiddenVertices(int _c, std::vector<unsigned int>& _vertices);
     // Samples x with respect to the given resolution
     unsigned int findPosGrid (float _x, float _min, float _max, unsigned int _resolution) const;
+    // Box of atlas texels whose centers are colored from the triangle (_a, _b, _c)
+    void texelBox (const Vector2f& _a, const Vector2f& _b, const Vector2f& _c, unsigned int& _xmin, unsigned int& _xmax, unsigned int& _ymin, unsigned int& _ymax) const;
     // Checks if the point p is included in the triangle defined by vertices a, b and c
     bool isPinsideTri (const Vector2f& _p, const Vector2f& _a, const Vector2f& _b, const Vector2f& _c) const; 
     // This function returns a 2D Vector containing the u,v, image coordinates
@@ -122,40 +144,101 @@ private:
     Vector2f uvPtri (const Vector2f& _p, const Vector2f& _a, const Vector2f& _b, const Vector2f& _c) const;
     // Returns the intersecting point of two lines defined by point _a and vector _va and _b and _vb
     Vector2f lineIntersect(const Vector2f& _a, const Vector2f& _va, const Vector2f& _b, const Vector2f& _vb) const;
+
+    // Image sampling
+    //
+    // Points to be colored by blending up to num_cam_mix_ cameras. Each point
+    // has num_cam_mix_ slots with a camera index (-1 if unused), its weight
+    // and the mip level the camera image is sampled at. Slots may also carry the
+    // projection of the point into their camera, when it is already known
+    struct BlendBatch {
+        std::vector<Vector3f> points;
+        std::vector<int> cameras;
+        std::vector<float> weights;
+        std::vector<unsigned char> levels;
+        std::vector<Vector2f> projections;
+        std::vector<char> projected;
+    };
+    // Mip level of camera _c that matches the size of an atlas texel placed at
+    // _point: the texel footprint in the image is focal length * texel size / depth
+    unsigned int mipLevel(int _c, const Vector3f& _point) const;
+    // Samples mip level _level of the image of camera _c at the projections _points_st (uv
+    // coordinates) in one call. Colors are written as RGB triplets in _rgb. Points that project
+    // before the image origin or outside the window kept from the image are not
+    // sampled, and are marked as 0 in _valid
+    void sampleCamera(int _c, unsigned int _level, const std::vector<Vector2f>& _points_st, std::vector<float>& _rgb, std::vector<char>& _valid);
+    // Samples each camera once for the whole batch and blends the samples of
+    // every point in slot order. Points without cameras are colored black
+    void blendBatch(const BlendBatch& _batch, std::vector<Color>& _colors);
+    // Images needed by colorTextureAtlas, in the order it will use them. For every
+    // triangle (same order as in the charts) the cameras ranked in the top num_cam_mix_
+    // of any of its vertices are listed with their mip level, unless they were already listed less than
+    // _window entries before. _triPosition gets the schedule position of each triangle
+    void buildImageSchedule(std::vector<ScheduledImage>& _schedule, std::vector<size_t>& _triPosition, unsigned int _window) const;
+    // Blends a batch of texels and paints them in _image, at the given rows and columns
+    void paintBatch(const BlendBatch& _batch, const std::vector<unsigned int>& _rows, const std::vector<unsigned int>& _cols, Image& _image);
  
 
 
+    // Projections of the vertices
+    //
+    // Stores in projections_ the projections (_vtx_st, _vtx_depth) of camera _c for the vertices
+    // of the triangles that it rates in _ratings, which are the only ones used later on
+    void cacheProjections(unsigned int _c, const RatingMatrix& _ratings, const std::vector<Vector2f>& _vtx_st, const std::vector<float>& _vtx_depth);
+    // Projections of the listed vertices into camera _c, taken from projections_
+    // or computed for the ones that are not there
+    void projectVertices(int _c, const std::vector<unsigned int>& _vertices, std::vector<Vector2f>& _st) const;
+    // Homogeneous projections (u w, v w, w) of the vertices of a triangle into camera _c, taken
+    // from projections_. Points of the triangle project to the same combination of them as
+    // of the vertices, so they need no projection. Returns false if the camera is not a plain
+    // pinhole (projections are not linear) or a vertex is not in the cache
+    bool triangleProjection(int _c, int _v0, int _v1, int _v2, float* _hom) const;
+    // Fills projections_ for ratings that were not evaluated in this run, as they
+    // were taken from the rating store
+    void cacheRatedProjections(const RatingMatrix& _ratings);
+
+
+
     // Different ways to estimate camera weights:
-    // They all fill the vector tri_ratings_ of each camera
+    // They all fill the ratings of each camera in _ratings
     // 
     // Uses the normal of the triangle
-    void evaluateNormal(std::vector<std::vector<float> >& _cam_tri_ratings);
+    void evaluateNormal(RatingMatrix& _ratings);
     // Uses the projected area of the triangle
-    void evaluateArea(std::vector<std::vector<float> >& _cam_tri_ratings);
+    void evaluateArea(RatingMatrix& _ratings);
     // Uses the projected area taking into account occlusions
-    void evaluateAreaWithOcclusions(std::vector<std::vector<float> >& _cam_tri_ratings);
-    // Smooths the values estimated so transitions are seamless
-    void smoothRatings(std::vector<std::list<int> > & _tri2tri, std::vector<std::vector<float> >& _cam_tri_ratings);
+    void evaluateAreaWithOcclusions(RatingMatrix& _ratings);
+    // Smooths the values estimated so transitions are seamless, averaging the
+    // ratings of the triangles that share a vertex with each one
+    void smoothRatings(RatingMatrix& _ratings);
     // Weights the normals with respect to a function with
-    // curvature beta_ and cutoff value alpha_
-    void evaluateWeightNormal(std::vector<std::vector<float> >& _cam_tri_ratings);
+    // curvature beta_ and cutoff value alpha_, tabulated in _weighting. Triangles that
+    // end up rated 0 are dropped
+    void evaluateWeightNormal(RatingMatrix& _ratings, const NormalWeighting& _weighting);
     // Finds a face in an image and increases the camera ratings
     // for that camera in the corresponding facial triangles
-    void improveFaceRatings(std::vector<std::vector<float> >& _cam_tri_ratings);
+    void improveFaceRatings(RatingMatrix& _ratings);
 
 
     // Finds a camera in the list and returns its position
     // if the camera is not found, -1 is returned
     int findCameraInList(const std::string& _fileName) const;
 
-    // Loads the selected image to the cache
-    void loadImageToCache(const std::string& _fileName);
-
     // Finds a face in the determined image
     // Returns true if found or false if not
     // Stores the corners of the box where the face is contained
     bool findFaceInImage(float& _face_min_x, float& _face_max_x, float& _face_min_y, float& _face_max_y) const;
 
+    // Prints how many camera-triangle pairs were skipped by culling the clusters
+    void reportCulling(unsigned long long _ratedPairs);
+    // Prints the image cache statistics
+    void reportCacheUsage();
+    // Once the ratings are known, each image is restricted to the window where the texels
+    // of the triangles rated for its camera project, plus a margin for the filters and the
+    // mip levels used.
+    // Images are decoded straight at the lowest mip level their camera uses
+    void setImageRegions();
+
     // Chart coloring functions:
     // This functions calculates the output image size
     void calculateImageSize();
@@ -199,6 +282,13 @@ private:
     // Input 3D mesh
     Mesh3D mesh_;
     Mesh3D origMesh_;
+    // Clusters of triangles of mesh_, culled as a whole against each camera
+    MeshClusters clusters_;
+    // Hierarchy of the triangles of mesh_ for exact visibility queries (only with --raycast).
+    // Subdividing the triangles does not change the surface, so it is built once
+    MeshBVH bvh_;
+    // Projections of the vertices of mesh_ into the cameras that rate them
+    ProjectionCache projections_;
 
     unsigned int nVtx_, nTri_;
 
@@ -209,7 +299,7 @@ private:
 
     // Images are stored in a cache
     // so there are no memory issues
-    std::map<std::string, Image> imageCache_;
+    ImageCache imageCache_;
 
     // Group of 2D charts created by unwrapping the 3D mesh
     std::vector<Chart> charts_;
@@ -229,10 +319,14 @@ private:
     float alpha_; // 0.5
     float beta_; // 1.0
     unsigned int dimension_; // 10,000,000
-    unsigned int imageCacheSize_; // 75
+    unsigned int imageCacheSize_; // 4096 MB
+    unsigned int prefetchThreads_; // 2
     bool highlightOcclusions_; // false
     bool powerOfTwoImSize_; // false
     bool photoconsistency_; // true
+    float pruneAngle_; // 0: cameras are not pruned
+    float depthScale_; // 1.0 (depth buffer pixels per image pixel)
+    bool rayVisibility_; // false
 
     // File names
     std::string fileNameIn_;
@@ -241,6 +335,8 @@ private:
     std::string fileNameOut_;
     std::string fileNameTexOut_;
     std::string fileFaceCam_;
+    std::string imageStoreDir_; // Empty: no image store
+    std::string ratingStoreDir_; // Empty: no rating store
 
     // Out timing file
     std::ofstream times_;
@@ -0,0 +1,139 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "normalweighting.h"
+
+// The kernel needs SSE2, which every x86-64 target has; 32-bit builds get it with -msse2
+#if defined(__GNUC__) && defined(__SSE2__)
+#define NORMALWEIGHTING_SSE
+#include <immintrin.h>
+#endif
+
+const unsigned int NormalWeighting::TABLE_SIZE;
+
+NormalWeighting::NormalWeighting(){
+    alpha_ = 0.5;
+    beta_ = 1.0;
+    invalpha_ = invoneminusalpha_ = 2.0;
+    alphaInterval_ = TABLE_SIZE / 2;
+}
+
+NormalWeighting::~NormalWeighting(){
+}
+
+void NormalWeighting::build(const Mesh3D& _mesh, float _alpha, float _beta){
+
+    alpha_ = _alpha;
+    beta_ = _beta;
+    invalpha_ = 1/_alpha;
+    invoneminusalpha_ = 1 / (1-_alpha);
+    alphaInterval_ = (unsigned int) std::min(std::max(_alpha, 0.0f) * TABLE_SIZE, (float) TABLE_SIZE);
+
+    table_.resize(TABLE_SIZE + 2);
+    for (unsigned int k = 0; k <= TABLE_SIZE; k++){
+        table_[k] = evaluate((float) k / TABLE_SIZE);
+    }
+    table_[TABLE_SIZE + 1] = table_[TABLE_SIZE];
+
+    const unsigned int nTri = _mesh.getNTri();
+    std::vector<float> (6 * (size_t) nTri).swap(triangles_);
+
+    #pragma omp parallel for
+    for (unsigned int i = 0; i < nTri; i++){
+        const Triangle& tri = _mesh.getTriangle(i);
+        const Vector3f n = _mesh.getTriangleNormal(i);
+        Vector3f mf = _mesh.getVertex(tri.getIndex(0));
+        mf += _mesh.getVertex(tri.getIndex(1));
+        mf += _mesh.getVertex(tri.getIndex(2));
+        mf /= 3;
+        float* data = &triangles_[6 * (size_t) i];
+        for (unsigned int j = 0; j < 3; j++){
+            data[j] = n(j);
+            data[3 + j] = mf(j);
+        }
+    }
+}
+
+void NormalWeighting::apply(const Vector3f& _position, const unsigned int* _triangles, size_t _n, float* _ratings) const {
+
+    size_t i = 0;
+
+#ifdef NORMALWEIGHTING_SSE
+    const __m128 px = _mm_set1_ps(_position(0)), py = _mm_set1_ps(_position(1)), pz = _mm_set1_ps(_position(2));
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), size = _mm_set1_ps((float) TABLE_SIZE);
+
+    for (; i + 4 <= _n; i += 4){
+        const float* t0 = &triangles_[6 * (size_t) _triangles[i]];
+        const float* t1 = &triangles_[6 * (size_t) _triangles[i + 1]];
+        const float* t2 = &triangles_[6 * (size_t) _triangles[i + 2]];
+        const float* t3 = &triangles_[6 * (size_t) _triangles[i + 3]];
+
+        // Cosine between the normal and the direction from the centroid to the camera
+        const __m128 dx = _mm_sub_ps(_mm_setr_ps(t0[3], t1[3], t2[3], t3[3]), px);
+        const __m128 dy = _mm_sub_ps(_mm_setr_ps(t0[4], t1[4], t2[4], t3[4]), py);
+        const __m128 dz = _mm_sub_ps(_mm_setr_ps(t0[5], t1[5], t2[5], t3[5]), pz);
+        const __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_setr_ps(t0[0], t1[0], t2[0], t3[0]), dx),
+                                                 _mm_mul_ps(_mm_setr_ps(t0[1], t1[1], t2[1], t3[1]), dy)),
+                                                 _mm_mul_ps(_mm_setr_ps(t0[2], t1[2], t2[2], t3[2]), dz));
+        const __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+        const __m128 dp = _mm_div_ps(_mm_sub_ps(zero, dot), length);
+
+        // Interpolated from the table; NaNs (centroid at the camera) end up at 0 as well
+        const __m128 x = _mm_mul_ps(_mm_min_ps(_mm_max_ps(dp, zero), one), size);
+        const __m128i k = _mm_cvttps_epi32(x);
+        const __m128 frac = _mm_sub_ps(x, _mm_cvtepi32_ps(k));
+        alignas(16) int idx[4];
+        _mm_store_si128((__m128i*) idx, k);
+        const __m128 a = _mm_setr_ps(table_[idx[0]], table_[idx[1]], table_[idx[2]], table_[idx[3]]);
+        const __m128 b = _mm_setr_ps(table_[idx[0] + 1], table_[idx[1] + 1], table_[idx[2] + 1], table_[idx[3] + 1]);
+        __m128 w = _mm_and_ps(_mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), frac)), _mm_cmpgt_ps(dp, zero));
+
+        // Some triangles are weighted with the curve itself
+        if (isExact(idx[0]) || isExact(idx[1]) || isExact(idx[2]) || isExact(idx[3])){
+            alignas(16) float cosines[4], weights[4];
+            _mm_store_ps(cosines, dp);
+            for (unsigned int l = 0; l < 4; l++){
+                weights[l] = weight(cosines[l]);
+            }
+            w = _mm_load_ps(weights);
+        }
+
+        _mm_storeu_ps(_ratings + i, _mm_mul_ps(_mm_loadu_ps(_ratings + i), w));
+    }
+#endif
+
+    for (; i < _n; i++){
+        const float* t = &triangles_[6 * (size_t) _triangles[i]];
+        const float dx = t[3] - _position(0);
+        const float dy = t[4] - _position(1);
+        const float dz = t[5] - _position(2);
+        const float dot = t[0] * dx + t[1] * dy + t[2] * dz;
+        const float length = std::sqrt(dx * dx + dy * dy + dz * dz);
+        _ratings[i] *= weight((0.0f - dot) / length);
+    }
+}
+
+size_t NormalWeighting::getBytes() const {
+    return (table_.capacity() + triangles_.capacity()) * sizeof(float);
+}
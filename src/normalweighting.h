@@ -0,0 +1,101 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef NORMALWEIGHTING_H
+#define NORMALWEIGHTING_H
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+#include <cmath>
+
+#include "mesh3d.h"
+
+// Weighting of the camera-triangle ratings by the angle between the normal of each
+// triangle and the direction it is seen from: a curve of curvature beta that is 1/2 at
+// the cutoff cosine alpha, and 0 for triangles that face away. The weight only depends
+// on that cosine, so the curve is tabulated once and interpolated, and the normal and
+// centroid of every triangle are kept, so weighting the ratings again costs no pow()
+// and no mesh lookups. The curve is only evaluated in the first and last intervals,
+// where it is too steep to interpolate when beta < 1, and in the one holding alpha,
+// where its two halves meet. Triangles are weighted four at a time with SSE on x86.
+class NormalWeighting {
+
+public:
+
+    NormalWeighting();
+    virtual ~NormalWeighting();
+
+    // Tabulates the curve for _alpha and _beta, and keeps the normals and centroids of
+    // the triangles of _mesh. It has to be called again whenever the mesh changes
+    void build(const Mesh3D& _mesh, float _alpha, float _beta);
+
+    // Weight for cosine _dp
+    inline float weight(float _dp) const {
+        if (!(_dp > 0.0f)){
+            return 0.0f;
+        }
+        const float x = std::min(_dp, 1.0f) * TABLE_SIZE;
+        const unsigned int k = (unsigned int) x;
+        if (isExact(k)){
+            return evaluate(_dp);
+        }
+        return table_[k] + (table_[k + 1] - table_[k]) * (x - k);
+    }
+
+    // Multiplies the ratings of the _n listed triangles, as seen from _position, by their weight
+    void apply(const Vector3f& _position, const unsigned int* _triangles, size_t _n, float* _ratings) const;
+
+    size_t getBytes() const;
+
+private:
+
+    // Intervals where the table is not used
+    inline bool isExact(unsigned int _k) const {
+        return _k == 0 || _k >= TABLE_SIZE - 1 || _k == alphaInterval_;
+    }
+
+    // The curve itself
+    inline float evaluate(float _dp) const {
+        if (_dp < alpha_){
+            return 0.5 * pow(_dp * invalpha_, beta_);
+        } else {
+            return 1 - 0.5 * pow( (1-_dp) * invoneminusalpha_, beta_);
+        }
+    }
+
+    // Intervals the cosine range [0, 1] is split in
+    static const unsigned int TABLE_SIZE = 4096;
+
+    float alpha_, beta_, invalpha_, invoneminusalpha_;
+    unsigned int alphaInterval_;
+
+    // Weight at the ends of every interval, plus one more so the last end can be interpolated too
+    std::vector<float> table_;
+    // Normal and centroid of every triangle (nx, ny, nz, cx, cy, cz)
+    std::vector<float> triangles_;
+
+};
+
+#endif // NORMALWEIGHTING_H
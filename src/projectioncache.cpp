@@ -0,0 +1,115 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "projectioncache.h"
+
+ProjectionCache::ProjectionCache(){
+    nVtx_ = 0;
+}
+
+ProjectionCache::~ProjectionCache(){
+}
+
+void ProjectionCache::reset(unsigned int _nCam, unsigned int _nVtx){
+    std::vector<Entry>().swap(entries_);
+    entries_.resize(_nCam);
+    for (unsigned int c = 0; c < _nCam; c++){
+        entries_[c].dense = false;
+    }
+    nVtx_ = _nVtx;
+}
+
+void ProjectionCache::store(unsigned int _c, const std::vector<unsigned int>& _vertices, const float* _uv, const float* _depth){
+
+    Entry& entry = entries_[_c];
+    const size_t n = _vertices.size();
+
+    // A sparse entry takes 16 bytes per vertex stored, a dense one 12 per vertex of the mesh
+    entry.dense = 16 * n >= 12 * (size_t) nVtx_;
+
+    if (entry.dense){
+        std::vector<unsigned int>().swap(entry.vertices);
+        entry.uvd.assign(3 * (size_t) nVtx_, std::numeric_limits<float>::quiet_NaN());
+        for (size_t i = 0; i < n; i++){
+            const size_t slot = _vertices[i];
+            entry.uvd[3 * slot]     = _uv[2 * i];
+            entry.uvd[3 * slot + 1] = _uv[2 * i + 1];
+            entry.uvd[3 * slot + 2] = _depth[i];
+        }
+    } else {
+        entry.vertices = _vertices;
+        std::vector<float> (3 * n).swap(entry.uvd);
+        for (size_t i = 0; i < n; i++){
+            entry.uvd[3 * i]     = _uv[2 * i];
+            entry.uvd[3 * i + 1] = _uv[2 * i + 1];
+            entry.uvd[3 * i + 2] = _depth[i];
+        }
+    }
+}
+
+void ProjectionCache::keep(unsigned int _c, const std::vector<unsigned int>& _vertices){
+
+    std::vector<unsigned int> vertices;
+    std::vector<float> uv, depth;
+    vertices.reserve(_vertices.size());
+    uv.reserve(2 * _vertices.size());
+    depth.reserve(_vertices.size());
+
+    for (size_t i = 0; i < _vertices.size(); i++){
+        Vector2f st;
+        float d;
+        if (find(_c, _vertices[i], st, d)){
+            vertices.push_back(_vertices[i]);
+            uv.push_back(st(0));
+            uv.push_back(st(1));
+            depth.push_back(d);
+        }
+    }
+
+    store(_c, vertices, uv.data(), depth.data());
+}
+
+size_t ProjectionCache::getNProjections() const {
+    size_t n = 0;
+    for (size_t c = 0; c < entries_.size(); c++){
+        if (entries_[c].dense){
+            for (size_t i = 0; i < nVtx_; i++){
+                if (entries_[c].uvd[3 * i + 2] == entries_[c].uvd[3 * i + 2]){
+                    n++;
+                }
+            }
+        } else {
+            n += entries_[c].vertices.size();
+        }
+    }
+    return n;
+}
+
+size_t ProjectionCache::getBytes() const {
+    size_t bytes = 0;
+    for (size_t c = 0; c < entries_.size(); c++){
+        bytes += entries_[c].vertices.capacity() * sizeof(unsigned int) + entries_[c].uvd.capacity() * sizeof(float);
+    }
+    return bytes;
+}
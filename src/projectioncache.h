@@ -0,0 +1,96 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef PROJECTIONCACHE_H
+#define PROJECTIONCACHE_H
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include "triangle.h"
+
+// Projections of the mesh vertices into each camera (uv coordinates and depth), computed
+// once while rating the triangles and reused by every later stage. Each camera keeps only
+// the vertices it needs: in a sorted list when they are few (sparse), or in an array
+// indexed by vertex when they are most of the mesh (dense), whichever takes less memory.
+// Vertex indices refer to the mesh the cache was reset for.
+class ProjectionCache {
+
+public:
+
+    ProjectionCache();
+    virtual ~ProjectionCache();
+
+    // Drops every projection. The mesh has _nVtx vertices and is seen by _nCam cameras
+    void reset(unsigned int _nCam, unsigned int _nVtx);
+
+    // Replaces the projections of camera _c by the ones of the listed vertices, which are given
+    // in increasing order. _uv holds their (u, v) pairs and _depth their depths, in list order
+    void store(unsigned int _c, const std::vector<unsigned int>& _vertices, const float* _uv, const float* _depth);
+    // Drops the projections of camera _c except for the listed vertices (in increasing order)
+    void keep(unsigned int _c, const std::vector<unsigned int>& _vertices);
+
+    // Projection of vertex _v into camera _c. Returns false if it is not in the cache
+    inline bool find(unsigned int _c, unsigned int _v, Vector2f& _uv, float& _depth) const {
+        if (_c >= entries_.size()){
+            return false;
+        }
+        const Entry& entry = entries_[_c];
+        size_t slot = _v;
+        if (!entry.dense){
+            std::vector<unsigned int>::const_iterator it = std::lower_bound(entry.vertices.begin(), entry.vertices.end(), _v);
+            if (it == entry.vertices.end() || *it != _v){
+                return false;
+            }
+            slot = it - entry.vertices.begin();
+        } else if (_v >= nVtx_ || entry.uvd[3 * slot + 2] != entry.uvd[3 * slot + 2]){ // NaN: missing
+            return false;
+        }
+        _uv = Vector2f(entry.uvd[3 * slot], entry.uvd[3 * slot + 1]);
+        _depth = entry.uvd[3 * slot + 2];
+        return true;
+    }
+
+    // Statistics
+    size_t getNProjections() const;
+    size_t getBytes() const;
+
+private:
+
+    struct Entry {
+        bool dense;
+        // Sparse entries: vertices stored, in increasing order
+        std::vector<unsigned int> vertices;
+        // (u, v, depth) triplets, one per listed vertex or, in dense entries, one per
+        // vertex of the mesh (depth is NaN for the ones that are not stored)
+        std::vector<float> uvd;
+    };
+
+    std::vector<Entry> entries_;
+    unsigned int nVtx_;
+
+};
+
+#endif // PROJECTIONCACHE_H
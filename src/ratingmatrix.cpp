@@ -0,0 +1,109 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <algorithm>
+
+#include "ratingmatrix.h"
+
+RatingMatrix::RatingMatrix(){
+    nTri_ = 0;
+}
+
+RatingMatrix::~RatingMatrix(){
+}
+
+void RatingMatrix::reset(unsigned int _nCam, unsigned int _nTri){
+    std::vector<Row>().swap(rows_);
+    rows_.resize(_nCam);
+    nTri_ = _nTri;
+}
+
+void RatingMatrix::store(unsigned int _c, const std::vector<unsigned int>& _triangles, const std::vector<float>& _ratings){
+
+    std::vector<unsigned int> order;
+    order.reserve(_triangles.size());
+    for (unsigned int i = 0; i < _triangles.size(); i++){
+        if (_ratings[i] != 0){
+            order.push_back(i);
+        }
+    }
+    std::sort(order.begin(), order.end(), [&_triangles](unsigned int _a, unsigned int _b){
+        return _triangles[_a] < _triangles[_b];
+    });
+
+    Row& row = rows_[_c];
+    std::vector<unsigned int> (order.size()).swap(row.triangles);
+    std::vector<float> (order.size()).swap(row.ratings);
+    for (unsigned int i = 0; i < order.size(); i++){
+        row.triangles[i] = _triangles[order[i]];
+        row.ratings[i] = _ratings[order[i]];
+    }
+}
+
+void RatingMatrix::compact(unsigned int _c){
+
+    Row& row = rows_[_c];
+    size_t kept = 0;
+    for (size_t i = 0; i < row.triangles.size(); i++){
+        if (row.ratings[i] != 0){
+            row.triangles[kept] = row.triangles[i];
+            row.ratings[kept] = row.ratings[i];
+            kept++;
+        }
+    }
+    if (kept < row.triangles.size()){
+        std::vector<unsigned int> (row.triangles.begin(), row.triangles.begin() + kept).swap(row.triangles);
+        std::vector<float> (row.ratings.begin(), row.ratings.begin() + kept).swap(row.ratings);
+    }
+}
+
+void RatingMatrix::scatter(unsigned int _c, std::vector<float>& _tri_ratings) const {
+    const Row& row = rows_[_c];
+    for (size_t i = 0; i < row.triangles.size(); i++){
+        _tri_ratings[row.triangles[i]] = row.ratings[i];
+    }
+}
+
+void RatingMatrix::clear(unsigned int _c, std::vector<float>& _tri_ratings) const {
+    const Row& row = rows_[_c];
+    for (size_t i = 0; i < row.triangles.size(); i++){
+        _tri_ratings[row.triangles[i]] = 0;
+    }
+}
+
+size_t RatingMatrix::getNPairs() const {
+    size_t n = 0;
+    for (size_t c = 0; c < rows_.size(); c++){
+        n += rows_[c].triangles.size();
+    }
+    return n;
+}
+
+size_t RatingMatrix::getBytes() const {
+    size_t bytes = 0;
+    for (size_t c = 0; c < rows_.size(); c++){
+        bytes += rows_[c].triangles.capacity() * sizeof(unsigned int) + rows_[c].ratings.capacity() * sizeof(float);
+    }
+    return bytes;
+}
@@ -0,0 +1,94 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef RATINGMATRIX_H
+#define RATINGMATRIX_H
+
+#include <vector>
+#include <cstddef>
+
+// Camera-triangle ratings. A camera only rates the triangles it sees, which are a small
+// part of the mesh, so each camera keeps the triangles it rates (rating other than 0) in
+// increasing order, with their ratings next to them. Triangles that are not listed are
+// rated 0. Different cameras can be filled in and changed from different threads.
+class RatingMatrix {
+
+public:
+
+    RatingMatrix();
+    virtual ~RatingMatrix();
+
+    // Drops every rating. The mesh has _nTri triangles and is seen by _nCam cameras
+    void reset(unsigned int _nCam, unsigned int _nTri);
+
+    // Replaces the ratings of camera _c by the given ones, the one of triangle _triangles[i]
+    // being _ratings[i]. Triangles can come in any order, and the ones rated 0 are dropped
+    void store(unsigned int _c, const std::vector<unsigned int>& _triangles, const std::vector<float>& _ratings);
+    // Drops the triangles of camera _c whose rating has been set to 0
+    void compact(unsigned int _c);
+
+    inline unsigned int getNCam() const {
+        return rows_.size();
+    }
+    inline unsigned int getNTri() const {
+        return nTri_;
+    }
+
+    // Triangles rated by camera _c, in increasing order, and their ratings
+    inline size_t getNRated(unsigned int _c) const {
+        return rows_[_c].triangles.size();
+    }
+    inline const unsigned int* getTriangles(unsigned int _c) const {
+        return rows_[_c].triangles.data();
+    }
+    inline const float* getRatings(unsigned int _c) const {
+        return rows_[_c].ratings.data();
+    }
+    inline float* getRatings(unsigned int _c) {
+        return rows_[_c].ratings.data();
+    }
+
+    // Writes the ratings of camera _c into _tri_ratings, which holds one rating per triangle
+    // of the mesh. Only the triangles the camera rates are written, so the rest keep whatever
+    // they had; clear() sets them back to 0, which makes a zeroed array reusable for every camera
+    void scatter(unsigned int _c, std::vector<float>& _tri_ratings) const;
+    void clear(unsigned int _c, std::vector<float>& _tri_ratings) const;
+
+    // Statistics
+    size_t getNPairs() const;
+    size_t getBytes() const;
+
+private:
+
+    struct Row {
+        std::vector<unsigned int> triangles;
+        std::vector<float> ratings;
+    };
+
+    std::vector<Row> rows_;
+    unsigned int nTri_;
+
+};
+
+#endif // RATINGMATRIX_H
@@ -0,0 +1,226 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#include <cstdio>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <sstream>
+#include <iomanip>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ratingstore.h"
+
+// Header of the stored files. It is followed by nCam + 1 offsets (unsigned long long):
+// the rated triangles of camera c are the ones between offsets c and c + 1 of the next
+// two arrays, which hold nPairs triangle indices (unsigned int) and their ratings (float)
+struct StoredRatingsHeader {
+    char magic[8];
+    unsigned long long key;
+    unsigned int nCam, nTri;
+    unsigned long long nPairs;
+};
+
+static const char STORE_MAGIC[8] = {'S','S','M','V','R','A','T','1'};
+
+// 64-bit FNV-1a
+static const unsigned long long FNV_OFFSET = 14695981039346656037ULL;
+
+static inline void hashBytes(unsigned long long& _hash, const void* _data, size_t _bytes){
+    const unsigned char* data = (const unsigned char*) _data;
+    for (size_t i = 0; i < _bytes; i++){
+        _hash ^= data[i];
+        _hash *= 1099511628211ULL;
+    }
+}
+
+RatingStore::RatingStore(const std::string& _directory){
+    directory_ = _directory;
+    if (mkdir(directory_.c_str(), 0755) != 0 && errno != EEXIST){
+        std::cerr << "Rating store " << directory_ << " could not be created" << std::endl;
+    }
+}
+
+RatingStore::~RatingStore(){
+}
+
+unsigned long long RatingStore::computeKey(const Mesh3D& _mesh, const std::vector<Camera>& _cameras, const std::string& _options){
+
+    // The mesh is hashed in blocks, in parallel, and then the hashes of the blocks are hashed
+    const unsigned int nVtx = _mesh.getNVtx();
+    const unsigned int nTri = _mesh.getNTri();
+    const unsigned int block = 1 << 16;
+    const unsigned int nVtxBlocks = (nVtx + block - 1) / block;
+    const unsigned int nTriBlocks = (nTri + block - 1) / block;
+    std::vector<unsigned long long> blockHashes (nVtxBlocks + nTriBlocks, FNV_OFFSET);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (unsigned int b = 0; b < nVtxBlocks + nTriBlocks; b++){
+        unsigned long long& hash = blockHashes[b];
+        if (b < nVtxBlocks){
+            for (unsigned int i = b * block; i < std::min((b + 1) * block, nVtx); i++){
+                hashBytes(hash, _mesh.getVertex(i).data(), 3 * sizeof(float));
+            }
+        } else {
+            const unsigned int first = (b - nVtxBlocks) * block;
+            for (unsigned int i = first; i < std::min(first + block, nTri); i++){
+                hashBytes(hash, _mesh.getTriangle(i).getIndices().data(), 3 * sizeof(int));
+            }
+        }
+    }
+
+    unsigned long long hash = FNV_OFFSET;
+    hashBytes(hash, &nVtx, sizeof(nVtx));
+    hashBytes(hash, &nTri, sizeof(nTri));
+    hashBytes(hash, blockHashes.data(), blockHashes.size() * sizeof(unsigned long long));
+
+    const unsigned int nCam = _cameras.size();
+    hashBytes(hash, &nCam, sizeof(nCam));
+    for (unsigned int c = 0; c < nCam; c++){
+        const Camera& camera = _cameras[c];
+        const Vector2i dim = camera.getImageDim();
+        const Vector2f distortion = camera.getDistortionParams();
+        const int model = camera.getModel();
+        hashBytes(hash, camera.getIntrinsicParam().data(), 9 * sizeof(float));
+        hashBytes(hash, camera.getExtrinsicParam().data(), 9 * sizeof(float));
+        hashBytes(hash, camera.getPosition().data(), 3 * sizeof(float));
+        hashBytes(hash, dim.data(), 2 * sizeof(int));
+        hashBytes(hash, distortion.data(), 2 * sizeof(float));
+        hashBytes(hash, &model, sizeof(model));
+    }
+
+    hashBytes(hash, _options.data(), _options.size());
+    return hash;
+}
+
+std::string RatingStore::storedFileName(unsigned long long _key) const {
+    std::stringstream name;
+    name << directory_ << "/" << std::hex << std::setw(16) << std::setfill('0') << _key << ".rat";
+    return name.str();
+}
+
+bool RatingStore::load(unsigned long long _key, RatingMatrix& _ratings) const {
+
+    const std::string storedName = storedFileName(_key);
+    const int fd = open(storedName.c_str(), O_RDONLY);
+    if (fd < 0){
+        return false;
+    }
+
+    const unsigned int nCam = _ratings.getNCam();
+    const unsigned int nTri = _ratings.getNTri();
+
+    struct stat info;
+    StoredRatingsHeader header;
+    if (fstat(fd, &info) != 0 || read(fd, &header, sizeof(header)) != (ssize_t) sizeof(header)
+        || memcmp(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC)) != 0
+        || header.key != _key || header.nCam != nCam || header.nTri != nTri
+        || (size_t) info.st_size != sizeof(header) + (nCam + 1) * sizeof(unsigned long long)
+                                    + header.nPairs * (sizeof(unsigned int) + sizeof(float))){
+        close(fd);
+        return false;
+    }
+
+    const size_t length = info.st_size;
+    void* address = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED){
+        return false;
+    }
+
+    const unsigned long long* offsets = (const unsigned long long*) ((const char*) address + sizeof(header));
+    const unsigned int* triangles = (const unsigned int*) (offsets + nCam + 1);
+    const float* ratings = (const float*) (triangles + header.nPairs);
+
+    // Nothing is filled in unless the whole file makes sense
+    bool valid = offsets[0] == 0 && offsets[nCam] == header.nPairs;
+    for (unsigned int c = 0; c < nCam && valid; c++){
+        valid = offsets[c] <= offsets[c + 1];
+    }
+    for (unsigned long long i = 0; i < header.nPairs && valid; i++){
+        valid = triangles[i] < nTri;
+    }
+
+    if (valid){
+        #pragma omp parallel for
+        for (unsigned int c = 0; c < nCam; c++){
+            const std::vector<unsigned int> camTriangles (triangles + offsets[c], triangles + offsets[c + 1]);
+            const std::vector<float> camRatings (ratings + offsets[c], ratings + offsets[c + 1]);
+            _ratings.store(c, camTriangles, camRatings);
+        }
+    }
+
+    munmap(address, length);
+    return valid;
+}
+
+void RatingStore::save(unsigned long long _key, const RatingMatrix& _ratings) const {
+
+    const unsigned int nCam = _ratings.getNCam();
+    const unsigned int nTri = _ratings.getNTri();
+
+    std::vector<unsigned long long> offsets (nCam + 1, 0);
+    for (unsigned int c = 0; c < nCam; c++){
+        offsets[c + 1] = offsets[c] + _ratings.getNRated(c);
+    }
+
+    StoredRatingsHeader header;
+    memcpy(header.magic, STORE_MAGIC, sizeof(STORE_MAGIC));
+    header.key = _key;
+    header.nCam = nCam;
+    header.nTri = nTri;
+    header.nPairs = offsets[nCam];
+
+    // Other processes may be filling the store at the same time
+    const std::string storedName = storedFileName(_key);
+    std::stringstream tempName;
+    tempName << storedName << ".tmp" << getpid();
+
+    FILE* file = fopen(tempName.str().c_str(), "wb");
+    if (file == NULL){
+        std::cerr << "Rating store: " << tempName.str() << " could not be written" << std::endl;
+        return;
+    }
+
+    // The rows of every camera are already in the order of the file: all the
+    // triangles, one camera after another, and then all the ratings
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+           && fwrite(offsets.data(), sizeof(unsigned long long), offsets.size(), file) == offsets.size();
+    for (unsigned int c = 0; c < nCam && ok; c++){
+        ok = fwrite(_ratings.getTriangles(c), sizeof(unsigned int), _ratings.getNRated(c), file) == _ratings.getNRated(c);
+    }
+    for (unsigned int c = 0; c < nCam && ok; c++){
+        ok = fwrite(_ratings.getRatings(c), sizeof(float), _ratings.getNRated(c), file) == _ratings.getNRated(c);
+    }
+
+    if (fclose(file) != 0 || !ok || rename(tempName.str().c_str(), storedName.c_str()) != 0){
+        std::cerr << "Rating store: " << storedName << " could not be written" << std::endl;
+        remove(tempName.str().c_str());
+    }
+}
@@ -0,0 +1,72 @@
+/* 
+ *  Copyright (c) 2017  Rafael Pagés
+ *
+ *  This file is part of SSMVtex
+ *
+ *  Permission is hereby granted, free of charge, to any person obtaining a copy
+ *  of this software and associated documentation files (the "Software"), to deal
+ *  in the Software without restriction, including without limitation the rights
+ *  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+ *  of the Software, and to permit persons to whom the Software is furnished to do
+ *  so, subject to the following conditions:
+ *
+ *  The above copyright notice and this permission notice shall be included in all
+ *  copies or substantial portions of the Software.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR 
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ *  FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ *  COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ *  IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+ *  WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+
+#ifndef RATINGSTORE_H
+#define RATINGSTORE_H
+
+#include <string>
+#include <vector>
+
+#include "mesh3d.h"
+#include "camera.h"
+#include "ratingmatrix.h"
+
+// On-disk store of camera-triangle ratings, so runs that only change what comes after
+// them (atlas size, --alpha/--beta, output format...) do not have to evaluate them again.
+// The ratings are saved in a file named after a hash of everything they depend on: the
+// mesh (after any subdivision), the cameras and the options used to rate them. Only the
+// triangles each camera rates are stored, and stored files are memory-mapped.
+class RatingStore {
+
+public:
+
+    // The directory is created if it does not exist
+    RatingStore(const std::string& _directory);
+    virtual ~RatingStore();
+
+    // Key of the ratings of _mesh as seen from _cameras. _options has to
+    // describe every other setting the ratings depend on
+    static unsigned long long computeKey(const Mesh3D& _mesh, const std::vector<Camera>& _cameras, const std::string& _options);
+
+    // Replaces _ratings, which has been reset for the cameras and triangles of the key, by
+    // the ones stored for _key. Returns false, leaving them as they were, if they are not stored
+    bool load(unsigned long long _key, RatingMatrix& _ratings) const;
+
+    // Writes the ratings for _key (through a temporary file and a rename)
+    void save(unsigned long long _key, const RatingMatrix& _ratings) const;
+
+    inline const std::string& getDirectory() const {
+        return directory_;
+    }
+
+private:
+
+    std::string storedFileName(unsigned long long _key) const;
+
+    std::string directory_;
+
+};
+
+#endif // RATINGSTORE_H
@@ -685,100 +685,37 @@ void Unwrapper::unwrapSplats(const Mesh3D& _mesh, std::vector<Chart>& _charts){
 }
 
 
-// This method is too trivial and probably very time consuming,
-// something more efficient should be implemented.
 void Unwrapper::findTriangleNeighbors(const Mesh3D& _mesh, std::vector<size_t>& _adj_count, std::vector<int>& _triNeighbor)
 {
     const size_t nTri = _mesh.getNTri();
-    const size_t nVtx = _mesh.getNVtx();
 
-	// which triangles contain each vertex
-    std::vector<size_t> *vtx2tri = new std::vector<size_t> [nVtx];
-    // #pragma omp parallel for
+    // The mesh normally comes with its topology
+    MeshTopology ownTopology;
+    if (!_mesh.getTopology().isBuilt()){
+        ownTopology.build(_mesh.getTriangles(), _mesh.getNVtx());
+    }
+    const MeshTopology& topology = _mesh.getTopology().isBuilt() ? _mesh.getTopology() : ownTopology;
+
+    // Neighbors across the edges of each triangle, each of them listed once
+    #pragma omp parallel for
     for (size_t i = 0; i < nTri; ++i)
     {
-    	const Triangle& thistri = _mesh.getTriangle(i);
         for (size_t j = 0; j < 3; ++j)
         {
-            vtx2tri[thistri.getIndex(j)].push_back(i);
-        }
-    }
-
-    for(size_t i = 0; i < nVtx; i++){
-        std::vector<size_t>::iterator ita = vtx2tri[i].begin();
-
-        for(; ita != vtx2tri[i].end(); ++ita){
-            std::vector<size_t>::iterator itb = vtx2tri[i].begin();
-
-            for(; itb != vtx2tri[i].end(); ++itb){
-
-            	// in case both iterators are pointing to the same triangle
-                if ((*ita)==(*itb))
-                    continue;
+            const unsigned int neighbor = topology.getNeighbor(i, j);
+            if (neighbor == MeshTopology::NONE || neighbor == i)
+                continue;
 
-                // Variables needed for the identification of adjacent triangles
-                int va0, va1, va2;
-                int vb0, vb1, vb2;
-
-                va0 = _mesh.getTriangle(*ita).getIndex(0);
-                va1 = _mesh.getTriangle(*ita).getIndex(1);
-                va2 = _mesh.getTriangle(*ita).getIndex(2);
-                vb0 = _mesh.getTriangle(*itb).getIndex(0);
-                vb1 = _mesh.getTriangle(*itb).getIndex(1);
-                vb2 = _mesh.getTriangle(*itb).getIndex(2);
-
-
-                // In case an edge of each triangle is the same
-                if ((((va0==vb0)||(va0==vb1)||(va0==vb2))&&((va1==vb0)||(va1==vb1)||(va1==vb2)))||
-                    (((va0==vb0)||(va0==vb1)||(va0==vb2))&&((va2==vb0)||(va2==vb1)||(va2==vb2)))||
-                    (((va2==vb0)||(va2==vb1)||(va2==vb2))&&((va1==vb0)||(va1==vb1)||(va1==vb2)))) {
-
-                    // The values number of adj triangles is updated
-                    // for both pointed triangles and the neighbor
-                    // triangle index as well
-
-                    // case it-A
-                    switch (_adj_count[*ita]){
-                    case 0:
-                        _triNeighbor[3*(*ita)] = *itb;
-                        _adj_count[*ita] = 1;
-                        break;
-                    case 1:
-                        if (_triNeighbor[3*(*ita)] != *itb){
-                            _triNeighbor[3*(*ita)+1] = *itb;
-                            _adj_count[*ita] = 2;
-                        }
-                        break;
-                    case 2:
-                        if ((_triNeighbor[3*(*ita)] != *itb) && (_triNeighbor[3*(*ita)+1] != *itb)){
-                            _triNeighbor[3*(*ita)+2] = *itb;
-                            _adj_count[*ita] = 3;
-                        }
-                    }
+            bool listed = false;
+            for (size_t k = 0; k < _adj_count[i]; ++k)
+                listed = listed || (_triNeighbor[3*i+k] == (int) neighbor);
 
-                    // case it-B
-                    switch (_adj_count[*itb]){
-                    case 0:
-                        _triNeighbor[3*(*itb)] = *ita;
-                        _adj_count[*itb] = 1;
-                        break;
-                    case 1:
-                        if (_triNeighbor[3*(*itb)] != *ita){
-                            _triNeighbor[3*(*itb)+1] = *ita;
-                            _adj_count[*itb] = 2;
-                        }
-                        break;
-                    case 2:
-                        if ((_triNeighbor[3*(*itb)] != *ita) && (_triNeighbor[3*(*itb)+1] != *ita)){
-                            _triNeighbor[3*(*itb)+2] = *ita;
-                            _adj_count[*itb] = 3;
-                        }
-                    }
-                }
+            if (!listed){
+                _triNeighbor[3*i+_adj_count[i]] = neighbor;
+                _adj_count[i]++;
             }
         }
     }
-    delete [] vtx2tri;
 
 }
 